@@ -37,6 +37,7 @@
 #include "crouton/io/HTTPConnection.hh"
 #include "crouton/io/HTTPHandler.hh"
 #include "crouton/io/ISocket.hh"
+#include "crouton/io/MemoryStream.hh"
 #include "crouton/io/Process.hh"
 #include "crouton/io/URL.hh"
 #include "crouton/io/WebSocket.hh"
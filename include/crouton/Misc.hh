@@ -24,4 +24,10 @@ namespace crouton {
     /// Writes cryptographically-secure random bytes to the destination buffer.
     void Randomize(void* buf, size_t len);
 
+    /// Writes unpredictable random bytes to the destination buffer, from a per-thread ChaCha20
+    /// generator that's seeded by `Randomize`. It's much faster than `Randomize` for small
+    /// amounts, since it doesn't make a system call each time. Use it for things like WebSocket
+    /// mask keys and nonces, but prefer `Randomize` for long-lived secrets like keys.
+    void FastRandomize(void* buf, size_t len);
+
 }
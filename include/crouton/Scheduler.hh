@@ -46,6 +46,9 @@ namespace crouton {
 
         bool isEmpty() const;
 
+        /// The number of coroutines ready to run; a measure of how far behind the thread is.
+        size_t readyCount() const                       {return _ready.size();}
+
         /// Returns true if there are no coroutines ready or suspended, except possibly for the one
         /// belonging to the EventLoop. Checked at the end of unit tests.
         bool assertEmpty();
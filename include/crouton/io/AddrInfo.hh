@@ -18,6 +18,8 @@
 
 #pragma once
 #include "crouton/CroutonFwd.hh"
+#include <atomic>
+#include <vector>
 
 #ifdef ESP_PLATFORM
     struct ip_addr;
@@ -28,7 +30,10 @@
 
 namespace crouton::io {
 
-    /** An asynchronous DNS lookup. */
+    /** An asynchronous DNS lookup.
+        Results are kept in a process-wide cache, keyed by hostname, port and address family.
+        Concurrent lookups of the same name share one query, and a result that's gone stale is
+        still returned for a while, while a new query refreshes it in the background. */
     class AddrInfo {
     public:
 #ifdef ESP_PLATFORM
@@ -38,7 +43,34 @@ namespace crouton::io {
 #endif
 
         /// Does a DNS lookup of the given hostname, returning an AddrInfo or an error.
-        staticASYNC<AddrInfo> lookup(string hostname, uint16_t port =0);
+        /// `family` may be AF_INET or AF_INET6 (or 4 or 6) to look up only that kind of address;
+        /// the default 0 means either.
+        staticASYNC<AddrInfo> lookup(string hostname, uint16_t port =0, int family =0);
+
+        /// Settings of the DNS cache.
+        struct CacheOptions {
+            double ttl          = 60;   ///< Seconds a successful result is used for
+            double negativeTTL  = 5;    ///< Seconds a "host not found" result is used for
+            double staleTTL     = 300;  ///< Seconds after `ttl` that a result is still returned,
+                                        ///< while it's refreshed in the background
+            size_t maxEntries   = 256;  ///< Max number of cached results; 0 disables the cache
+        };
+
+        static void setCacheOptions(CacheOptions const&);
+
+        /// Forgets all cached results.
+        static void clearCache();
+
+        /// Counts of the DNS cache's activity.
+        struct CacheStats {
+            std::atomic<uint64_t> lookups = 0;      ///< Calls to `lookup`
+            std::atomic<uint64_t> hits = 0;         ///< Lookups answered from the cache
+            std::atomic<uint64_t> staleHits = 0;    ///< Hits on stale results (also in `hits`)
+            std::atomic<uint64_t> coalesced = 0;    ///< Lookups that waited for another's query
+            std::atomic<uint64_t> queries = 0;      ///< Queries sent to the resolver
+        };
+
+        static CacheStats const& cacheStats();
 
         /// Returns the primary address, which may be either IPv4 or IPv6.
         RawAddress const& primaryAddress() const;
@@ -51,18 +83,19 @@ namespace crouton::io {
         /// The primary address converted to a numeric string.
         string primaryAddressString() const;
 
+        /// Returns all the addresses, of both families, in the order the resolver prefers them.
+        std::vector<RawAddress const*> allAddresses() const;
+
     private:
 #ifdef ESP_PLATFORM
         using addrinfo = ::ip_addr;
-        using deleter = std::default_delete<addrinfo>;
 #else
         using addrinfo = ::addrinfo;
-        struct deleter { void operator() (addrinfo*); };
 #endif
 
-        explicit AddrInfo(addrinfo*);
+        explicit AddrInfo(std::shared_ptr<addrinfo> info)   :_info(std::move(info)) { }
 
-        std::unique_ptr<addrinfo,deleter> _info;
+        std::shared_ptr<addrinfo> _info;    // Shared with the cache, and with copies
     };
 
 }
@@ -0,0 +1,127 @@
+//
+// AdmissionController.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/EventLoop.hh"
+
+#include <chrono>
+#include <unordered_map>
+
+namespace crouton::io {
+
+    /** Decides whether a server has capacity for more work, so that when it's overloaded it can
+        quickly turn away new connections and requests, instead of accepting everything and
+        making every client wait.
+
+        It measures the event loop's lag (how late a periodic timer fires) and the length of
+        the Scheduler's ready queue, and also enforces limits on the number of connections and
+        of requests being handled at once, overall or per group (e.g. per HTTP route.)
+
+        A `TCPServer` given an AdmissionController closes new connections while it's overloaded,
+        and an `http::Handler` responds to requests with 503 (Service Unavailable).
+
+        An AdmissionController is not thread-safe; it must only be used on the thread that
+        created it. */
+    class AdmissionController {
+    public:
+        struct Options {
+            size_t maxConnections = 0;      ///< Max open connections (0 means no limit)
+            size_t maxRequests    = 0;      ///< Max requests handled at once (0 means no limit)
+            double maxLag         = 0.1;    ///< Loop lag in seconds that counts as overload
+            size_t maxReady       = 0;      ///< Ready coroutines that count as overload (or 0)
+            double sampleInterval = 0.05;   ///< How often to measure the lag, in seconds
+        };
+
+        struct Stats {
+            uint64_t acceptedConnections = 0;
+            uint64_t refusedConnections = 0;
+            uint64_t admittedRequests = 0;
+            uint64_t rejectedRequests = 0;
+        };
+
+        /// Holds a slot for a connection or request; the slot is released when it's destructed.
+        /// A Ticket for a rejected request is empty, i.e. it tests as false; so is one that's
+        /// been moved from.
+        class Ticket {
+        public:
+            Ticket() = default;
+            Ticket(Ticket&& t) noexcept     {*this = std::move(t);}
+            Ticket& operator=(Ticket&&) noexcept;
+            ~Ticket()                       {release();}
+
+            explicit operator bool() const noexcept Pure    {return _admitted;}
+
+            /// Releases the slot early.
+            void release() noexcept;
+
+        private:
+            friend class AdmissionController;
+            Ticket(size_t* count, size_t* groupCount) noexcept;
+
+            size_t* _count = nullptr;
+            size_t* _groupCount = nullptr;
+            bool    _admitted = false;
+        };
+
+        AdmissionController()               :AdmissionController(Options{}) { }
+        explicit AdmissionController(Options const&);
+
+        /// True if the loop lag or the ready queue is over its limit.
+        bool overloaded() const noexcept Pure;
+
+        /// The current estimate of the event loop's lag, in seconds.
+        double lag() const noexcept Pure                {return _lag;}
+
+        /// The number of open connections (that have Tickets.)
+        size_t connections() const noexcept Pure        {return _connections;}
+
+        /// The number of requests being handled.
+        size_t requests() const noexcept Pure           {return _requests;}
+
+        Stats const& stats() const noexcept Pure        {return _stats;}
+
+        /// Called by a server when a client connects; returns false if the connection should be
+        /// closed right away, because of overload or the connection limit.
+        bool shouldAccept();
+
+        /// Returns a Ticket that counts an open connection until it's released.
+        Ticket connection();
+
+        /// Asks to handle a request. Returns an empty Ticket if the server is overloaded, or
+        /// if `maxRequests` requests, or `groupLimit` requests in the same group, are already
+        /// being handled.
+        /// @param group  Identifies a group of requests, such as a route; or nullptr
+        /// @param groupLimit  Max requests in the group handled at once (0 means no limit)
+        Ticket admitRequest(void const* group = nullptr, size_t groupLimit = 0);
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        void sample();
+
+        Options                 _options;
+        Stats                   _stats;
+        Timer                   _timer;
+        Clock::time_point       _lastSample;
+        double                  _lag = 0;
+        size_t                  _connections = 0;
+        size_t                  _requests = 0;
+        std::unordered_map<void const*, size_t> _groupRequests;
+    };
+
+}
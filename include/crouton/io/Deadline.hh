@@ -0,0 +1,74 @@
+//
+// Deadline.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/CroutonFwd.hh"
+
+#include <chrono>
+#include <functional>
+
+namespace crouton::io {
+
+    /** A coarse-grained timeout that calls a function when it expires, meant for things like
+        network connections that need several deadlines per request.
+
+        Instead of each having its own Timer, all Deadlines on a thread are checked by a single
+        periodic tick, every `kResolution` seconds, which only runs while any Deadline is set.
+        So setting, moving or clearing a Deadline is very cheap; the tradeoff is that it may
+        fire up to `kResolution` seconds late.
+
+        A Deadline must be used only on the thread that created it. */
+    class Deadline {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr double kResolution = 0.25;     ///< Seconds between checks
+
+        /// Constructs an unset Deadline that will call `fn` when it expires.
+        explicit Deadline(std::function<void()> fn);
+        ~Deadline()                             {clear();}
+
+        /// Sets the Deadline to expire `secs` seconds from now. A value <= 0 clears it.
+        void set(double secs);
+
+        /// Sets the Deadline to expire at a specific time.
+        void setAt(Clock::time_point);
+
+        /// Clears the Deadline, so it won't expire.
+        void clear() noexcept;
+
+        /// True if the Deadline is set.
+        bool isSet() const noexcept Pure        {return _next != this;}
+
+        /// The time at which the Deadline will expire, if it's set.
+        Clock::time_point when() const noexcept Pure   {return _when;}
+
+    private:
+        friend struct DeadlineList;
+        Deadline(Deadline const&) = delete;
+        Deadline& operator=(Deadline const&) = delete;
+        void link(Deadline* head) noexcept;
+        void unlink() noexcept;
+
+        std::function<void()>   _fn;
+        Clock::time_point       _when;
+        Deadline*               _prev = this;   // Links in the thread's list of set Deadlines
+        Deadline*               _next = this;
+    };
+
+}
@@ -0,0 +1,127 @@
+//
+// HTTPCompression.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/util/Bytes.hh"
+#include <memory>
+#include <optional>
+
+// HTTP compression uses zlib. If it's not available the build defines `CROUTON_USE_ZLIB` as `0`,
+// and then no compressed encodings are offered or accepted.
+#ifndef CROUTON_USE_ZLIB
+#  if __has_include(<zlib.h>)
+#    define CROUTON_USE_ZLIB 1
+#  else
+#    define CROUTON_USE_ZLIB 0
+#  endif
+#endif
+
+struct z_stream_s;
+
+namespace crouton::io::http {
+
+    /// The HTTP body encodings supported by `Content-Encoding` and `Accept-Encoding`.
+    enum class ContentEncoding : uint8_t {
+        Identity,       ///< Not encoded
+        Deflate,        ///< "deflate", i.e. zlib format (RFC 1950)
+        Gzip,           ///< "gzip" format (RFC 1952)
+    };
+
+    /// The name of an encoding as it appears in a header.
+    Pure string_view encodingName(ContentEncoding) noexcept;
+
+    /// Parses a `Content-Encoding` header value. An empty value is Identity.
+    /// Returns nullopt if the encoding isn't supported.
+    Pure std::optional<ContentEncoding> parseContentEncoding(string_view) noexcept;
+
+    /// Picks the preferred encoding allowed by an `Accept-Encoding` header value,
+    /// or Identity if none are.
+    Pure ContentEncoding negotiateEncoding(string_view acceptEncoding) noexcept;
+
+    /// True if a MIME type, the value of a `Content-Type` header, is worth compressing:
+    /// text, JSON, XML or JavaScript. Media and archive types are already compressed.
+    Pure bool isCompressibleType(string_view contentType) noexcept;
+
+
+    /** Streaming compressor that produces a deflate or gzip encoded body.
+
+        Deflate state is large (~256KB), so instead of being created and destroyed for every
+        response, Deflaters are kept in a small per-thread cache and reset between streams.
+        Get one with `Deflater::get`; it goes back to the cache when the Ref is destroyed. */
+    class Deflater {
+    public:
+        struct Recycler { void operator()(Deflater*) const noexcept; };
+        using Ref = std::unique_ptr<Deflater,Recycler>;
+
+        /// Returns a Deflater ready to compress a new stream.
+        /// @param encoding  Deflate or Gzip.
+        /// @param level  zlib compression level, from 1 (fastest) to 9 (smallest).
+        static Ref get(ContentEncoding encoding, int level);
+
+        /// Compresses `input`, appending any output to `output`.
+        /// If `flush` is true, all the input is flushed to the output so the peer can decode
+        /// it right away, at some cost in compression.
+        void write(ConstBytes input, string& output, bool flush = false);
+
+        /// Ends the stream, appending the remaining output to `output`.
+        void finish(string& output);
+
+        ~Deflater();
+
+    private:
+        Deflater(ContentEncoding, int level);
+        void compress(ConstBytes input, string& output, int flush);
+
+        std::unique_ptr<z_stream_s> _z;
+        ContentEncoding             _encoding;
+        int                         _level;
+    };
+
+
+    /** Streaming decompressor for a deflate or gzip encoded body.
+        Like Deflater, instances are cached per thread. */
+    class Inflater {
+    public:
+        struct Recycler { void operator()(Inflater*) const noexcept; };
+        using Ref = std::unique_ptr<Inflater,Recycler>;
+
+        /// Returns an Inflater ready to decompress a new stream.
+        static Ref get();
+
+        /// Decompresses from `input` into `output`, until one is used up or the stream ends.
+        /// `input` is advanced past the bytes consumed.
+        /// Returns the number of bytes written to `output`.
+        /// @throws CroutonError::ParseError if the data is invalid.
+        size_t write(ConstBytes& input, MutableBytes output);
+
+        /// True once any input has been decompressed.
+        bool started() const noexcept Pure;
+
+        /// True when the end of the compressed stream has been reached.
+        bool finished() const noexcept Pure         {return _finished;}
+
+        ~Inflater();
+
+    private:
+        Inflater();
+
+        std::unique_ptr<z_stream_s> _z;
+        bool                        _finished = false;
+    };
+
+}
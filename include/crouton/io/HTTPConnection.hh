@@ -17,6 +17,7 @@
 //
 
 #pragma once
+#include "crouton/io/HTTPCompression.hh"
 #include "crouton/io/HTTPParser.hh"
 #include "crouton/io/IStream.hh"
 #include "crouton/Future.hh"
@@ -71,7 +72,8 @@ namespace crouton::io::http {
     };
 
 
-    /** The response received from an outgoing HTTPRequest. */
+    /** The response received from an outgoing HTTPRequest.
+        If the body has a gzip or deflate `Content-Encoding`, it's decompressed as it's read. */
     class Response : public IStream {
     public:
         explicit Response(Connection&);
@@ -82,12 +84,12 @@ namespace crouton::io::http {
         Status status() const noexcept Pure                 {return _parser.status;}
 
         /// The HTTP status message.
-        string const& statusMessage() const noexcept Pure   {return _parser.statusMessage;}
+        string_view statusMessage() const noexcept Pure     {return _parser.statusMessage;}
 
         /// The response headers.
         Headers const& headers() const noexcept Pure        {return _parser.headers;}
 
-        ASYNC<void> open() override             {return _parser.readHeaders();}
+        ASYNC<void> open() override;
         bool isOpen() const override            {return _parser.status != Status::Unknown;}
         ASYNC<void> close() override;
         ASYNC<void> closeWrite() override;
@@ -102,10 +104,17 @@ namespace crouton::io::http {
         IStream& upgradedStream();
 
     private:
-        Connection* _connection;
-        Parser      _parser;
-        string      _buf;
-        size_t      _bufUsed = 0;
+        ASYNC<void> fillBuffer();
+
+        static constexpr size_t kInflateBufferSize = 16384;
+
+        Connection*   _connection;
+        Parser        _parser;
+        string        _buf;                 // Body data ready to be read
+        size_t        _bufUsed = 0;         // Number of bytes of _buf already read
+        Inflater::Ref _inflater;            // Decompresses the body, if it's encoded
+        string        _encoded;             // Encoded body data read from the parser
+        size_t        _encodedUsed = 0;     // Number of bytes of _encoded decompressed
     };
 
 }
@@ -0,0 +1,70 @@
+//
+// HTTPFileHandler.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/io/HTTPHandler.hh"
+
+namespace crouton::io::http {
+
+    /// A Handler function that serves static files from a directory.
+    ///
+    /// Use it in a Route whose path ends with a `*` parameter, whose value is the path of the
+    /// file relative to the root directory:
+    /// ```
+    /// {Method::GET,  "/static/*path", FileHandler("/var/www")},
+    /// {Method::HEAD, "/static/*path", FileHandler("/var/www")},
+    /// ```
+    /// - Responses have `ETag` and `Last-Modified` headers; a request with a matching
+    ///   `If-None-Match` or `If-Modified-Since` gets a 304 (Not Modified) response.
+    /// - A request with a single-range `Range` header gets a 206 (Partial Content) response.
+    /// - File data is written with `Response::writeFile`, i.e. with `sendfile` when possible.
+    /// - Recently served files are kept open, along with their metadata, so serving a popular
+    ///   file doesn't touch the filesystem except to check every so often whether it changed.
+    ///
+    /// FileHandler objects are cheap to copy, and copies share a cache.
+    ///
+    /// @note  It's built on FileStream and the `fs` functions, so it requires libuv; it's not
+    ///        available on ESP32.
+    class FileHandler {
+    public:
+        struct Options {
+            string   paramName      = "path";       ///< Route parameter with the relative path
+            string   indexFile      = "index.html"; ///< File to serve for a directory, if any
+            string   cacheControl;                  ///< `Cache-Control` header value, if any
+            size_t   maxCachedFiles = 64;           ///< Max number of open files to cache
+            unsigned revalidateMS   = 1000;         ///< How often to check a cached file
+        };
+
+        /// Constructs a FileHandler that serves files from the directory `root`.
+        explicit FileHandler(string root)          :FileHandler(std::move(root), Options{}) { }
+        FileHandler(string root, Options);
+
+        /// Handles a request. (This makes FileHandler usable as a `Handler::HandlerFunction`.)
+        ASYNC<void> operator() (Handler::Request const&, Handler::Response&) const;
+
+        /// The MIME type for a filename's extension, or "application/octet-stream".
+        static string_view contentTypeFor(string_view filename);
+
+    private:
+        struct Entry;
+        struct Cache;
+
+        std::shared_ptr<Cache> _cache;
+    };
+
+}
@@ -17,28 +17,104 @@
 //
 
 #pragma once
+#include "crouton/io/AdmissionController.hh"
+#include "crouton/io/Deadline.hh"
+#include "crouton/io/HTTPCompression.hh"
 #include "crouton/io/HTTPParser.hh"
+#include "crouton/io/HTTPResponseCache.hh"
 #include "crouton/io/IStream.hh"
 #include "crouton/Task.hh"
 
+#include <array>
+#include <atomic>
 #include <functional>
+#include <optional>
 #include <regex>
+#include <span>
 #include <vector>
 
+namespace crouton::io {
+    class FileStream;
+}
 namespace crouton::io::http {
+    class Router;
+
+
+    /** Path parameters captured from a request by a Route pattern like `/users/:id`.
+        The names and values point into the Route and the request URI respectively,
+        so they're only valid during the call to the HandlerFunction. */
+    class PathParams {
+    public:
+        static constexpr size_t kMaxParams = 8;
+
+        size_t size() const noexcept Pure               {return _count;}
+        bool empty() const noexcept Pure                {return _count == 0;}
+
+        /// Returns the value of a parameter, or an empty string if there's none by that name.
+        /// @note  The value is not URL-unescaped.
+        string_view get(string_view name) const noexcept Pure;
+        string_view operator[] (string_view name) const noexcept Pure   {return get(name);}
+
+        /// Returns the value of a parameter parsed as an integer, or nullopt if it's missing
+        /// or not numeric.
+        std::optional<int64_t> getInt(string_view name) const noexcept Pure;
+
+        /// Adds a parameter. Returns false if there's no room.
+        bool add(string_view name, string_view value) noexcept;
+
+        /// Removes all parameters after the first `n`.
+        void truncate(size_t n) noexcept                {if (n < _count) _count = uint8_t(n);}
+
+    private:
+        std::array<std::pair<string_view,string_view>, kMaxParams> _items;
+        uint8_t _count = 0;
+    };
+
+
+    /** A precomputed, serialized block of HTTP response headers, for headers that are the same
+        in many responses. It's formatted once, and then sent as-is by every response that uses it.
+        @note  A HeaderBlock must remain valid until all responses using it have been sent,
+               so it's usually a static or otherwise long-lived object. */
+    class HeaderBlock {
+    public:
+        HeaderBlock(std::initializer_list<Headers::Entry>);
+        explicit HeaderBlock(Headers const&);
+
+        /// The serialized headers, each line ending with CRLF.
+        string_view data() const noexcept Pure      {return _data;}
+
+        /// True if the block contains a header with this name. (Case-insensitive.)
+        bool contains(string_view name) const noexcept Pure {return find(name) != string::npos;}
+
+        /// Returns the value of a header, or an empty string if it's missing. (Case-insensitive.)
+        string_view get(string_view name) const noexcept Pure;
+
+    private:
+        void add(string_view name, string_view value);
+        size_t find(string_view name) const noexcept Pure;
+
+        string _data;
+    };
+
 
     /** An HTTP server's connection to a client,
-        from which it will read a request and send a response.
-        @note  It does not support keep-alive, so it closes the socket after one response. */
+        from which it will read requests and send responses.
+
+        If the client requests keep-alive, the connection stays open for another request as long
+        as each response has a `Content-Length` header; otherwise the socket is closed after the
+        response. Pipelined requests are not supported. */
     class Handler {
     public:
 
         /// An HTTP request as sent to a HandlerFunction function.
+        /// Its strings belong to the Handler's per-request arena, so they're only valid during
+        /// the call to the HandlerFunction.
         struct Request {
             Method  method = Method::GET;   ///< The request method
-            URL         uri;                        ///< The request URI (path + query.)
-            Headers headers;                    ///< The request headers.
+            URLRef         uri;                     ///< The request URI (path + query.)
+            Headers const& headers;                 ///< The request headers.
             string body;                       ///< The request body.
+            PathParams params;                  ///< Parameters captured by the Route's path
         };
 
 
@@ -51,51 +127,201 @@ namespace crouton::io::http {
             /// Adds a response header.
             void writeHeader(string_view name, string_view value);
 
+            /// Adds a precomputed block of response headers. This is cheaper than calling
+            /// `writeHeader` for each one, since they're already formatted.
+            /// @note  Headers in the block are not checked for duplicates of other headers.
+            void writeHeaders(HeaderBlock const&);
+
             /// Writes to the body. After this you can't call writeHeader any more.
             ASYNC<void> writeToBody(string);
 
+            /// Writes `length` bytes of an open file, starting at `offset`, to the body.
+            /// When possible the data goes directly from the file to the socket with `sendfile`,
+            /// without being copied through memory. The body is not compressed.
+            ASYNC<void> writeFile(FileStream&, uint64_t offset, uint64_t length);
+
             /// The socket's stream. Only use this when bypassing HTTP, e.g. for WebSockets.
             ASYNC<IStream*> rawStream();
 
         private:
             friend class Handler;
             Response(Handler*, Headers&&);
+            string_view getHeader(string_view name) const;
+            void startBody(size_t firstWriteSize);
             ASYNC<void> finishHeaders();
+            ASYNC<void> finish();
+
+            static constexpr size_t kMaxHeaderBlocks = 4;
 
             Handler* _handler;
             Headers  _headers;
+            std::array<HeaderBlock const*, kMaxHeaderBlocks> _headerBlocks;
+            uint8_t      _nHeaderBlocks = 0;
+            bool         _startedBody = false;
             bool         _sentHeaders = false;
+            Deflater::Ref _deflater;            // Compresses the body, if enabled
+            std::optional<string> _compressedBody; // Compressed body, when awaiting its length
         };
 
 
         /// A function that handles a request, writing a response.
         using HandlerFunction = std::function<Future<void>(Request const&, Response&)>;
 
-        /// An HTTP method and path regex, with the function that should be called.
+        /** An HTTP method and path pattern, with the function that should be called.
+
+            The path pattern is matched literally except for parameters, which each match
+            a single path component and are captured into `Request::params`:
+            - `:name` matches any non-empty component, e.g. `/users/:id`.
+            - `:name<int>` matches only a decimal integer, e.g. `/users/:id<int>/posts`.
+            - `*name` at the end of the pattern matches the entire rest of the path.
+
+            As an escape hatch, a Route can instead be given a `std::regex` that must match the
+            entire path. Regex routes are much slower, and are only tried if no pattern matches.
+
+            If the Handler has an AdmissionController, `maxConcurrent` limits how many requests
+            to the Route can be handled at once; more get a 503 response. */
         struct Route {
-            Method      method = Method::GET;
-            std::regex      pathPattern;
-            HandlerFunction handler;
+            Route(Method m, string path, HandlerFunction h, size_t maxConcurrent = 0)
+            :method(m), path(std::move(path)), handler(std::move(h))
+            ,maxConcurrent(maxConcurrent) { }
+            Route(Method m, std::regex pathRegex, HandlerFunction h, size_t maxConcurrent = 0)
+            :method(m), pathRegex(std::move(pathRegex)), handler(std::move(h))
+            ,maxConcurrent(maxConcurrent) { }
+
+            Method                    method = Method::GET;
+            string                    path;         ///< Path pattern, unless pathRegex is set
+            std::optional<std::regex> pathRegex;    ///< Regex to match instead of `path`
+            HandlerFunction           handler;
+            size_t                    maxConcurrent = 0; ///< Max requests at once (0 = no limit)
+        };
+
+        /// Settings for compressing response bodies.
+        struct Compression {
+            bool   enabled = true;      ///< Set to false to never compress
+            int    level   = 6;         ///< zlib level, from 1 (fastest) to 9 (smallest)
+            size_t minSize = 1024;      ///< Bodies smaller than this aren't compressed
+        };
+
+        /// Time limits, in seconds, on the phases of a connection. Zero means no limit.
+        /// A connection that exceeds one is aborted.
+        struct Timeouts {
+            double headers = 20;    ///< Max time to receive a request's headers
+            double body    = 60;    ///< Max time to receive a request's body
+            double idle    = 60;    ///< Max time to wait for another request on a kept-alive connection
+            double request = 0;     ///< Max time from the start of a request to the end of its response
+        };
+
+        /// Counts of connections aborted for exceeding each Timeout, by all Handlers.
+        struct TimeoutStats {
+            std::atomic<uint64_t> headers = 0, body = 0, idle = 0, request = 0;
         };
 
         /// Constructs an HTTPHandler on a socket, given its routing table.
-        explicit Handler(std::shared_ptr<IStream>, std::vector<Route> const&);
+        /// @note  The Router must remain valid as long as the Handler exists.
+        explicit Handler(std::shared_ptr<IStream>, Router const&);
+
+        /// Changes the response compression settings.
+        ///
+        /// A response body is compressed with gzip or deflate if the request's `Accept-Encoding`
+        /// allows it, its `Content-Type` is text, JSON, XML or JavaScript, it has no
+        /// `Content-Encoding`, and its `Content-Length` (or else the size of the first write)
+        /// is at least `minSize`. If the response has a `Content-Length`, the compressed body is
+        /// buffered so the header can be updated; otherwise it's streamed.
+        void setCompression(Compression const& c)      {_compression = c;}
+
+        /// Makes the Handler answer requests from a ResponseCache when possible, and store
+        /// cacheable responses in it. The cache can be shared by Handlers on the same thread.
+        /// @note  The cache must remain valid as long as the Handler exists.
+        void setResponseCache(ResponseCache* cache)     {_cache = cache;}
+
+        /// Changes the time limits. (These protect against clients that hold connections open
+        /// by sending slowly or not at all, a.k.a. "slowloris" attacks.)
+        void setTimeouts(Timeouts const& t)             {_timeouts = t;}
+
+        /// Counts of connections aborted because of timeouts.
+        static TimeoutStats const& timeoutStats()       {return sTimeoutStats;}
+
+        /// Makes the Handler count its connection and requests with an AdmissionController,
+        /// and respond with 503 (Service Unavailable) to requests it rejects.
+        /// @note  The controller must remain valid as long as the Handler exists.
+        void setAdmissionController(AdmissionController* ac)   {_admission = ac;}
 
-        /// Reads the request, calls the handler (or writes an error) and closes the socket.
+        /// Reads a request, calls the handler (or writes an error), and repeats while the
+        /// connection is kept alive. Then closes the socket.
         ASYNC<void> run();
 
     private:
+        enum class Phase : uint8_t {Idle, Headers, Body, Request};
+
+        void setDeadline(Phase, double timeout);
+        void timedOut();
+        ASYNC<void> respond();
+        ASYNC<void> skipBody();
         ASYNC<void> handleRequest(Headers responseHeaders,
-                                  HandlerFunction const& handler);
+                                  HandlerFunction const& handler,
+                                  PathParams const& params,
+                                  bool cacheable);
+        ASYNC<void> writeCachedResponse(ResponseCache::EntryRef);
         ASYNC<void> writeHeaders(Status status,
                                  string_view statusMsg,
-                                 Headers const& headers);
+                                 Headers const& headers,
+                                 std::span<HeaderBlock const* const> headerBlocks = {});
         ASYNC<void> writeToBody(string);
         ASYNC<void> endBody();
 
         std::shared_ptr<IStream> _stream;
         Parser                   _parser;
-        std::vector<Route> const&_routes;
+        Router const&            _router;
+        Compression              _compression;
+        ResponseCache*           _cache = nullptr;
+        AdmissionController*     _admission = nullptr;
+        std::shared_ptr<ResponseCache::Entry> _capture; // Response being saved to the cache
+        bool                     _mayCache = false;     // Can the next response be cached?
+        bool                     _keepAlive = false;    // Keep connection open after response?
+        Timeouts                 _timeouts;
+        Deadline                 _deadline;             // Current time limit
+        Deadline::Clock::time_point _requestDeadline;   // When the current request times out
+        Phase                    _phase = Phase::Idle;  // What the deadline is for
+        bool                     _timedOut = false;     // Set when a deadline expires
+
+        static TimeoutStats      sTimeoutStats;
+    };
+
+
+
+    /** A routing table that maps request methods and paths to Routes.
+        Path patterns are compiled into a radix tree, so matching a request takes time
+        proportional to the length of its path, not the number of routes.
+        A Router is immutable once constructed, so it can be shared by all Handlers. */
+    class Router {
+    public:
+        using Route = Handler::Route;
+
+        Router(std::initializer_list<Route>);
+        explicit Router(std::vector<Route>);
+        ~Router();
+
+        /// The result of `match`.
+        struct Match {
+            Route const* route = nullptr;   ///< The matching Route, or nullptr on failure
+            Status       status;            ///< OK, NotFound or MethodNotAllowed
+            PathParams   params;            ///< Captured path parameters
+        };
+
+        /// Finds the Route for a request method and path.
+        /// On failure, `status` is NotFound if no Route matches the path,
+        /// or MethodNotAllowed if one does but not with that method.
+        Match match(Method, string_view path) const;
+
+    private:
+        struct Node;
+        Router(Router const&) = delete;
+        Router& operator=(Router const&) = delete;
+        void insert(Route const&);
+
+        std::vector<Route>          _routes;        // All routes, in the order given
+        std::unique_ptr<Node>       _root;          // Radix tree of path-pattern routes
+        std::vector<Route const*>   _regexRoutes;   // Routes with a pathRegex
     };
 
 }
@@ -20,9 +20,11 @@
 #include "crouton/CroutonFwd.hh"
 #include "crouton/Error.hh"
 #include "crouton/io/URL.hh"
+#include "crouton/util/Arena.hh"
 
+#include <memory>
 #include <optional>
-#include <unordered_map>
+#include <utility>
 
 struct llhttp_settings_s;
 struct llhttp__internal_s;
@@ -37,12 +39,18 @@ namespace crouton::io::http {
         Unknown = 0,
         SwitchingProtocols = 101,
         OK = 200,
+        NoContent = 204,
+        PartialContent = 206,
         MovedPermanently = 301,
+        NotModified = 304,
         BadRequest = 400,
         Forbidden = 403,
         NotFound = 404,
         MethodNotAllowed = 405,
+        RangeNotSatisfiable = 416,
         ServerError = 500,
+        NotImplemented = 501,
+        ServiceUnavailable = 503,
     };
 
     /// HTTP request methods.
@@ -60,38 +68,77 @@ namespace crouton::io::http {
     ostream& operator<< (ostream&, Method);
 
 
-    /// A map of HTTP header names->values. Inherits from `unordered_map`.
-    class Headers : public std::unordered_map<string,string> {
+    /** A list of HTTP header names and values.
+        The strings are stored in an internal Arena, so building a Headers object makes very few
+        heap allocations, and name lookup is case-insensitive without allocating.
+        Multiple values for the same name are combined into one, comma-delimited. */
+    class Headers {
     public:
-        using unordered_map::unordered_map;
+        using Entry = std::pair<string_view,string_view>;  ///< A name and value
+
+        /// The number of headers that can be stored without allocating another array.
+        static constexpr size_t kInlineCapacity = 16;
+
+        /// Constructs an empty Headers that stores its strings in its own internal Arena.
+        Headers() noexcept                          :_arena(&_ownArena), _entries(_inline) { }
+
+        /// Constructs an empty Headers that stores its strings in an external Arena, such as a
+        /// per-request one. The Arena must outlive this object; `clear` will not reset it.
+        explicit Headers(util::Arena& arena) noexcept :_arena(&arena), _entries(_inline) { }
+
+        Headers(Headers const&);
+        Headers& operator=(Headers const&);
+        Headers(Headers&&) noexcept;
+        Headers& operator=(Headers&&) noexcept;
+
+        size_t size() const noexcept Pure           {return _size;}
+        bool empty() const noexcept Pure            {return _size == 0;}
+
+        Entry const* begin() const noexcept Pure    {return _entries;}
+        Entry const* end() const noexcept Pure      {return _entries + _size;}
 
         /// True if the header name exists. Name lookup is case-insensitive.
-        bool contains(string const& name) const {
-            return find(canonicalName(name)) != end();
-        }
+        bool contains(string_view name) const noexcept Pure   {return find(name) != nullptr;}
 
-        /// Returns the value of a header. Name lookup is case-insensitive.
-        string get(string const& name) const {
-            auto i = find(canonicalName(name));
-            return (i != end()) ? i->second : "";
-        }
+        /// Returns the value of a header, or an empty string if it's missing.
+        /// Name lookup is case-insensitive.
+        string_view get(string_view name) const noexcept Pure;
+        string_view operator[] (string_view name) const noexcept Pure  {return get(name);}
 
         /// Sets a header, replacing any prior value. The name is canonicalized.
-        void set(string const& name, string const& value) {
-            (*this)[canonicalName(name)] = value;
-        }
+        void set(string_view name, string_view value);
 
         /// Sets a header, appending to any prior value (with a comma as a delimiter.)
         /// The name is canonicalized.
-        void add(string const& name, string const& value) {
-            if (auto [i, added] = insert({canonicalName(name), value}); !added) {
-                i->second += ", ";
-                i->second += value;
-            }
-        }
+        void add(string_view name, string_view value);
+
+        /// Removes a header. Returns false if it wasn't present.
+        bool remove(string_view name) noexcept;
+
+        /// Removes all headers. If the internal Arena is used, frees their storage.
+        void clear() noexcept;
 
         /// Title-capitalizes a header name, e.g. `conTent-TYPe` -> `Content-Type`.
         static string canonicalName(string name);
+
+    private:
+        friend class Parser;
+
+        Entry const* find(string_view name) const noexcept Pure;
+        Entry* find(string_view name) noexcept Pure {
+            return const_cast<Entry*>(std::as_const(*this).find(name));
+        }
+        string_view copyName(string_view);
+        void addOwned(string_view name, string_view value);
+        void push(Entry);
+
+        util::Arena             _ownArena {1024};       // Default storage for names & values
+        util::Arena*            _arena;                 // Stores the names & values
+        Entry*                  _entries;               // Points to _inline or _heapEntries
+        size_t                  _size = 0;              // Number of entries
+        size_t                  _capacity = kInlineCapacity;
+        std::unique_ptr<Entry[]> _heapEntries;          // Entries, if more than kInlineCapacity
+        Entry                   _inline[kInlineCapacity];
     };
 
 
@@ -129,21 +176,37 @@ namespace crouton::io::http {
         /// Returns true if the connection has been upgraded to another protocol.
         bool upgraded() const noexcept Pure             {return _upgraded;}
 
+        /// True if the connection may be kept open after this message, according to its HTTP
+        /// version and `Connection` header. Valid once the headers have been read.
+        bool keepAlive() const noexcept Pure            {return _keepAlive;}
+
+        /// True if data following the current message has already been read from the stream,
+        /// as when a client pipelines requests. It will be parsed after `reset`.
+        bool hasPipelinedData() const noexcept Pure     {return !_leftover.empty();}
+
+        /// Clears all the metadata and frees its storage, preparing to parse another message.
+        void reset();
+
+        /// The Arena that stores the strings of the current message: the URI, status message,
+        /// and headers. Other objects with the same lifetime as the message may allocate from
+        /// it too. It's cleared by `reset`.
+        util::Arena& arena() noexcept                   {return *_arena;}
+
         //---- Metadata
 
         /// The HTTP request method.
         Method requestMethod;
 
-        /// The HTTP request URI (path + query)
-        std::optional<URL> requestURI;
+        /// The HTTP request URI (path + query.) Its strings are stored in the `arena`.
+        std::optional<URLRef> requestURI;
 
         /// The HTTP response status code.
         Status status = Status::Unknown;
 
-        /// The HTTP response status message.
-        string statusMessage;
+        /// The HTTP response status message. Stored in the `arena`.
+        string_view statusMessage;
 
-        /// All the HTTP headers.
+        /// All the HTTP headers. Their strings are stored in the `arena`.
         Headers headers;
 
         /// Returns the value of an HTTP header. (Case-insensitive.)
@@ -166,21 +229,26 @@ namespace crouton::io::http {
     private:
         Parser(IStream*, Role role);
         int gotBody(const char* data, size_t length);
-        int addHeader(string const& value);
 
         using SettingsRef = std::unique_ptr<llhttp_settings_s>;
         using ParserRef   = std::unique_ptr<llhttp__internal_s>;
+        using ArenaRef    = std::unique_ptr<util::Arena>;
 
         IStream*    _stream;                    // Input Stream, if any
         Role        _role;                      // Request or Response
         SettingsRef _settings;                  // llhttp settings
         ParserRef   _parser;                    // llhttp parser
-        string      _statusMsg;                 // Parsed status message ("OK", etc.)
-        string      _curHeaderName;             // Latest header name read during parsing
+        ArenaRef    _arena;                     // Per-message storage (heap-allocated so it
+                                                //   doesn't move when the Parser does)
+        string_view _curURL;                    // URL being parsed (in _arena)
+        string_view _curHeaderName;             // Header name being parsed (in _arena)
+        string_view _curHeaderValue;            // Header value being parsed (ditto)
         string      _body;                      // Latest chunk of body read
+        string      _leftover;                  // Data read past the end of the message
         bool        _headersComplete = false;   // True when metadata/headers have been read
         bool        _messageComplete = false;   // True when entire request/response is read
         bool        _upgraded = false;          // True on protocol upgrade (WebSocket etc.)
+        bool        _keepAlive = false;         // True if connection may be reused
     };
 
 }
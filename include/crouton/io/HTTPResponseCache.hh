@@ -0,0 +1,125 @@
+//
+// HTTPResponseCache.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/io/HTTPParser.hh"
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+namespace crouton::io::http {
+    class Handler;
+
+
+    /** An in-memory cache of serialized HTTP responses, shared by Handlers (see
+        `Handler::setResponseCache`.) A request that matches a cached response gets that response
+        written back in a single write, without calling the HandlerFunction at all.
+
+        - Only GET and HEAD requests are looked up, and only if they don't have `Authorization`,
+          `Range` or conditional headers, or `Cache-Control: no-cache`.
+        - A response is stored if it has a cacheable status (200, 203, 204, 301, 404 or 410),
+          a `Content-Length` no bigger than `maxEntrySize`, no `Set-Cookie` header, and no
+          `Cache-Control` directive `no-store`, `no-cache` or `private`. It's kept for `ttl`
+          seconds, or less if it has a `Cache-Control: max-age`.
+        - A response with a `Vary` header is only used for requests whose headers named by it
+          have the same values. (Compressed responses vary on `Accept-Encoding`.)
+        - A successful POST, PUT or DELETE request removes the cached responses for its URI.
+        - When the cache's total size exceeds `maxSize`, least recently used responses are evicted.
+
+        A ResponseCache is not thread-safe; all Handlers using one must be on the same thread. */
+    class ResponseCache {
+    public:
+        struct Options {
+            size_t maxSize      = 16 << 20; ///< Max total size of the cached responses
+            size_t maxEntrySize = 1 << 20;  ///< Max size of a single cached response
+            double ttl          = 5.0;      ///< Max seconds to keep a response
+        };
+
+        ResponseCache()                     :ResponseCache(Options{}) { }
+        explicit ResponseCache(Options const& options)     :_options(options) { }
+
+        struct Stats {
+            uint64_t hits = 0;          ///< Requests answered from the cache
+            uint64_t misses = 0;        ///< Cacheable requests not found (or expired)
+            uint64_t evictions = 0;     ///< Responses removed to make room for others
+        };
+
+        Stats const& stats() const noexcept Pure        {return _stats;}
+
+        /// The number of cached responses.
+        size_t count() const noexcept Pure              {return _lru.size();}
+
+        /// The total size in bytes of the cached responses.
+        size_t size() const noexcept Pure               {return _size;}
+
+        /// Removes all cached responses for a URI (path + query.)
+        void invalidate(string_view uri);
+
+        /// Removes all cached responses.
+        void clear();
+
+    private:
+        friend class Handler;
+        using Clock = std::chrono::steady_clock;
+        using HeaderGetter = std::function<string_view(string_view)>;
+
+        /// A cached response.
+        struct Entry {
+            string              key;            // Method and URI
+            string              vary;           // Names of request headers in the `Vary` header
+            string              varyValues;     // Values of those request headers
+            string              data;           // Serialized response, minus Date & Connection
+            size_t              statusLength = 0; // Length of the status line at start of `data`
+            Clock::time_point   expires;
+        };
+        using EntryRef = std::shared_ptr<Entry const>;
+
+        /// True if a request can be answered from the cache.
+        static bool isCacheable(Method, Headers const& requestHeaders) noexcept Pure;
+
+        /// Returns the cached response for a request, or nullptr.
+        /// Call only if `isCacheable` returns true.
+        EntryRef lookup(Method, URLRef const& uri, Headers const& requestHeaders);
+
+        /// Checks whether a response can be cached, given its status and a function that
+        /// returns its headers. If so, returns a new Entry to which it should be serialized.
+        std::shared_ptr<Entry> newEntry(Method, URLRef const& uri, Status, HeaderGetter const&);
+
+        /// Adds a completely serialized Entry.
+        void store(std::shared_ptr<Entry>, Headers const& requestHeaders);
+
+        /// Called after handling a request that wasn't cached; invalidates the URI if the
+        /// request was a successful modification.
+        void noteRequest(Method, URLRef const& uri, Status);
+
+        using LRUList = std::list<std::shared_ptr<Entry>>;
+
+        void invalidate(string_view path, string_view query);
+        void remove(LRUList::iterator);
+
+        Options                 _options;
+        Stats                   _stats;
+        LRUList                 _lru;           // Most recently used first
+        std::unordered_multimap<string_view, LRUList::iterator> _index; // Keys are Entry::key
+        size_t                  _size = 0;
+    };
+
+}
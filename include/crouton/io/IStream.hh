@@ -24,6 +24,7 @@
 #include <initializer_list>
 
 namespace crouton::io {
+    class FileStream;
 
     /** Abstract base class of an asynchronous bidirectional stream.
         It has concrete read/write methods, which are merely conveniences that call the
@@ -46,6 +47,12 @@ namespace crouton::io {
         /// Closes the write side, but not the read side. (Like a socket's `shutdown`.)
         virtualASYNC<void> closeWrite() =0;
 
+        /// Breaks the connection immediately, e.g. on a timeout: any pending or future read
+        /// returns EOF and writes fail. Unlike `close`, it doesn't wait, and the stream stays
+        /// valid for calls in progress; it still needs to be closed afterwards.
+        /// @note  The default implementation does nothing.
+        virtual void abort()                            { }
+
         //---- Reading:
 
         /// Reads at least 1 byte, except at EOF, and no more than `maxLen`.
@@ -101,12 +108,24 @@ namespace crouton::io {
 
         /// Writes data, fully, from multiple input buffers.
         /// @warning The data pointed to by the buffers must remain valid until completion.
-        /// @note  The default implementation makes `nBuffers` calls to `write(ConstBytes)`.
-        ///        A subclass that natively supports multi-buffer write ("writev") may override
-        ///        this method as an optimization.
+        /// @note  The default implementation copies the buffers into one and calls
+        ///        `write(ConstBytes)` once. A subclass that natively supports multi-buffer
+        ///        write ("writev") may override this method as an optimization.
         virtualASYNC<void> write(const ConstBytes buffers[], size_t nBuffers);
 
         ASYNC<void> write(std::initializer_list<ConstBytes> buffers);
+
+        /// The number of bytes passed to `write` calls that are still waiting to be sent.
+        /// Callers can use this to apply backpressure, by not writing faster than the peer reads.
+        /// @note  The default implementation returns 0.
+        virtual size_t bytesQueued() const              {return 0;}
+
+        /// Writes up to `length` bytes of an open file, starting at `offset`, directly from the
+        /// file to the stream without copying them through memory (i.e. with `sendfile`.)
+        /// Returns the number of bytes sent, which may be less than `length`; or 0 if the stream
+        /// can't do this right now, in which case the caller should write the data normally.
+        /// @note  The default implementation returns 0.
+        virtualASYNC<size_t> sendFile(FileStream&, uint64_t offset, size_t length);
     };
 
 
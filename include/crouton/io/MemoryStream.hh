@@ -0,0 +1,79 @@
+//
+// MemoryStream.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/io/IStream.hh"
+
+namespace crouton::io {
+
+    /** MemoryStreams are bidirectional streams that come in pairs, like `LocalSocket`s, but
+        they're implemented entirely in memory: no file descriptors, system calls or event loop.
+
+        A write doesn't copy: the peer's reads return pointers into the writer's buffers, and the
+        write completes once the peer has read all of it and called `readNoCopy` (or `peekNoCopy`
+        or `close`) again, since until then it may still be using the last bytes it got.
+        That's the backpressure: a writer can't get ahead of its reader by more than one write.
+
+        So by default a write blocks until the peer reads it, and two peers that each write and
+        then wait for the other's reply would deadlock. A protocol that does that (like HTTP)
+        should give the pair a buffer, which acts like a socket's send buffer: a write that
+        fits in the free space of the buffer is copied into it and completes immediately.
+
+        Both streams of a pair must be used on the same thread. */
+    class MemoryStream : public IStream {
+    public:
+        using Ref = std::shared_ptr<MemoryStream>;
+
+        /// Creates a pair of connected MemoryStreams, which are already open.
+        /// @param bufferSize  Capacity of each direction's buffer; 0 means writes are never copied.
+        static std::pair<Ref,Ref> createPair(size_t bufferSize = 0);
+
+        bool isOpen() const override                    {return _open;}
+        ASYNC<void> open() override;
+        ASYNC<void> close() override;
+        ASYNC<void> closeWrite() override;
+        void abort() override;
+
+        ASYNC<ConstBytes> readNoCopy(size_t maxLen = 65536) override;
+        ASYNC<ConstBytes> peekNoCopy() override;
+
+        ASYNC<void> write(ConstBytes) override;
+        ASYNC<void> write(const ConstBytes buffers[], size_t nBuffers) override;
+        using IStream::write;
+
+        /// The number of bytes written that the peer hasn't read yet.
+        size_t bytesQueued() const override;
+
+        ~MemoryStream();
+
+        struct Channel;
+        // private by convention
+        MemoryStream(std::shared_ptr<Channel> in, std::shared_ptr<Channel> out);
+
+    private:
+        ASYNC<void> waitForData();
+        void shutdown();
+
+        std::shared_ptr<Channel>    _in;                // Data the peer writes to me
+        std::shared_ptr<Channel>    _out;               // Data I write to the peer
+        bool                        _open = true;
+        bool                        _readBusy = false;  // Detects re-entrant calls
+        bool                        _writeBusy = false;
+    };
+
+}
@@ -39,6 +39,8 @@ namespace crouton::io {
         /// Closes the stream entirely. (Called by the destructor.)
         virtual Future<void> close() override;
 
+        void abort() override;
+
         //---- READING
 
         /// True if the stream has data available to read.
@@ -65,6 +67,13 @@ namespace crouton::io {
         ASYNC<void> write(ConstBytes) override;
         ASYNC<void> write(const ConstBytes buffers[], size_t nBuffers) override;
 
+        /// The number of bytes written that libuv hasn't yet passed to the OS.
+        size_t bytesQueued() const override;
+
+        /// Sends file data with `sendfile`. Returns 0 if the stream's send buffer is full, or
+        /// if there's unsent data from an earlier write call.
+        ASYNC<size_t> sendFile(FileStream&, uint64_t offset, size_t length) override;
+
     protected:
         Stream();
 
@@ -18,13 +18,43 @@
 
 #pragma once
 #include "crouton/io/ISocket.hh"
+#include "crouton/io/AdmissionController.hh"
 
 #include <functional>
+#include <vector>
 
 struct uv_tcp_s;
 
+namespace crouton::io::mbed {
+    class TLSContext;
+}
+
 namespace crouton::io {
 
+    /// Certificates and options for a TCPServer that accepts TLS connections.
+    struct TLSServerConfig {
+        /// A certificate chain and its private key, both in PEM format.
+        struct Identity {
+            string hostName;            ///< SNI host name it's for (ignored in the first one)
+            string certChain;           ///< Server cert, followed by any intermediate certs
+            string privateKey;          ///< Private key of the server cert
+            string keyPassword;         ///< Password of the private key, if it's encrypted
+        };
+
+        /// The identities to present to clients. A client asking for a host name (with SNI)
+        /// gets the identity with that name; any other client gets the first one.
+        std::vector<Identity> identities;
+
+        /// If true, the steps of TLS handshakes run on libuv's thread pool, so that the
+        /// public-key operations of a burst of new connections don't stall the event loop.
+        bool offloadHandshakes = false;
+
+        /// Seconds a client has to complete its handshake before it's disconnected; 0 means
+        /// no limit. Otherwise a client that stalls mid-handshake ties up the connection.
+        double handshakeTimeout = 10;
+    };
+
+
     //TODO: Requires libuv. Not yet implemented for ESP32.
 
     class TCPServer {
@@ -37,8 +67,20 @@ namespace crouton::io {
         using Acceptor = std::function<void(std::shared_ptr<ISocket>)>;
 
         /// Starts the server. Incoming connections will trigger calls to the acceptor function.
+        /// @param backlog  Max number of connections the OS will queue until they're accepted.
         /// @throws  If it's not possible to listen on the specified port.
-        void listen(Acceptor);
+        void listen(Acceptor, int backlog = 128);
+
+        /// Makes the server accept TLS connections. Each client's TLS handshake is completed
+        /// before it's passed to the acceptor function; clients that fail it are closed.
+        /// Must be called before `listen`.
+        /// @throws  If a certificate or key can't be parsed.
+        void useTLS(TLSServerConfig const&);
+
+        /// Makes the server close new connections immediately when the controller says it's
+        /// overloaded or has too many connections.
+        /// @note  The controller must remain valid as long as the server is open.
+        void setAdmissionController(AdmissionController* ac)   {_admission = ac;}
 
         /// The port on which the server is listening.
         uint16_t port();
@@ -51,9 +93,13 @@ namespace crouton::io {
 
     private:
         void accept(int status);
+        static Task acceptTLS(std::shared_ptr<ISocket>, std::shared_ptr<mbed::TLSContext>,
+                              Acceptor);
         
         uv_tcp_s*       _tcpHandle;         // Handle for TCP operations
         Acceptor        _acceptor;
+        std::shared_ptr<mbed::TLSContext> _tlsContext;  // Set if using TLS
+        AdmissionController* _admission = nullptr;
         bool            _isOpen = false;
     };
 
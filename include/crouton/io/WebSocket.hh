@@ -18,6 +18,7 @@
 
 #pragma once
 #include "crouton/util/Bytes.hh"
+#include "crouton/CoCondition.hh"
 #include "crouton/Coroutine.hh"
 #include "crouton/Generator.hh"
 #include "crouton/io/HTTPConnection.hh"
@@ -25,6 +26,7 @@
 
 #include <deque>
 #include <optional>
+#include <span>
 
 namespace uWS {
     template <const bool isServer> class WebSocketProtocol;
@@ -62,6 +64,7 @@ namespace crouton::io::ws {
     struct Message : public string {
         /// WebSocket message types (the numeric values are defined by the protocol.)
         enum Type : uint8_t {
+            Continuation = 0,   ///< (Only used internally, for the later frames of a message)
             Text   =  1,
             Binary =  2,
             Close  =  8,
@@ -72,6 +75,8 @@ namespace crouton::io::ws {
         using string::string;
 
         Message::Type type = Binary;
+        bool partial = false;                   ///< True if more of the message follows
+
 
         Message(CloseCode, string_view message);
         CloseCode closeCode() const;            ///< If type==Close, this is the status code
@@ -83,6 +88,71 @@ namespace crouton::io::ws {
     ostream& operator<< (ostream&, CloseCode);
 
 
+    /// Options for the permessage-deflate extension (RFC 7692), which compresses messages.
+    /// "Peer" options are requests to the other side, which it may not honor.
+    struct CompressionOptions {
+        bool    enabled               = CROUTON_USE_ZLIB; ///< Offer/accept compression at all?
+        int     level                 = 6;     ///< zlib compression level, 1 (fastest) to 9 (smallest)
+        int     windowBits            = 15;    ///< Log2 of the window for messages I send (9-15)
+        int     peerWindowBits        = 15;    ///< Log2 of the max window for received messages (8-15)
+        bool    noContextTakeover     = false; ///< Compress each message I send independently
+        bool    peerNoContextTakeover = false; ///< Ask peer to compress each message independently
+        size_t  minSize               = 128;   ///< Messages smaller than this are sent uncompressed
+    };
+
+    class PerMessageDeflate;
+
+
+    /// Limits on the messages a WebSocket reads from the network ahead of the `receive` caller.
+    /// When either is reached it stops reading, so a peer sending faster than the app handles
+    /// messages is held back by TCP flow control instead of filling up memory.
+    struct ReceiveLimits {
+        size_t  maxQueuedMessages = 256;        ///< Max messages waiting to be received
+        size_t  maxQueuedBytes    = 1 << 20;    ///< Max total size of those messages
+    };
+
+
+    /// Options for combining small outgoing frames into fewer writes, so that a burst of small
+    /// messages costs one system call instead of one per message.
+    struct CoalesceOptions {
+        bool    enabled  = false;       ///< Coalesce frames at all?
+        size_t  maxBytes = 16 * 1024;   ///< Held frames are written once they reach this size
+        double  maxDelay = 0;           ///< Max secs to hold frames; 0 means till the next event loop turn
+    };
+
+
+    /** A message that's framed (and optionally compressed) just once, so that it can be sent to
+        any number of ServerWebSockets at the cost of one write each. It's immutable, so it can
+        be shared between them.
+        (This only works for servers: a client has to mask every frame with a different key.) */
+    class PreparedMessage {
+    public:
+        /// Frames a message. If `compression` is enabled, it also compresses it, for recipients
+        /// whose negotiated parameters allow that: those whose connection negotiated
+        /// `server_no_context_takeover`, with a window at least as large as
+        /// `compression.windowBits`. Other recipients get the uncompressed frame.
+        explicit PreparedMessage(ConstBytes payload,
+                                 Message::Type = Message::Binary,
+                                 CompressionOptions const& compression = {.enabled = false});
+
+        Message::Type type() const              {return _type;}
+        size_t size() const                     {return _size;}         ///< Payload size
+        bool isCompressed() const               {return !_compressedFrame.empty();}
+
+    private:
+        friend class ServerWebSocket;
+        ConstBytes frameFor(PerMessageDeflate const*) const;
+
+        string          _frame;                 // Uncompressed frame, including header
+        string          _compressedFrame;       // Compressed frame, if any
+        size_t          _size;
+        int             _windowBits = 15;       // Window size used to compress
+        Message::Type   _type;
+    };
+
+    using PreparedMessageRef = std::shared_ptr<PreparedMessage const>;
+
+
     /** Abstract base class of WebSocket connections. */
     class WebSocket {
     public:
@@ -92,10 +162,59 @@ namespace crouton::io::ws {
         ///   type `Close` will arrive. No further messages will arrive; don't call receive again.
         Generator<Message> receive();
 
-        /// Sends a binary message, asynchronously.
-        /// @note The data is copied and does not need to remain valid after the call.
+        /// Like `receive`, except that a large Text or Binary message is produced in pieces as
+        /// it arrives, instead of being assembled in memory first. Every piece but the last has
+        /// its `partial` flag set. This allows messages larger than `receive` would accept.
+        Generator<Message> receiveFragments();
+
+        /// Sets limits on the messages read ahead of the `receive` caller.
+        void setReceiveLimits(ReceiveLimits const& limits)     {_receiveLimits = limits;}
+
+        /// Optionally call this with a received message when you're done with it, so its memory
+        /// can be reused for a later one. (The buffers are pooled per thread.)
+        static void recycle(Message&&);
+
+        /// Sends a message, asynchronously.
+        /// Messages are sent in the order of the calls, even if the caller doesn't wait.
+        /// @warning  The data is not copied, so it must remain valid until the Future resolves.
         ASYNC<void> send(ConstBytes, Message::Type = Message::Binary);
-        ASYNC<void> send(Message const& m)   {return send(ConstBytes(m), m.type);}
+
+        /// Sends a message, taking ownership of its data, so the caller doesn't need to keep
+        /// anything valid. Pass the string with `std::move` to avoid copying it.
+        ASYNC<void> send(string, Message::Type = Message::Binary);
+
+        /// Sends a Message, taking ownership of it like the `send(string)` method.
+        ASYNC<void> send(Message m)     {auto type = m.type; return send(std::move(m), type);}
+
+        /// Sends a message whose contents are read from a stream, such as a FileStream, until
+        /// it reaches EOF. The message is sent in fragments as it's read, so it's never all in
+        /// memory. It's not compressed.
+        /// No other Text or Binary message can be sent until this completes.
+        /// If reading or writing fails partway through the message, this sends a Close message
+        /// with code `CantFulfill`, since the message can't be finished.
+        ASYNC<void> sendStream(IStream& source, Message::Type = Message::Binary);
+
+        /// Sets the options for compressing messages. Must be called before connecting.
+        /// @note  Compression uses several hundred KB of memory per connection, by default.
+        ///        Memory-constrained apps can reduce this by lowering the window sizes and
+        ///        compression level, or disable compression by setting `enabled` to false.
+        void setCompressionOptions(CompressionOptions const& opts)   {_compressionOptions = opts;}
+
+        /// Enables or disables coalescing of outgoing frames. While it's enabled, frames no larger
+        /// than `maxBytes` are held briefly and written together, and a `send`'s Future resolves
+        /// when the write containing its message completes.
+        void setCoalescing(CoalesceOptions const&);
+
+        /// Writes any frames being held for coalescing right away, and waits until they've
+        /// been written. Does nothing if coalescing is off.
+        ASYNC<void> flush();
+
+        /// True if the peers agreed to compress messages. (Only known after connecting.)
+        bool isCompressed() const       {return _deflate != nullptr;}
+
+        /// The number of bytes of sent messages that are still queued, waiting to be written
+        /// to the network. If this keeps growing, the peer isn't keeping up.
+        size_t bytesQueued() const;
 
         /// Returns true once each side has sent a Close message.
         bool readyToClose() const       {return _closeSent && _closeReceived;}
@@ -112,17 +231,56 @@ namespace crouton::io::ws {
     protected:
         template <bool S> friend class uWS::WebSocketProtocol;
 
-        WebSocket() = default;
-        virtual size_t formatMessage(void* dst, ConstBytes message, Message::Type) = 0;
-        virtual void consume(ConstBytes) = 0;
+        explicit WebSocket(bool isClient);
 
+        /// Writes a frame header to `dst`, which must have room for 14 bytes, and returns its
+        /// length. In a client frame, the last 4 bytes of the header are the mask key.
+        virtual size_t formatHeader(std::byte* dst, size_t payloadLen, Message::Type,
+                                    bool compressed, bool fin) = 0;
+        virtual void consume(ConstBytes) = 0;
+        size_t consumeUntilFull(ConstBytes);
+        bool incomingFull() const;
+
+        Error checkSend(Message::Type, size_t size);
+        bool shouldCompress(Message::Type, size_t size) const;
+        ASYNC<void> sendFrame(string payload, Message::Type, bool compressed);
+        ASYNC<void> writeFrame(ConstBytes payload, Message::Type, bool fin);
+        bool canCoalesce(size_t frameSize) const;
+        uint64_t coalesceFrame(ConstBytes payload, Message::Type, bool compressed, bool fin);
+        uint64_t coalesceBytes(ConstBytes frame);
+        void pendingAdded();
+        void writePending();
+        void dropPending();
+        ASYNC<void> writeBatch(string data, uint64_t batch);
+        ASYNC<void> waitForBatch(uint64_t batch);
+        Generator<Message> receiveMessages(bool fragments);
+
+        bool setCompressed();
         bool handleFragment(std::byte*, size_t, size_t,uint8_t, bool);
         void protocolError(string_view logMessage);
         ASYNC<void> handleCloseMessage(Message const& msg);
 
         IStream*                _stream = nullptr;
         std::deque<Message>     _incoming;
+        size_t                  _incomingBytes = 0;     // Total size of _incoming messages
+        ReceiveLimits           _receiveLimits;
         std::optional<Message>  _curMessage;
+        std::optional<Message>  _curControl;            // Control msg interrupting _curMessage
+        CompressionOptions      _compressionOptions;
+        std::unique_ptr<PerMessageDeflate> _deflate;    // Set if compression was negotiated
+        CoalesceOptions         _coalesce;
+        string                  _pending;               // Frames held for coalescing
+        std::unique_ptr<Timer>  _flushTimer;            // Writes _pending
+        CoCondition             _batchWritten;          // Notified when a writeBatch completes
+        uint64_t                _batchesStarted = 0;    // Number of writeBatch calls
+        uint64_t                _batchesWritten = 0;    // Number of those that completed
+        Error                   _batchError;            // Error from a failed writeBatch
+        bool                    _flushScheduled = false; // _flushTimer is running
+        bool                    _frameCompressed = false; // Current frame has RSV1 bit set
+        bool                    _curCompressed = false; // _curMessage is compressed
+        bool const              _isClient;              // Client frames must be masked
+        bool                    _receivingFragments = false; // receiveFragments was called
+        bool                    _sendingStream = false; // sendStream is in progress
         bool                    _closeSent = false;
         bool                    _closeReceived = false;
     };
@@ -153,7 +311,8 @@ namespace crouton::io::ws {
         static string generateAcceptResponse(const char* key);
 
     private:
-        size_t formatMessage(void* dst, ConstBytes message, Message::Type) override;
+        size_t formatHeader(std::byte* dst, size_t payloadLen, Message::Type,
+                            bool compressed, bool fin) override;
         void consume(ConstBytes) override;
 
         using ProtocolRef = std::unique_ptr<uWS::ClientProtocol>;
@@ -184,8 +343,22 @@ namespace crouton::io::ws {
                             http::Handler::Response&,
                             string_view subprotocol = "");
 
+        using WebSocket::send;
+
+        /// Sends a PreparedMessage. Its frame is written as-is, with no copying or framing.
+        ASYNC<void> send(PreparedMessageRef);
+
+        /// Sends a PreparedMessage to many sockets, without waiting for it to be written.
+        /// Each socket is skipped if it's closing, or if it has more than `maxQueued` bytes of
+        /// earlier messages still waiting to be written (i.e. its client is reading too slowly.)
+        /// Returns the number of sockets the message was sent to.
+        static size_t broadcast(PreparedMessageRef const&,
+                                std::span<ServerWebSocket* const> sockets,
+                                size_t maxQueued = 1 << 20);
+
     private:
-        size_t formatMessage(void* dst, ConstBytes message, Message::Type) override;
+        size_t formatHeader(std::byte* dst, size_t payloadLen, Message::Type,
+                            bool compressed, bool fin) override;
         void consume(ConstBytes) override;
 
         std::unique_ptr<uWS::ServerProtocol> _serverParser;
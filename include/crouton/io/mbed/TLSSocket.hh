@@ -20,37 +20,71 @@
 #include "crouton/io/ISocket.hh"
 #include "crouton/io/IStream.hh"
 
+#include <atomic>
+
 
 namespace crouton {
     struct Buffer;
 }
 
 namespace crouton::io::mbed {
+    class TLSContext;
 
     /*** A TCP socket with TLS, using mbedTLS. */
     class TLSSocket : public ISocket, private IStream {
     public:
         static std::shared_ptr<TLSSocket> create()  {return std::make_shared<TLSSocket>();}
 
+        /// Counts of TLS session resumptions, by all TLSSockets and TLS servers.
+        /// A client looks up a cached session for the host and port it's connecting to, and if
+        /// it finds one it offers it to the server, which resumes it if it still recognizes it.
+        struct SessionStats {
+            std::atomic<uint64_t> clientLookups = 0;    ///< Connections that looked for a session
+            std::atomic<uint64_t> clientHits = 0;       ///< Connections that offered one
+            std::atomic<uint64_t> serverLookups = 0;    ///< Clients that offered a session
+            std::atomic<uint64_t> serverHits = 0;       ///< Sessions the server resumed
+        };
+
+        static SessionStats const& sessionStats();
+
+        /// Counts of the handshake steps that TLS servers run on background threads, when
+        /// `TLSServerConfig::offloadHandshakes` is set.
+        struct HandshakeStats {
+            std::atomic<uint64_t> offloadedSteps = 0;       ///< Steps run on background threads
+            std::atomic<uint32_t> maxConcurrentSteps = 0;   ///< Most steps ever running at once
+        };
+
+        static HandshakeStats const& handshakeStats();
+
 
         bool isOpen() const override;
         ASYNC<void> open() override;
         ASYNC<void> close() override;
         ASYNC<void> closeWrite() override;
 
+        /// Shuts down the TCP connection at once, without a TLS close_notify. Pending and
+        /// future reads hit EOF, and writes fail.
+        void abort() override;
+
         std::shared_ptr<IStream> stream() override;
 
+        /// Server side: takes over a connection a server has just accepted, and runs the TLS
+        /// handshake on it. Resolves once the handshake completes. (Used by TCPServer.)
+        ASYNC<void> accept(std::shared_ptr<ISocket> socket, std::shared_ptr<TLSContext>);
+
         TLSSocket();
         ~TLSSocket();
     private:
         ASYNC<ConstBytes> readNoCopy(size_t maxLen = 65536) override;
         ASYNC<ConstBytes> peekNoCopy() override;
         ASYNC<void> write(ConstBytes) override;
+        ASYNC<void> write(const ConstBytes buffers[], size_t nBuffers) override;
         using IStream::write;
 
         ASYNC<ConstBytes> _readNoCopy(size_t maxLen, bool peek);
 
         class Impl;
+        std::shared_ptr<TLSContext> _context;       // Server context; must outlive _impl
         std::unique_ptr<Impl>   _impl;
         std::unique_ptr<Buffer> _inputBuf;
         bool                    _busy = false;
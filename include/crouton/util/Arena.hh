@@ -0,0 +1,76 @@
+//
+// Arena.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/util/Base.hh"
+
+#include <cstddef>
+
+namespace crouton::util {
+
+    /** A simple "bump" allocator. Memory is carved sequentially out of large chunks, and is
+        never freed individually; instead it's all freed at once by `reset` or the destructor.
+        That makes allocation very cheap, and is ideal for lots of small objects that share a
+        lifetime, like the strings of a single HTTP request.
+
+        Allocated memory never moves, even if the Arena itself is moved.
+        @warning  Not thread-safe. */
+    class Arena {
+    public:
+        static constexpr size_t kDefaultChunkSize = 4096;
+
+        explicit Arena(size_t chunkSize = kDefaultChunkSize) noexcept :_chunkSize(chunkSize) { }
+        Arena(Arena&&) noexcept;
+        Arena& operator=(Arena&&) noexcept;
+        ~Arena();
+
+        /// Allocates memory. It will be freed by `reset` or by the destructor.
+        void* alloc(size_t size, size_t alignment = alignof(std::max_align_t));
+
+        /// Copies a string into the arena and returns the copy.
+        string_view copy(string_view);
+
+        /// Appends `more` to a string previously returned by `copy` or `append`, returning
+        /// the combined string. If `str` is the latest allocation and there's room, this extends
+        /// it in place; otherwise it copies both pieces to a new location.
+        string_view append(string_view str, string_view more);
+
+        /// Frees all allocated memory. The first chunk is kept, so that an Arena that's reset
+        /// after each use doesn't need to allocate from the heap again.
+        void reset() noexcept;
+
+        /// The total number of bytes allocated by callers since construction or `reset`.
+        size_t bytesAllocated() const noexcept Pure      {return _bytesAllocated;}
+
+        /// The number of chunks currently allocated from the heap.
+        size_t chunkCount() const noexcept Pure;
+
+    private:
+        struct Chunk;
+
+        Arena(Arena const&) = delete;
+        Arena& operator=(Arena const&) = delete;
+        Chunk* newChunk(size_t minSize);
+        void freeChunks(Chunk*) noexcept;
+
+        Chunk*  _chunk = nullptr;           // Current chunk; others are linked from it
+        size_t  _chunkSize;                 // Default capacity of a chunk
+        size_t  _bytesAllocated = 0;        // Total of sizes passed to `alloc`
+    };
+
+}
@@ -0,0 +1,126 @@
+//
+// AdmissionController.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/io/AdmissionController.hh"
+#include "crouton/Scheduler.hh"
+#include "crouton/util/Logging.hh"
+
+namespace crouton::io {
+    using namespace std;
+
+
+    AdmissionController::AdmissionController(Options const& options)
+    :_options(options)
+    ,_timer([this] {sample();})
+    {
+        if (_options.maxLag > 0) {
+            _lastSample = Clock::now();
+            _timer.start(_options.sampleInterval);
+        }
+    }
+
+
+    // Called by the timer. The lag is how much later than expected it fired.
+    void AdmissionController::sample() {
+        auto now = Clock::now();
+        double elapsed = chrono::duration<double>(now - _lastSample).count();
+        _lastSample = now;
+        double lag = std::max(elapsed - _options.sampleInterval, 0.0);
+        // Rise immediately, but decay gradually so a single good sample doesn't end overload:
+        _lag = (lag >= _lag) ? lag : (_lag + (lag - _lag) / 4);
+    }
+
+
+    bool AdmissionController::overloaded() const noexcept {
+        return (_options.maxLag > 0 && _lag > _options.maxLag)
+            || (_options.maxReady > 0 && Scheduler::current().readyCount() > _options.maxReady);
+    }
+
+
+    bool AdmissionController::shouldAccept() {
+        if (overloaded() || (_options.maxConnections > 0
+                             && _connections >= _options.maxConnections)) {
+            LNet->warn("AdmissionController: refusing connection (lag {:.3f}s, {} connections)",
+                       _lag, _connections);
+            ++_stats.refusedConnections;
+            return false;
+        }
+        ++_stats.acceptedConnections;
+        return true;
+    }
+
+
+    AdmissionController::Ticket AdmissionController::connection() {
+        return Ticket(&_connections, nullptr);
+    }
+
+
+    AdmissionController::Ticket AdmissionController::admitRequest(void const* group,
+                                                                  size_t groupLimit)
+    {
+        size_t* groupCount = nullptr;
+        if (group && groupLimit > 0)
+            groupCount = &_groupRequests[group];    // (the map's values have stable addresses)
+        if (overloaded() || (_options.maxRequests > 0 && _requests >= _options.maxRequests)
+                         || (groupCount && *groupCount >= groupLimit)) {
+            ++_stats.rejectedRequests;
+            return Ticket();
+        }
+        ++_stats.admittedRequests;
+        return Ticket(&_requests, groupCount);
+    }
+
+
+#pragma mark - TICKET:
+
+
+    AdmissionController::Ticket::Ticket(size_t* count, size_t* groupCount) noexcept
+    :_count(count)
+    ,_groupCount(groupCount)
+    ,_admitted(true)
+    {
+        ++*_count;
+        if (_groupCount)
+            ++*_groupCount;
+    }
+
+
+    AdmissionController::Ticket&
+    AdmissionController::Ticket::operator=(Ticket&& t) noexcept {
+        if (&t != this) {
+            release();
+            _count = t._count;
+            _groupCount = t._groupCount;
+            _admitted = t._admitted;
+            t._count = t._groupCount = nullptr;
+            t._admitted = false;
+        }
+        return *this;
+    }
+
+
+    void AdmissionController::Ticket::release() noexcept {
+        if (_count) {
+            --*_count;
+            if (_groupCount)
+                --*_groupCount;
+            _count = _groupCount = nullptr;
+        }
+    }
+
+}
@@ -0,0 +1,114 @@
+//
+// Deadline.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/io/Deadline.hh"
+#include "crouton/EventLoop.hh"
+#include "crouton/util/Logging.hh"
+
+namespace crouton::io {
+    using namespace std;
+
+
+    // The per-thread state: a circular list of the Deadlines that are set, and whether a tick
+    // is scheduled. (The list head is a Deadline whose links are the only members used.)
+    struct DeadlineList {
+        Deadline    head {nullptr};
+        bool        ticking = false;
+
+        // Schedules the next check, unless one is already scheduled.
+        void startTicking() {
+            if (!ticking) {
+                ticking = true;
+                Timer::after(Deadline::kResolution, [this] {tick();});
+            }
+        }
+
+        // Fires the expired Deadlines, then schedules another check if any are still set.
+        void tick() {
+            ticking = false;
+            auto now = Deadline::Clock::now();
+            // First move the expired ones to a separate list, since firing one might clear or
+            // destroy others:
+            Deadline expired {nullptr};
+            for (Deadline* d = head._next; d != &head; ) {
+                Deadline* next = d->_next;
+                if (d->_when <= now) {
+                    d->unlink();
+                    d->link(&expired);
+                }
+                d = next;
+            }
+            while (expired._next != &expired) {
+                Deadline* d = expired._next;
+                d->unlink();
+                try {
+                    d->_fn();
+                } catch (...) {
+                    LLoop->error("*** Caught unexpected exception in Deadline callback ***");
+                }
+            }
+            if (head._next != &head)
+                startTicking();
+        }
+    };
+
+    static thread_local DeadlineList sDeadlines;
+
+
+    Deadline::Deadline(std::function<void()> fn)
+    :_fn(std::move(fn))
+    { }
+
+
+    void Deadline::set(double secs) {
+        if (secs > 0)
+            setAt(Clock::now() + chrono::duration_cast<Clock::duration>(chrono::duration<double>(secs)));
+        else
+            clear();
+    }
+
+
+    void Deadline::setAt(Clock::time_point when) {
+        _when = when;
+        if (!isSet()) {
+            link(&sDeadlines.head);
+            sDeadlines.startTicking();
+        }
+    }
+
+
+    void Deadline::clear() noexcept {
+        unlink();
+    }
+
+
+    void Deadline::link(Deadline* head) noexcept {
+        _prev = head->_prev;
+        _next = head;
+        _prev->_next = this;
+        head->_prev = this;
+    }
+
+
+    void Deadline::unlink() noexcept {
+        _prev->_next = _next;
+        _next->_prev = _prev;
+        _prev = _next = this;
+    }
+
+}
@@ -0,0 +1,300 @@
+//
+// HTTPCompression.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// For zlib API documentation, see: https://zlib.net/manual.html
+
+#include "crouton/io/HTTPCompression.hh"
+#include "crouton/Error.hh"
+#include "support/StringUtils.hh"
+#include <vector>
+
+#if CROUTON_USE_ZLIB
+#  include <zlib.h>
+#else
+   struct z_stream_s { };
+#endif
+
+namespace crouton::io::http {
+    using namespace std;
+
+
+    string_view encodingName(ContentEncoding encoding) noexcept {
+        switch (encoding) {
+            case ContentEncoding::Identity: return "identity";
+            case ContentEncoding::Deflate:  return "deflate";
+            case ContentEncoding::Gzip:     return "gzip";
+        }
+        return "";
+    }
+
+
+    optional<ContentEncoding> parseContentEncoding(string_view value) noexcept {
+        value = trimWhitespace(value);
+        if (value.empty() || equalIgnoringCase(value, "identity"))
+            return ContentEncoding::Identity;
+#if CROUTON_USE_ZLIB
+        if (equalIgnoringCase(value, "gzip") || equalIgnoringCase(value, "x-gzip"))
+            return ContentEncoding::Gzip;
+        if (equalIgnoringCase(value, "deflate"))
+            return ContentEncoding::Deflate;
+#endif
+        return nullopt;
+    }
+
+
+    // Parses a "q=" quality value, returning it in thousandths (0...1000).
+    static int parseQValue(string_view str) noexcept {
+        if (str.empty() || (str[0] != '0' && str[0] != '1'))
+            return 1000;    // invalid; ignore it
+        int q = (str[0] == '1') ? 1000 : 0;
+        if (str.size() > 1 && str[1] == '.') {
+            int scale = 100;
+            for (char c : str.substr(2, 3)) {
+                if (c < '0' || c > '9')
+                    break;
+                q += (c - '0') * scale;
+                scale /= 10;
+            }
+        }
+        return std::min(q, 1000);
+    }
+
+
+    ContentEncoding negotiateEncoding(string_view acceptEncoding) noexcept {
+#if CROUTON_USE_ZLIB
+        // Quality values, in thousandths; -1 means not mentioned.
+        int gzipQ = -1, deflateQ = -1, anyQ = -1;
+        while (!acceptEncoding.empty()) {
+            auto [item, rest] = split(acceptEncoding, ',');
+            acceptEncoding = rest;
+            auto [coding, params] = split(item, ';');
+            coding = trimWhitespace(coding);
+            params = trimWhitespace(params);
+            int q = 1000;
+            if (params.starts_with("q=") || params.starts_with("Q="))
+                q = parseQValue(params.substr(2));
+            if (equalIgnoringCase(coding, "gzip") || equalIgnoringCase(coding, "x-gzip"))
+                gzipQ = q;
+            else if (equalIgnoringCase(coding, "deflate"))
+                deflateQ = q;
+            else if (coding == "*")
+                anyQ = q;
+        }
+        if (gzipQ < 0)
+            gzipQ = anyQ;
+        if (deflateQ < 0)
+            deflateQ = anyQ;
+        // Prefer gzip, since some clients mistakenly expect "deflate" to be raw DEFLATE data:
+        if (gzipQ > 0 && gzipQ >= deflateQ)
+            return ContentEncoding::Gzip;
+        if (deflateQ > 0)
+            return ContentEncoding::Deflate;
+#endif
+        return ContentEncoding::Identity;
+    }
+
+
+    bool isCompressibleType(string_view type) noexcept {
+        type = trimWhitespace(split(type, ';').first);     // ignore parameters like "charset"
+        if (type.size() >= 5 && equalIgnoringCase(type.substr(0, 5), "text/"))
+            return true;
+        for (string_view suffix : {"json", "xml", "javascript", "ecmascript"}) {
+            if (type.size() >= suffix.size()
+                    && equalIgnoringCase(type.substr(type.size() - suffix.size()), suffix))
+                return true;
+        }
+        return false;
+    }
+
+
+#if CROUTON_USE_ZLIB
+
+
+#pragma mark - CACHE:
+
+
+    static constexpr size_t kMaxCached = 4;     // Max idle instances per thread (per encoding)
+
+    // Idle instances, ready to be reused:
+    thread_local vector<unique_ptr<Deflater>> tDeflaters[3];    // indexed by ContentEncoding
+    thread_local vector<unique_ptr<Inflater>> tInflaters;
+
+
+    static void checkErr(int err) {
+        if (err == Z_MEM_ERROR)
+            throw std::bad_alloc();
+        else if (err != Z_OK)
+            Error::raise(CroutonError::LogicError, "unexpected zlib error");
+    }
+
+
+#pragma mark - DEFLATER:
+
+
+    Deflater::Ref Deflater::get(ContentEncoding encoding, int level) {
+        precondition(encoding != ContentEncoding::Identity);
+        if (auto& cache = tDeflaters[size_t(encoding)]; !cache.empty()) {
+            Ref d(cache.back().release());
+            cache.pop_back();
+            if (d->_level != level) {
+                checkErr(deflateParams(d->_z.get(), level, Z_DEFAULT_STRATEGY));
+                d->_level = level;
+            }
+            return d;
+        }
+        return Ref(new Deflater(encoding, level));
+    }
+
+
+    void Deflater::Recycler::operator()(Deflater* d) const noexcept {
+        auto& cache = tDeflaters[size_t(d->_encoding)];
+        if (cache.size() < kMaxCached && deflateReset(d->_z.get()) == Z_OK)
+            cache.emplace_back(d);
+        else
+            delete d;
+    }
+
+
+    Deflater::Deflater(ContentEncoding encoding, int level)
+    :_z(make_unique<z_stream>())
+    ,_encoding(encoding)
+    ,_level(level)
+    {
+        // Adding 16 to the window bits makes zlib write a gzip header & trailer:
+        int windowBits = MAX_WBITS + (encoding == ContentEncoding::Gzip ? 16 : 0);
+        checkErr(deflateInit2(_z.get(), level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY));
+    }
+
+
+    Deflater::~Deflater() {
+        deflateEnd(_z.get());
+    }
+
+
+    void Deflater::write(ConstBytes input, string& output, bool flush) {
+        compress(input, output, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    }
+
+
+    void Deflater::finish(string& output) {
+        compress({}, output, Z_FINISH);
+    }
+
+
+    void Deflater::compress(ConstBytes input, string& output, int flush) {
+        _z->next_in = (Bytef*)input.data();
+        _z->avail_in = unsigned(input.size());
+        // Grow the output string until zlib has room to write everything:
+        size_t outputSize = output.size();
+        int err;
+        do {
+            size_t room = std::max(deflateBound(_z.get(), _z->avail_in), uLong(1024));
+            output.resize(outputSize + room);
+            _z->next_out = (Bytef*)&output[outputSize];
+            _z->avail_out = unsigned(room);
+            err = ::deflate(_z.get(), flush);
+            outputSize += room - _z->avail_out;
+        } while (err == Z_OK && _z->avail_out == 0);
+        output.resize(outputSize);
+        if (err != Z_OK && err != Z_BUF_ERROR && err != Z_STREAM_END)
+            Error::raise(CroutonError::LogicError, "zlib deflate failed");
+    }
+
+
+#pragma mark - INFLATER:
+
+
+    Inflater::Ref Inflater::get() {
+        if (!tInflaters.empty()) {
+            Ref i(tInflaters.back().release());
+            tInflaters.pop_back();
+            return i;
+        }
+        return Ref(new Inflater());
+    }
+
+
+    void Inflater::Recycler::operator()(Inflater* i) const noexcept {
+        if (tInflaters.size() < kMaxCached && inflateReset(i->_z.get()) == Z_OK) {
+            i->_finished = false;
+            tInflaters.emplace_back(i);
+        } else {
+            delete i;
+        }
+    }
+
+
+    Inflater::Inflater()
+    :_z(make_unique<z_stream>())
+    {
+        // Adding 32 to the window bits makes zlib detect either zlib or gzip format:
+        checkErr(inflateInit2(_z.get(), MAX_WBITS + 32));
+    }
+
+
+    Inflater::~Inflater() {
+        inflateEnd(_z.get());
+    }
+
+
+    bool Inflater::started() const noexcept {
+        return _z->total_in > 0;
+    }
+
+
+    size_t Inflater::write(ConstBytes& input, MutableBytes output) {
+        if (_finished)
+            return 0;
+        _z->next_in = (Bytef*)input.data();
+        _z->avail_in = unsigned(input.size());
+        _z->next_out = (Bytef*)output.data();
+        _z->avail_out = unsigned(output.size());
+        int err = ::inflate(_z.get(), Z_NO_FLUSH);
+        if (err == Z_STREAM_END)
+            _finished = true;
+        else if (err == Z_MEM_ERROR)
+            throw std::bad_alloc();
+        else if (err != Z_OK && err != Z_BUF_ERROR)
+            Error::raise(CroutonError::ParseError, "invalid compressed HTTP body");
+        input = input.without_first(input.size() - _z->avail_in);
+        return output.size() - _z->avail_out;
+    }
+
+
+#else // CROUTON_USE_ZLIB
+
+
+    Deflater::Ref Deflater::get(ContentEncoding, int) {
+        Error::raise(CroutonError::Unimplemented, "HTTP compression requires zlib");
+    }
+    void Deflater::Recycler::operator()(Deflater* d) const noexcept {delete d;}
+    Deflater::~Deflater() = default;
+    void Deflater::write(ConstBytes, string&, bool) { }
+    void Deflater::finish(string&) { }
+
+    Inflater::Ref Inflater::get() {
+        Error::raise(CroutonError::Unimplemented, "HTTP compression requires zlib");
+    }
+    void Inflater::Recycler::operator()(Inflater* i) const noexcept {delete i;}
+    Inflater::~Inflater() = default;
+    bool Inflater::started() const noexcept {return false;}
+    size_t Inflater::write(ConstBytes&, MutableBytes) {return 0;}
+
+#endif // CROUTON_USE_ZLIB
+
+}
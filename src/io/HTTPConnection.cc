@@ -99,6 +99,8 @@ namespace crouton::io::http {
             out << req;
             out << "Host: " << _url.hostname << "\r\n";
             out << "Connection: close\r\n";
+            if (CROUTON_USE_ZLIB && !req.headers.contains("Accept-Encoding"))
+                out << "Accept-Encoding: gzip, deflate\r\n";
             if (req.method != Method::GET && !req.bodyStream) {
                 assert_always(!req.headers.contains("Content-Length"));
                 out << "Content-Length: " << req.body.size() << "\r\n";
@@ -151,15 +153,17 @@ namespace crouton::io::http {
     ,_parser(*connection._stream, Parser::Response)
     { }
 
-    Response::Response(Response&& r) noexcept
-    :_connection(r._connection)
-    ,_parser(std::move(r._parser))
-    { }
+    Response::Response(Response&&) noexcept = default;
+    Response& Response::operator=(Response&&) noexcept = default;
 
-    Response& Response::operator=(Response&& r) noexcept {
-        _connection = r._connection;
-        _parser = std::move(r._parser);
-        return *this;
+    Future<void> Response::open() {
+        AWAIT _parser.readHeaders();
+        if (!_parser.upgraded()) {
+            auto encoding = parseContentEncoding(_parser.headers.get("Content-Encoding"));
+            if (encoding && *encoding != ContentEncoding::Identity)
+                _inflater = Inflater::get();
+        }
+        RETURN noerror;
     }
 
     Future<void> Response::close() {
@@ -170,21 +174,45 @@ namespace crouton::io::http {
         return Error(CroutonError::LogicError, "HTTPReponse is not writeable");
     }
 
-    Future<ConstBytes> Response::readNoCopy(size_t maxLen) {
-        if (_bufUsed >= _buf.size()) {
-            _buf = AWAIT _parser.readBody();
+    // Makes sure `_buf` has unread data, unless the body is finished.
+    Future<void> Response::fillBuffer() {
+        while (_bufUsed >= _buf.size()) {
             _bufUsed = 0;
+            if (!_inflater) {
+                _buf = AWAIT _parser.readBody();
+                break;
+            } else if (_inflater->finished()) {
+                _buf.clear();
+                break;
+            }
+            // Decompress more of the body:
+            if (_encodedUsed >= _encoded.size()) {
+                _encoded = AWAIT _parser.readBody();
+                _encodedUsed = 0;
+                if (_encoded.empty()) {
+                    if (_inflater->started())
+                        RETURN CroutonError::UnexpectedEOF; // compressed data is truncated
+                    _buf.clear();                           // body is empty
+                    break;
+                }
+            }
+            ConstBytes input = ConstBytes(_encoded).without_first(_encodedUsed);
+            _buf.resize(kInflateBufferSize);
+            _buf.resize(_inflater->write(input, MutableBytes(_buf)));
+            _encodedUsed = _encoded.size() - input.size();
         }
+        RETURN noerror;
+    }
+
+    Future<ConstBytes> Response::readNoCopy(size_t maxLen) {
+        AWAIT fillBuffer();
         ConstBytes result(&_buf[_bufUsed], std::min(maxLen, _buf.size() - _bufUsed));
         _bufUsed += result.size();
         RETURN result;
     }
 
     Future<ConstBytes> Response::peekNoCopy() {
-        if (_bufUsed >= _buf.size()) {
-            _buf = AWAIT _parser.readBody();
-            _bufUsed = 0;
-        }
+        AWAIT fillBuffer();
         RETURN ConstBytes(&_buf[_bufUsed], _buf.size() - _bufUsed);
     }
 
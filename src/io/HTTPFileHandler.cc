@@ -0,0 +1,403 @@
+//
+// HTTPFileHandler.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/io/HTTPFileHandler.hh"
+#include "crouton/io/FileStream.hh"
+#include "crouton/io/Filesystem.hh"
+#include "crouton/EventLoop.hh"
+#include "crouton/Future.hh"
+#include "support/StringUtils.hh"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+#include <unordered_map>
+#include <sys/stat.h>
+
+namespace crouton::io::http {
+    using namespace std;
+    using Clock = chrono::steady_clock;
+
+
+    // (This is here instead of in HTTPHandler.cc because FileStream requires libuv.)
+    Future<void> Handler::Response::writeFile(FileStream& file, uint64_t offset, uint64_t length) {
+        precondition(!_deflater);
+        _startedBody = true;
+        AWAIT finishHeaders();
+        _handler->_capture = nullptr;       // the file isn't copied into the ResponseCache
+        IStream& stream = *_handler->_stream;
+        string buffer;
+        while (length > 0) {
+            size_t chunk = size_t(std::min(length, uint64_t(1) << 30));
+            size_t n = AWAIT stream.sendFile(file, offset, chunk);
+            if (n == 0) {
+                // The stream can't take the data directly right now, so copy a piece of it:
+                buffer.resize(std::min(chunk, size_t(65536)));
+                MutableBytes buf(buffer);
+                n = AWAIT file.preadv(&buf, 1, int64_t(offset));
+                if (n == 0)
+                    RETURN CroutonError::UnexpectedEOF;     // the file got shorter
+                AWAIT stream.write(ConstBytes(buffer.data(), n));
+            }
+            offset += n;
+            length -= n;
+        }
+        RETURN noerror;
+    }
+
+
+#pragma mark - CACHE:
+
+
+    // An open file (or a directory) and its metadata.
+    struct FileHandler::Entry {
+        explicit Entry(string const& path)  :file(path) { }
+
+        FileStream          file;
+        bool                isDirectory = false;
+        uint64_t            size = 0;
+        uint64_t            ino = 0;
+        fs::timeSpec        mtime {};
+        string              etag;           // Quoted, as in the header
+        string              lastModified;   // HTTP date
+        string_view         contentType;
+        Clock::time_point   checked;        // When the metadata was last known to be current
+        uint64_t            lastUsed = 0;   // Value of Cache::useCounter when last requested
+    };
+
+
+    // Shared state of copies of a FileHandler: its configuration and the open files.
+    struct FileHandler::Cache {
+        Cache(string root, Options options)
+        :root(std::move(root)), options(std::move(options)) { }
+
+        ASYNC<shared_ptr<Entry>> get(string const& path);
+        void add(string const& path, shared_ptr<Entry>);
+
+        string const    root;
+        Options const   options;
+        unordered_map<string, shared_ptr<Entry>> entries;  // Keys are paths, including root
+        uint64_t        useCounter = 0;
+    };
+
+
+    static string formatHTTPDate(time_t time) {
+        tm gmt;
+#ifdef _MSC_VER
+        gmt = *gmtime(&time);
+#else
+        gmtime_r(&time, &gmt);
+#endif
+        char buf[40];
+        return string(buf, strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt));
+    }
+
+
+    // True if a cached Entry still matches the file on disk.
+    static bool unchanged(string const& path, fs::timeSpec mtime, uint64_t size, uint64_t ino) {
+        try {
+            fs::statBuf st = fs::stat(path.c_str());
+            return st.size == size && st.ino == ino
+                && st.mtim.sec == mtime.sec && st.mtim.nsec == mtime.nsec;
+        } catch (...) {
+            return false;   // it's been deleted, probably
+        }
+    }
+
+
+    // Returns the Entry for a path, opening the file if it's not cached.
+    // Returns nullptr if there's no readable file or directory at the path.
+    Future<shared_ptr<FileHandler::Entry>> FileHandler::Cache::get(string const& path) {
+        if (auto i = entries.find(path); i != entries.end()) {
+            shared_ptr<Entry> entry = i->second;
+            auto now = Clock::now();
+            bool fresh = (now - entry->checked < chrono::milliseconds(options.revalidateMS));
+            if (!fresh) {
+                // `fs::stat` blocks, so call it on a background thread instead of the event loop:
+                fresh = AWAIT OnBackgroundThread<bool>([path, mtime = entry->mtime,
+                                                        size = entry->size, ino = entry->ino] {
+                    return unchanged(path, mtime, size, ino);
+                });
+                if (fresh)
+                    entry->checked = now;
+            }
+            if (fresh) {
+                entry->lastUsed = ++useCounter;
+                RETURN entry;
+            }
+            // It's changed, so reopen it. (The map may have changed while waiting for `stat`.)
+            if (auto j = entries.find(path); j != entries.end() && j->second == entry)
+                entries.erase(j);
+        }
+
+        auto entry = make_shared<Entry>(path);
+        Result<void> opened = AWAIT NoThrow(entry->file.open());
+        if (opened.isError())
+            RETURN shared_ptr<Entry>{};
+        fs::statBuf st = fs::fstat(entry->file);
+        if ((st.mode & S_IFMT) == S_IFDIR) {
+            entry->isDirectory = true;
+        } else if ((st.mode & S_IFMT) != S_IFREG) {
+            RETURN shared_ptr<Entry>{};
+        }
+        entry->size = st.size;
+        entry->ino = st.ino;
+        entry->mtime = st.mtim;
+        entry->contentType = contentTypeFor(path);
+        entry->lastModified = formatHTTPDate(time_t(st.mtim.sec));
+        // The ETag is derived from the modification time and size, like nginx's:
+        char buf[50];
+        char* end = buf;
+        *end++ = '"';
+        end = to_chars(end, std::end(buf), uint64_t(st.mtim.sec), 16).ptr;
+        *end++ = '-';
+        end = to_chars(end, std::end(buf), st.size, 16).ptr;
+        *end++ = '"';
+        entry->etag = string(buf, end);
+        entry->checked = Clock::now();
+        entry->lastUsed = ++useCounter;
+        add(path, entry);
+        RETURN entry;
+    }
+
+
+    void FileHandler::Cache::add(string const& path, shared_ptr<Entry> entry) {
+        if (options.maxCachedFiles == 0)
+            return;
+        if (entries.size() >= options.maxCachedFiles) {
+            // Evict the least recently used entry. (Requests using it keep it alive.)
+            auto lru = std::min_element(entries.begin(), entries.end(), [](auto& a, auto& b) {
+                return a.second->lastUsed < b.second->lastUsed;
+            });
+            entries.erase(lru);
+        }
+        entries.emplace(path, std::move(entry));
+    }
+
+
+#pragma mark - FILE HANDLER:
+
+
+    FileHandler::FileHandler(string root, Options options) {
+        while (root.size() > 1 && root.ends_with('/'))
+            root.pop_back();
+        _cache = make_shared<Cache>(std::move(root), std::move(options));
+    }
+
+
+    string_view FileHandler::contentTypeFor(string_view filename) {
+        static constexpr pair<string_view,string_view> kTypes[] = {
+            {"html",  "text/html; charset=utf-8"},
+            {"htm",   "text/html; charset=utf-8"},
+            {"css",   "text/css; charset=utf-8"},
+            {"js",    "text/javascript; charset=utf-8"},
+            {"mjs",   "text/javascript; charset=utf-8"},
+            {"json",  "application/json"},
+            {"txt",   "text/plain; charset=utf-8"},
+            {"md",    "text/markdown; charset=utf-8"},
+            {"xml",   "application/xml"},
+            {"svg",   "image/svg+xml"},
+            {"png",   "image/png"},
+            {"jpg",   "image/jpeg"},
+            {"jpeg",  "image/jpeg"},
+            {"gif",   "image/gif"},
+            {"webp",  "image/webp"},
+            {"ico",   "image/x-icon"},
+            {"wasm",  "application/wasm"},
+            {"pdf",   "application/pdf"},
+            {"woff",  "font/woff"},
+            {"woff2", "font/woff2"},
+            {"mp4",   "video/mp4"},
+            {"zip",   "application/zip"},
+        };
+        size_t dot = filename.rfind('.');
+        if (dot != string_view::npos && filename.find('/', dot) == string_view::npos) {
+            string_view ext = filename.substr(dot + 1);
+            for (auto& [e, type] : kTypes) {
+                if (equalIgnoringCase(ext, e))
+                    return type;
+            }
+        }
+        return "application/octet-stream";
+    }
+
+
+    // True if a relative path can't escape the root directory.
+    static bool isSafePath(string_view path) {
+        if (path.find('\0') != string_view::npos || path.find('\\') != string_view::npos)
+            return false;
+        while (!path.empty()) {
+            auto [component, rest] = split(path, '/');
+            if (component == "..")
+                return false;
+            path = rest;
+        }
+        return true;
+    }
+
+
+    // True if an `If-None-Match` header matches an ETag. (Weak comparison, per RFC 9110 13.1.2)
+    static bool matchesETag(string_view ifNoneMatch, string_view etag) {
+        if (trimWhitespace(ifNoneMatch) == "*")
+            return true;
+        while (!ifNoneMatch.empty()) {
+            auto [tag, rest] = split(ifNoneMatch, ',');
+            tag = trimWhitespace(tag);
+            if (tag.starts_with("W/"))
+                tag.remove_prefix(2);
+            if (tag == etag)
+                return true;
+            ifNoneMatch = rest;
+        }
+        return false;
+    }
+
+
+    enum class RangeResult {Ignore, Satisfiable, Unsatisfiable};
+
+    // Parses a `Range` header. Only a single byte range is supported; otherwise the header is
+    // ignored and the entire file is sent, which RFC 9110 allows.
+    static RangeResult parseRange(string_view range, uint64_t size,
+                                  uint64_t& start, uint64_t& length)
+    {
+        range = trimWhitespace(range);
+        if (!range.starts_with("bytes=") || range.find(',') != string_view::npos)
+            return RangeResult::Ignore;
+        auto [first, last] = split(range.substr(6), '-');
+        first = trimWhitespace(first);
+        last = trimWhitespace(last);
+        auto parse = [](string_view str, uint64_t& n) {
+            auto [end, err] = from_chars(str.data(), str.data() + str.size(), n);
+            return !str.empty() && err == std::errc{} && end == str.data() + str.size();
+        };
+        uint64_t a, b;
+        if (first.empty()) {
+            // Suffix range "-n": the last n bytes
+            if (!parse(last, b))
+                return RangeResult::Ignore;
+            if (b == 0 || size == 0)
+                return RangeResult::Unsatisfiable;
+            start = size - std::min(b, size);
+            length = size - start;
+        } else {
+            if (!parse(first, a))
+                return RangeResult::Ignore;
+            if (last.empty())
+                b = UINT64_MAX;
+            else if (!parse(last, b) || b < a)
+                return RangeResult::Ignore;
+            if (a >= size)
+                return RangeResult::Unsatisfiable;
+            start = a;
+            length = std::min(b, size - 1) - a + 1;
+        }
+        return RangeResult::Satisfiable;
+    }
+
+
+    static string_view toChars(char* buf, size_t bufSize, uint64_t n) {
+        return {buf, size_t(to_chars(buf, buf + bufSize, n).ptr - buf)};
+    }
+
+
+    Future<void> FileHandler::operator() (Handler::Request const& req,
+                                          Handler::Response& res) const
+    {
+        Options const& options = _cache->options;
+        string relPath = URLRef::unescape(req.params.get(options.paramName));
+        if (!isSafePath(relPath)) {
+            res.status = Status::NotFound;
+            res.writeHeader("Content-Length", "0");
+            RETURN noerror;
+        }
+        string path = _cache->root + "/" + relPath;
+        if (relPath.empty() || relPath.ends_with('/'))
+            path += options.indexFile;
+
+        shared_ptr<Entry> entry = AWAIT _cache->get(path);
+        if (!entry || (entry->isDirectory && relPath.empty())) {
+            res.status = Status::NotFound;
+            res.writeHeader("Content-Length", "0");
+            RETURN noerror;
+        } else if (entry->isDirectory) {
+            // Redirect to the path with a trailing slash, so relative links work:
+            res.status = Status::MovedPermanently;
+            res.writeHeader("Location", string(req.uri.path) + "/");
+            res.writeHeader("Content-Length", "0");
+            RETURN noerror;
+        }
+
+        res.writeHeader("ETag", entry->etag);
+        res.writeHeader("Last-Modified", entry->lastModified);
+        if (!options.cacheControl.empty())
+            res.writeHeader("Cache-Control", options.cacheControl);
+
+        // Conditional request?
+        if (string_view ifNoneMatch = req.headers.get("If-None-Match"); !ifNoneMatch.empty()) {
+            if (matchesETag(ifNoneMatch, entry->etag)) {
+                res.status = Status::NotModified;
+                RETURN noerror;
+            }
+        } else if (req.headers.get("If-Modified-Since") == entry->lastModified) {
+            // (Clients send back the Last-Modified value, so there's no need to parse dates.)
+            res.status = Status::NotModified;
+            RETURN noerror;
+        }
+
+        res.writeHeader("Content-Type", entry->contentType);
+        res.writeHeader("Accept-Ranges", "bytes");
+        char buf1[24], buf2[24], buf3[24];
+
+        // Range request?
+        uint64_t start = 0, length = entry->size;
+        if (string_view range = req.headers.get("Range"); !range.empty()) {
+            string_view ifRange = req.headers.get("If-Range");
+            if (ifRange.empty() || ifRange == entry->etag || ifRange == entry->lastModified) {
+                switch (parseRange(range, entry->size, start, length)) {
+                    case RangeResult::Ignore:
+                        break;
+                    case RangeResult::Satisfiable: {
+                        res.status = Status::PartialContent;
+                        string contentRange = "bytes ";
+                        contentRange += toChars(buf1, sizeof(buf1), start);
+                        contentRange += '-';
+                        contentRange += toChars(buf2, sizeof(buf2), start + length - 1);
+                        contentRange += '/';
+                        contentRange += toChars(buf3, sizeof(buf3), entry->size);
+                        res.writeHeader("Content-Range", contentRange);
+                        break;
+                    }
+                    case RangeResult::Unsatisfiable: {
+                        res.status = Status::RangeNotSatisfiable;
+                        string contentRange = "bytes */";
+                        contentRange += toChars(buf3, sizeof(buf3), entry->size);
+                        res.writeHeader("Content-Range", contentRange);
+                        res.writeHeader("Content-Length", "0");
+                        RETURN noerror;
+                    }
+                }
+            }
+        }
+
+        res.writeHeader("Content-Length", toChars(buf1, sizeof(buf1), length));
+        if (req.method != Method::HEAD && length > 0)
+            AWAIT res.writeFile(entry->file, start, length);
+        RETURN noerror;
+    }
+
+}
@@ -21,84 +21,364 @@
 #include "crouton/util/Logging.hh"
 #include <llhttp.h>
 #include "crouton/util/MiniOStream.hh"
+#include "support/StringUtils.hh"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <ctime>
 
 namespace crouton::io::http {
     using namespace std;
 
-    Handler::Handler(std::shared_ptr<IStream> stream, vector<Route> const& routes)
+    Handler::TimeoutStats Handler::sTimeoutStats;
+
+
+    Handler::Handler(std::shared_ptr<IStream> stream, Router const& router)
     :_stream(std::move(stream))
     ,_parser(*_stream, Parser::Request)
-    ,_routes(routes)
+    ,_router(router)
+    ,_deadline([this] {timedOut();})
     { }
 
 
     Future<void> Handler::run() {
-        // Read the request:
-        AWAIT _parser.readHeaders();
+        AdmissionController::Ticket connectionTicket;
+        if (_admission)
+            connectionTicket = _admission->connection();
+        while (true) {
+            // Read and respond to a request:
+            if (_timeouts.request > 0)
+                _requestDeadline = Deadline::Clock::now()
+                        + chrono::duration_cast<Deadline::Clock::duration>(
+                                                    chrono::duration<double>(_timeouts.request));
+            setDeadline(Phase::Headers, _timeouts.headers);
+            Result<void> result = AWAIT NoThrow(_parser.readHeaders());
+            if (result.ok())
+                result = AWAIT NoThrow(respond());
+            if (result.isError()) {
+                if (_timedOut)
+                    break;
+                _deadline.clear();
+                RETURN result.error();
+            }
+
+            // If any of the request body is unread, there's no telling where the next request
+            // starts, so don't reuse the connection:
+            if (!_parser.complete())
+                _keepAlive = false;
+
+            // Free everything allocated for the request, in one shot:
+            _parser.reset();
+
+            if (!_keepAlive)
+                break;
+            // Wait for another request, unless the client closes the connection:
+            if (!_parser.hasPipelinedData()) {
+                setDeadline(Phase::Idle, _timeouts.idle);
+                ConstBytes next = AWAIT _stream->peekNoCopy();
+                if (next.empty())
+                    break;
+            }
+        }
+        _deadline.clear();
+        AWAIT endBody();
+        RETURN noerror;
+    }
+
+
+    // Sets the deadline for a phase of the connection, limited by the request's deadline.
+    void Handler::setDeadline(Phase phase, double timeout) {
+        _phase = phase;
+        auto when = Deadline::Clock::time_point::max();
+        if (timeout > 0)
+            when = Deadline::Clock::now() + chrono::duration_cast<Deadline::Clock::duration>(
+                                                    chrono::duration<double>(timeout));
+        if (phase != Phase::Idle && _timeouts.request > 0 && _requestDeadline < when) {
+            when = _requestDeadline;
+            _phase = Phase::Request;
+        }
+        if (when < Deadline::Clock::time_point::max())
+            _deadline.setAt(when);
+        else
+            _deadline.clear();
+    }
+
+
+    // Called when the deadline expires.
+    void Handler::timedOut() {
+        static constexpr const char* kPhaseNames[] = {"idle", "headers", "body", "request"};
+        LNet->warn("HTTPHandler: {} timeout; aborting connection", kPhaseNames[int(_phase)]);
+        switch (_phase) {
+            case Phase::Idle:    ++sTimeoutStats.idle; break;
+            case Phase::Headers: ++sTimeoutStats.headers; break;
+            case Phase::Body:    ++sTimeoutStats.body; break;
+            case Phase::Request: ++sTimeoutStats.request; break;
+        }
+        _timedOut = true;
+        _keepAlive = false;
+        _stream->abort();
+    }
+
 
-        auto uri = _parser.requestURI.value();
-        string path(uri.path);
-        LNet->info("HTTPHandler: Request is {} {}", _parser.requestMethod, string(uri));
+    // Responds to a request whose headers have been read.
+    Future<void> Handler::respond() {
+        _keepAlive = _parser.keepAlive();
 
-        Headers responseHeaders;
+        string_view path = _parser.requestURI.value().path;
+        LNet->info("HTTPHandler: Request is {} {}", _parser.requestMethod, path);
+
+        // The response headers share the request's arena:
+        Headers responseHeaders(_parser.arena());
         responseHeaders.set("User-Agent", "Crouton");
-        responseHeaders.set("Connection", "close");
-
-        // Find a matching route:
-        auto status = Status::MethodNotAllowed;
-        for (auto &route : _routes) {
-            if (route.method == _parser.requestMethod) {
-                status = Status::NotFound;
-                if (regex_match(path, route.pathPattern)) {
-                    // Call the handler:
-                    AWAIT handleRequest(std::move(responseHeaders), route.handler);
-                    RETURN noerror;
-                }
+
+        // Look for a cached response:
+        bool cacheable = _cache && ResponseCache::isCacheable(_parser.requestMethod,
+                                                              _parser.headers);
+        ResponseCache::EntryRef cached;
+        if (cacheable)
+            cached = _cache->lookup(_parser.requestMethod, *_parser.requestURI, _parser.headers);
+
+        if (cached) {
+            AWAIT skipBody();
+            AWAIT writeCachedResponse(std::move(cached));
+        } else if (Router::Match match = _router.match(_parser.requestMethod, path);
+                   !match.route) {
+            // No matching route; return an error. But first read the body, so it isn't parsed
+            // as the next request on the connection:
+            AWAIT skipBody();
+            responseHeaders.set("Content-Length", "0");
+            AWAIT writeHeaders(match.status, "", responseHeaders);
+        } else {
+            // Make sure there's capacity to handle the request:
+            AdmissionController::Ticket ticket;
+            if (_admission)
+                ticket = _admission->admitRequest(match.route, match.route->maxConcurrent);
+            if (_admission && !ticket) {
+                LNet->warn("HTTPHandler: Too busy; rejecting request");
+                responseHeaders.set("Content-Length", "0");
+                responseHeaders.set("Retry-After", "1");
+                responseHeaders.set("Connection", "close");
+                AWAIT writeHeaders(Status::ServiceUnavailable, "", responseHeaders);
+            } else {
+                // Call the handler:
+                AWAIT handleRequest(std::move(responseHeaders), match.route->handler,
+                                    match.params, cacheable);
             }
         }
+        RETURN noerror;
+    }
 
-        // No matching route; return an error:
-        AWAIT writeHeaders(status, "", responseHeaders);
-        AWAIT endBody();
+
+    // Reads and discards the request body, for a request that isn't passed to a handler.
+    Future<void> Handler::skipBody() {
+        setDeadline(Phase::Body, _timeouts.body);
+        (void) _parser.latestBodyData();
+        while (!_parser.complete())
+            (void) AWAIT _parser.readBody();
+        setDeadline(Phase::Request, 0);
         RETURN noerror;
     }
 
 
     Future<void> Handler::handleRequest(Headers responseHeaders,
-                                            HandlerFunction const& handler)
+                                        HandlerFunction const& handler,
+                                        PathParams const& params,
+                                        bool cacheable)
     {
+        setDeadline(Phase::Body, _timeouts.body);
         string body = AWAIT _parser.entireBody();   //TODO: Let handler fn read at its own pace
+        setDeadline(Phase::Request, 0);
         Request request {
             _parser.requestMethod,
             _parser.requestURI.value(),
             _parser.headers,
-            std::move(body)
+            std::move(body),
+            params
         };
         Response response(this, std::move(responseHeaders));
+        _mayCache = cacheable;
+        _capture = nullptr;
         Future<void> handled = handler(request, response); // split in 2 lines bc MSVC bug
         AWAIT handled;
-        AWAIT response.finishHeaders();
-        AWAIT endBody();
+        AWAIT response.finish();
+        if (_capture)
+            _cache->store(std::move(_capture), _parser.headers);
+        else if (_cache)
+            _cache->noteRequest(request.method, request.uri, response.status);
         RETURN noerror;
     }
 
 
+    // Returns the status line for a standard status code, e.g. "HTTP/1.1 200 OK\r\n",
+    // or an empty string if the code is unknown. The table is built at compile time.
+    static string_view statusLine(Status status) {
+        static constexpr auto kStatusLines = [] {
+            std::array<string_view, 600> lines {};
+#define STATUS_LINE(NUM, NAME, STRING) lines[NUM] = "HTTP/1.1 " #NUM " " #STRING "\r\n";
+            HTTP_STATUS_MAP(STATUS_LINE)
+#undef STATUS_LINE
+            return lines;
+        }();
+        auto code = size_t(status);
+        return (code < kStatusLines.size()) ? kStatusLines[code] : string_view{};
+    }
+
+
+    // Returns a "Date:" header line, including the CRLF, for the current time.
+    // Like the logger's timestamp, it's only reformatted when the second changes.
+    static string_view dateHeader() {
+        thread_local time_t sTime = 0;
+        thread_local char   sLine[64];
+        thread_local size_t sLineLen = 0;
+        time_t now = time(nullptr);
+        if (now != sTime) {
+            sTime = now;
+            tm gmt;
+#ifdef _MSC_VER
+            gmt = *gmtime(&now);
+#else
+            gmtime_r(&now, &gmt);
+#endif
+            sLineLen = strftime(sLine, sizeof(sLine), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &gmt);
+        }
+        return {sLine, sLineLen};
+    }
+
+
+    // Appends header lines to a cached response, except for a Date header, since that would be
+    // out of date when the response is reused.
+    static void appendWithoutDate(string& data, string_view lines) {
+        while (!lines.empty()) {
+            size_t end = lines.find("\r\n");
+            end = (end == string_view::npos) ? lines.size() : end + 2;
+            string_view line = lines.substr(0, end);
+            if (!(line.size() >= 5 && equalIgnoringCase(line.substr(0, 5), "Date:")))
+                data.append(line);
+            lines.remove_prefix(end);
+        }
+    }
+
+
     Future<void> Handler::writeHeaders(Status status,
-                                           string_view statusMsg,
-                                           Headers const& headers)
+                                       string_view statusMsg,
+                                       Headers const& headers,
+                                       std::span<HeaderBlock const* const> headerBlocks)
     {
-        if (statusMsg.empty())
-            statusMsg = llhttp_status_name(llhttp_status_t(status));
-        stringstream out;
-        out << "HTTP/1.1 " << int(status) << ' ' << statusMsg << "\r\n";
+        // The response is sent as a list of fragments, so that the status line and any
+        // HeaderBlocks don't have to be copied:
+        static constexpr size_t kMaxFragments = 3 + Response::kMaxHeaderBlocks;
+        precondition(headerBlocks.size() <= Response::kMaxHeaderBlocks);
+        ConstBytes fragments[kMaxFragments];
+        size_t nFragments = 0;
+
+        // A standard status line is a constant; otherwise it's formatted below:
+        string_view line = statusMsg.empty() ? statusLine(status) : string_view{};
+        char codeBuf[8];
+        string_view code;
+        if (line.empty()) {
+            code = {codeBuf, size_t(to_chars(codeBuf, std::end(codeBuf), int(status)).ptr - codeBuf)};
+            if (statusMsg.empty())
+                statusMsg = "Unknown";
+        } else {
+            fragments[nFragments++] = line;
+        }
+
+        // Keep the connection open only if the client wants to, and the response has a known
+        // length and doesn't take over the connection (as in a WebSocket upgrade):
+        auto hasHeader = [&](string_view name) {
+            return headers.contains(name) || std::any_of(headerBlocks.begin(), headerBlocks.end(),
+                                                          [&](auto b) {return b->contains(name);});
+        };
+        bool hasBody = !(status == Status::NoContent || status == Status::NotModified
+                         || _parser.requestMethod == Method::HEAD);
+        bool explicitConnection = hasHeader("Connection");
+        if (status == Status::SwitchingProtocols || explicitConnection
+                || (hasBody && !hasHeader("Content-Length")))
+            _keepAlive = false;
+        string_view connection = (_keepAlive || explicitConnection) ? "" : "Connection: close\r\n";
+
+        // Format everything else into the arena, which outlives the write:
+        string_view date = headers.contains("Date") ? string_view{} : dateHeader();
+        size_t statusSize = line.empty() ? (9 + code.size() + 1 + statusMsg.size() + 2) : 0;
+        size_t size = statusSize + date.size() + connection.size();
         for (auto &h : headers)
-            out << h.first << ": " << h.second << "\r\n";
-        out << "\r\n";
-        return _stream->write(out.str());
+            size += h.first.size() + 2 + h.second.size() + 2;
+        char* buf = static_cast<char*>(_parser.arena().alloc(size, 1));
+        char* dst = buf;
+        auto put = [&](string_view str) {
+            ::memcpy(dst, str.data(), str.size());
+            dst += str.size();
+        };
+        if (line.empty()) {
+            put("HTTP/1.1 "); put(code); put(" "); put(statusMsg); put("\r\n");
+        }
+        put(date);
+        put(connection);
+        for (auto &h : headers) {
+            put(h.first); put(": "); put(h.second); put("\r\n");
+        }
+        assert(dst == buf + size);
+        fragments[nFragments++] = ConstBytes(buf, size);
+
+        for (HeaderBlock const* block : headerBlocks)
+            fragments[nFragments++] = block->data();
+        fragments[nFragments++] = string_view("\r\n");
+
+        if (_mayCache) {
+            // Save the response (minus the Date and Connection headers) if it's cacheable:
+            _mayCache = false;
+            auto getHeader = [&](string_view name) -> string_view {
+                if (string_view value = headers.get(name); !value.empty())
+                    return value;
+                for (HeaderBlock const* block : headerBlocks) {
+                    if (string_view value = block->get(name); !value.empty())
+                        return value;
+                }
+                return {};
+            };
+            _capture = _cache->newEntry(_parser.requestMethod, *_parser.requestURI, status,
+                                        getHeader);
+            if (_capture) {
+                string& data = _capture->data;
+                data = line.empty() ? string_view(buf, statusSize) : line;
+                _capture->statusLength = data.size();
+                size_t headersStart = statusSize + date.size() + connection.size();
+                appendWithoutDate(data, string_view(buf + headersStart, size - headersStart));
+                for (size_t i = nFragments - headerBlocks.size() - 1; i < nFragments; ++i)
+                    appendWithoutDate(data, string_view((char const*)fragments[i].data(),
+                                                        fragments[i].size()));
+            }
+        }
+
+        AWAIT _stream->write(fragments, nFragments);
+        RETURN noerror;
+    }
+
+
+    // Writes a response from the cache, adding current Date and Connection headers.
+    // The request body must already have been skipped.
+    Future<void> Handler::writeCachedResponse(ResponseCache::EntryRef entry) {
+        LNet->info("HTTPHandler: Sending cached response");
+        string_view data = entry->data;
+        ConstBytes fragments[4];
+        size_t nFragments = 0;
+        fragments[nFragments++] = data.substr(0, entry->statusLength);
+        // Copy the Date header into the arena, which outlives the write:
+        string_view date = dateHeader();
+        char* buf = static_cast<char*>(_parser.arena().alloc(date.size(), 1));
+        ::memcpy(buf, date.data(), date.size());
+        fragments[nFragments++] = ConstBytes(buf, date.size());
+        if (!_keepAlive)
+            fragments[nFragments++] = string_view("Connection: close\r\n");
+        fragments[nFragments++] = data.substr(entry->statusLength);
+        AWAIT _stream->write(fragments, nFragments);
+        RETURN noerror;
     }
 
 
     Future<void> Handler::writeToBody(string str) {
+        if (_capture)
+            _capture->data += str;
         return _stream->write(std::move(str));   //TODO: Write via the Parser
     }
 
@@ -108,6 +388,46 @@ namespace crouton::io::http {
     }
 
 
+#pragma mark - HEADER BLOCK:
+
+
+    HeaderBlock::HeaderBlock(std::initializer_list<Headers::Entry> headers) {
+        for (auto& [name, value] : headers)
+            add(name, value);
+    }
+
+    HeaderBlock::HeaderBlock(Headers const& headers) {
+        for (auto& [name, value] : headers)
+            add(name, value);
+    }
+
+    // Returns the position of the line with the given header name, or npos.
+    size_t HeaderBlock::find(string_view name) const noexcept {
+        for (size_t pos = 0; pos < _data.size(); ) {
+            size_t colon = _data.find(':', pos);
+            if (equalIgnoringCase(string_view(_data).substr(pos, colon - pos), name))
+                return pos;
+            pos = _data.find('\n', colon) + 1;
+        }
+        return string::npos;
+    }
+
+    string_view HeaderBlock::get(string_view name) const noexcept {
+        size_t pos = find(name);
+        if (pos == string::npos)
+            return {};
+        size_t start = pos + name.size() + 2;       // skip ": "
+        return string_view(_data).substr(start, _data.find('\r', start) - start);
+    }
+
+    void HeaderBlock::add(string_view name, string_view value) {
+        _data += Headers::canonicalName(string(name));
+        _data += ": ";
+        _data += value;
+        _data += "\r\n";
+    }
+
+
 #pragma mark - RESPONSE:
 
 
@@ -118,19 +438,104 @@ namespace crouton::io::http {
 
     void Handler::Response::writeHeader(string_view name, string_view value) {
         precondition(!_sentHeaders);
-        _headers.set(string(name), string(value));
+        _headers.set(name, value);
+    }
+
+    void Handler::Response::writeHeaders(HeaderBlock const& block) {
+        precondition(!_sentHeaders && _nHeaderBlocks < kMaxHeaderBlocks);
+        _headerBlocks[_nHeaderBlocks++] = &block;
+    }
+
+    // Returns a header's value, from `_headers` or the HeaderBlocks.
+    string_view Handler::Response::getHeader(string_view name) const {
+        if (string_view value = _headers.get(name); !value.empty())
+            return value;
+        for (size_t i = 0; i < _nHeaderBlocks; ++i) {
+            if (string_view value = _headerBlocks[i]->get(name); !value.empty())
+                return value;
+        }
+        return {};
+    }
+
+    // Called before the first write to the body; decides whether to compress it.
+    void Handler::Response::startBody(size_t firstWriteSize) {
+        _startedBody = true;
+        Compression const& options = _handler->_compression;
+        if (!options.enabled || _handler->_parser.requestMethod == Method::HEAD)
+            return;
+        if (int code = int(status); code < 200 || code == 204 || code == 304)
+            return;
+        if (!getHeader("Content-Encoding").empty() || !isCompressibleType(getHeader("Content-Type")))
+            return;
+
+        // Compare the Content-Length if known, else the first write, with the threshold:
+        size_t size = firstWriteSize;
+        string_view length = getHeader("Content-Length");
+        if (!length.empty()) {
+            if (!_headers.contains("Content-Length"))
+                return;     // it's in a HeaderBlock, so it can't be changed
+            from_chars(length.data(), length.data() + length.size(), size);
+        }
+        if (size < options.minSize)
+            return;
+
+        // The response now depends on Accept-Encoding, which caches need to know:
+        _headers.add("Vary", "Accept-Encoding");
+        auto encoding = negotiateEncoding(_handler->_parser.headers.get("Accept-Encoding"));
+        if (encoding == ContentEncoding::Identity)
+            return;
+        _deflater = Deflater::get(encoding, options.level);
+        _headers.set("Content-Encoding", encodingName(encoding));
+        if (!length.empty()) {
+            // The compressed length isn't known until the end, so buffer the body till then:
+            _headers.remove("Content-Length");
+            _compressedBody.emplace();
+        }
     }
 
     Future<void> Handler::Response::writeToBody(string str) {
+        if (!_startedBody)
+            startBody(str.size());
+        if (_deflater) {
+            if (_compressedBody) {
+                _deflater->write(ConstBytes(str), *_compressedBody);
+                RETURN noerror;
+            }
+            // When streaming, flush each write so the client can decode it right away:
+            string compressed;
+            _deflater->write(ConstBytes(str), compressed, true);
+            str = std::move(compressed);
+        }
         AWAIT finishHeaders();
         AWAIT _handler->writeToBody(std::move(str));
         RETURN noerror;
     }
 
+    // Called after the HandlerFunction returns.
+    Future<void> Handler::Response::finish() {
+        if (_deflater) {
+            string body = _compressedBody ? std::move(*_compressedBody) : string();
+            _deflater->finish(body);
+            _deflater = nullptr;
+            if (_compressedBody) {
+                char lengthBuf[24];
+                auto end = to_chars(lengthBuf, std::end(lengthBuf), body.size()).ptr;
+                _headers.set("Content-Length", string_view(lengthBuf, end - lengthBuf));
+                _compressedBody = nullopt;
+            }
+            AWAIT finishHeaders();
+            AWAIT _handler->writeToBody(std::move(body));
+        } else {
+            AWAIT finishHeaders();
+        }
+        RETURN noerror;
+    }
+
     Future<void> Handler::Response::finishHeaders() {
         if (!_sentHeaders) {
             LNet->info("HTTPHandler: Sending {} response", status);
-            AWAIT _handler->writeHeaders(status, statusMessage, _headers);
+            AWAIT _handler->writeHeaders(status, statusMessage, _headers,
+                                         {_headerBlocks.data(), _nHeaderBlocks});
         }
         _sentHeaders = true;
         RETURN noerror;
@@ -138,7 +543,269 @@ namespace crouton::io::http {
 
     Future<IStream*> Handler::Response::rawStream() {
         AWAIT finishHeaders();
+        _handler->_capture = nullptr;       // the response can't be cached
+        _handler->_deadline.clear();        // the caller is responsible for timeouts now
         RETURN _handler->_stream.get();
     }
 
+
+
+#pragma mark - PATH PARAMS:
+
+
+    string_view PathParams::get(string_view name) const noexcept {
+        for (size_t i = 0; i < _count; ++i) {
+            if (_items[i].first == name)
+                return _items[i].second;
+        }
+        return {};
+    }
+
+    optional<int64_t> PathParams::getInt(string_view name) const noexcept {
+        string_view str = get(name);
+        int64_t n;
+        auto [end, err] = std::from_chars(str.data(), str.data() + str.size(), n);
+        if (str.empty() || err != std::errc{} || end != str.data() + str.size())
+            return nullopt;
+        return n;
+    }
+
+    bool PathParams::add(string_view name, string_view value) noexcept {
+        if (_count >= kMaxParams)
+            return false;
+        _items[_count++] = {name, value};
+        return true;
+    }
+
+
+#pragma mark - ROUTER:
+
+
+    // Number of Methods routes can use. The parser can produce others, like PATCH, since Method
+    // values come straight from llhttp, so check against this before indexing by method.
+    static constexpr size_t kNumMethods = size_t(Method::OPTIONS) + 1;
+
+    // Types of path parameter.
+    enum class ParamType : uint8_t {
+        Any,        // `:name`     -- any non-empty path component
+        Int,        // `:name<int>` -- a decimal integer
+        Rest,       // `*name`     -- the entire rest of the path
+    };
+
+
+    /* A node in the radix tree. Each node's `prefix` is the literal text of the edge leading to
+       it, or for a parameter node, the parameter name. Static children are checked first
+       (they're distinguished by their first character), then parameters in order of
+       specificity. */
+    struct Router::Node {
+        string                    prefix;       // Literal text, or the parameter name
+        ParamType                 paramType = ParamType::Any;
+        bool                      isParam = false;
+        vector<unique_ptr<Node>>  children;     // Static children
+        vector<unique_ptr<Node>>  params;       // Parameter children, most specific first
+        array<Route const*,kNumMethods> routes {}; // Routes ending at this node, by method
+
+        bool hasRoutes() const {
+            return std::any_of(routes.begin(), routes.end(), [](auto r) {return r != nullptr;});
+        }
+
+        // Finds or creates the static child for `text`, splitting edges as needed.
+        // Returns the node at the end of `text`.
+        Node* addStatic(string_view text) {
+            if (text.empty())
+                return this;
+            for (auto& child : children) {
+                string_view cp = child->prefix;
+                if (cp[0] != text[0])
+                    continue;
+                size_t n = 1;
+                while (n < cp.size() && n < text.size() && cp[n] == text[n])
+                    ++n;
+                if (n < cp.size()) {
+                    // Split the child's edge at the end of the common prefix:
+                    auto mid = make_unique<Node>();
+                    mid->prefix = string(cp.substr(0, n));
+                    child->prefix.erase(0, n);
+                    mid->children.push_back(std::move(child));
+                    child = std::move(mid);
+                }
+                return child->addStatic(text.substr(n));
+            }
+            auto& child = children.emplace_back(make_unique<Node>());
+            child->prefix = string(text);
+            return child.get();
+        }
+
+        // Finds or creates a parameter child.
+        Node* addParam(string_view name, ParamType type) {
+            for (auto& p : params) {
+                if (p->prefix == name && p->paramType == type)
+                    return p.get();
+            }
+            auto node = make_unique<Node>();
+            node->prefix = string(name);
+            node->paramType = type;
+            node->isParam = true;
+            // Keep more specific types first; the wildcard always goes last:
+            auto pos = std::find_if(params.begin(), params.end(), [&](auto& p) {
+                return p->paramType > type;
+            });
+            return params.insert(pos, std::move(node))->get();
+        }
+
+        // Recursively matches the rest of a path. Returns the Route for `method`, or nullptr.
+        // Sets `pathMatched` if any route matches the path regardless of method.
+        Route const* match(string_view path, Method method,
+                           PathParams& params, bool& pathMatched) const
+        {
+            if (path.empty()) {
+                if (hasRoutes()) {
+                    pathMatched = true;
+                    return size_t(method) < kNumMethods ? routes[size_t(method)] : nullptr;
+                }
+            } else {
+                for (auto& child : children) {
+                    if (path.starts_with(child->prefix)) {
+                        auto rest = path.substr(child->prefix.size());
+                        if (auto r = child->match(rest, method, params, pathMatched))
+                            return r;
+                        break;      // no other static child can share a first character
+                    }
+                }
+            }
+            for (auto& param : this->params) {
+                size_t end;
+                if (param->paramType == ParamType::Rest)
+                    end = path.size();
+                else
+                    end = std::min(path.find('/'), path.size());
+                string_view value = path.substr(0, end);
+                if (!param->matchesValue(value))
+                    continue;
+                size_t nParams = params.size();
+                if (params.add(param->prefix, value)) {
+                    if (auto r = param->match(path.substr(end), method, params, pathMatched))
+                        return r;
+                    params.truncate(nParams);
+                }
+            }
+            return nullptr;
+        }
+
+        bool matchesValue(string_view value) const {
+            switch (paramType) {
+                case ParamType::Any:
+                    return !value.empty();
+                case ParamType::Int:
+                    return !value.empty() && std::all_of(value.begin(), value.end(),
+                                                         [](char c) {return c >= '0' && c <= '9';});
+                case ParamType::Rest:
+                    return true;
+            }
+            return false;
+        }
+    };
+
+
+    static bool isParamNameChar(char c) {
+        return isAlphanumeric(c) || c == '_';
+    }
+
+
+    Router::Router(std::initializer_list<Route> routes)
+    :Router(vector<Route>(routes))
+    { }
+
+    Router::Router(vector<Route> routes)
+    :_routes(std::move(routes))
+    ,_root(make_unique<Node>())
+    {
+        // (_routes must not be modified after this, since the tree points to its items.)
+        for (auto& route : _routes) {
+            if (route.pathRegex)
+                _regexRoutes.push_back(&route);
+            else
+                insert(route);
+        }
+    }
+
+    Router::~Router() = default;
+
+
+    // Parses a Route's path pattern and adds it to the tree.
+    void Router::insert(Route const& route) {
+        string_view pattern = route.path;
+        if (size_t(route.method) >= kNumMethods)
+            Error::raise(CroutonError::InvalidArgument, "Unsupported HTTP route method");
+        if (!pattern.starts_with('/'))
+            Error::raise(CroutonError::InvalidArgument, "HTTP route path must start with '/'");
+        Node* node = _root.get();
+        size_t nParams = 0;
+        while (!pattern.empty()) {
+            // Add the literal text up to the next parameter:
+            size_t pos = pattern.find_first_of(":*");
+            node = node->addStatic(pattern.substr(0, pos));
+            if (pos == string_view::npos)
+                break;
+            if (pos > 0 && pattern[pos - 1] != '/')
+                Error::raise(CroutonError::InvalidArgument,
+                             "HTTP route parameter must be a complete path component");
+            if (++nParams > PathParams::kMaxParams)
+                Error::raise(CroutonError::InvalidArgument, "HTTP route has too many parameters");
+
+            // Parse the parameter name and type:
+            bool rest = (pattern[pos] == '*');
+            size_t nameEnd = pos + 1;
+            while (nameEnd < pattern.size() && isParamNameChar(pattern[nameEnd]))
+                ++nameEnd;
+            string_view name = pattern.substr(pos + 1, nameEnd - pos - 1);
+            if (name.empty())
+                Error::raise(CroutonError::InvalidArgument, "HTTP route parameter needs a name");
+            pattern = pattern.substr(nameEnd);
+            ParamType type = rest ? ParamType::Rest : ParamType::Any;
+            if (!rest && pattern.starts_with("<int>")) {
+                type = ParamType::Int;
+                pattern = pattern.substr(5);
+            }
+            if (rest ? !pattern.empty() : !(pattern.empty() || pattern.starts_with('/')))
+                Error::raise(CroutonError::InvalidArgument,
+                             "HTTP route parameter must be a complete path component");
+            node = node->addParam(name, type);
+        }
+
+        auto& slot = node->routes[size_t(route.method)];
+        if (slot)
+            Error::raise(CroutonError::InvalidArgument, "Duplicate HTTP route");
+        slot = &route;
+    }
+
+
+    Router::Match Router::match(Method method, string_view path) const {
+        Match result;
+        if (size_t(method) >= kNumMethods) {
+            // No route can have this method:
+            result.status = Status::NotImplemented;
+            return result;
+        }
+        bool pathMatched = false;
+        result.route = _root->match(path, method, result.params, pathMatched);
+        if (!result.route) {
+            result.params = PathParams{};
+            for (auto route : _regexRoutes) {
+                if (regex_match(path.begin(), path.end(), *route->pathRegex)) {
+                    if (route->method == method) {
+                        result.route = route;
+                        break;
+                    }
+                    pathMatched = true;
+                }
+            }
+        }
+        if (result.route)
+            result.status = Status::OK;
+        else
+            result.status = pathMatched ? Status::MethodNotAllowed : Status::NotFound;
+        return result;
+    }
+
 }
@@ -43,15 +43,147 @@ namespace crouton::io::http {
     }
 
 
-    string Headers::canonicalName(string name) {
+#pragma mark - HEADERS:
+
+
+    static void canonicalize(char* begin, char* end) {
         bool inWord = false;
-        for (char &c : name) {
-            c = inWord ? toLower(c) : toUpper(c);
-            inWord = isAlphanumeric(c);
+        for (char* c = begin; c != end; ++c) {
+            *c = inWord ? toLower(*c) : toUpper(*c);
+            inWord = isAlphanumeric(*c);
         }
+    }
+
+    string Headers::canonicalName(string name) {
+        canonicalize(name.data(), name.data() + name.size());
         return name;
     }
 
+
+    Headers::Headers(Headers const& h)
+    :Headers()
+    {
+        *this = h;
+    }
+
+    Headers& Headers::operator=(Headers const& h) {
+        if (&h != this) {
+            clear();
+            for (auto& [name, value] : h)
+                push({_arena->copy(name), _arena->copy(value)});
+        }
+        return *this;
+    }
+
+    Headers::Headers(Headers&& h) noexcept
+    :Headers()
+    {
+        *this = std::move(h);
+    }
+
+    Headers& Headers::operator=(Headers&& h) noexcept {
+        if (&h != this) {
+            // An Arena's memory doesn't move, so the entries' string_views remain valid:
+            if (h._arena == &h._ownArena) {
+                _ownArena = std::move(h._ownArena);
+                _arena = &_ownArena;
+            } else {
+                _arena = h._arena;
+            }
+            _size = h._size;
+            _capacity = h._capacity;
+            if (h._heapEntries) {
+                _heapEntries = std::move(h._heapEntries);
+                _entries = _heapEntries.get();
+            } else {
+                _heapEntries.reset();
+                _entries = _inline;
+                std::copy(h._inline, h._inline + h._size, _inline);
+            }
+            h._entries = h._inline;
+            h._size = 0;
+            h._capacity = kInlineCapacity;
+        }
+        return *this;
+    }
+
+
+    Headers::Entry const* Headers::find(string_view name) const noexcept {
+        for (auto i = begin(); i != end(); ++i) {
+            if (equalIgnoringCase(i->first, name))
+                return i;
+        }
+        return nullptr;
+    }
+
+    string_view Headers::get(string_view name) const noexcept {
+        auto entry = find(name);
+        return entry ? entry->second : string_view{};
+    }
+
+    // Copies a header name into the arena and canonicalizes it in place.
+    string_view Headers::copyName(string_view name) {
+        string_view copied = _arena->copy(name);
+        auto begin = const_cast<char*>(copied.data());
+        canonicalize(begin, begin + copied.size());
+        return copied;
+    }
+
+    void Headers::set(string_view name, string_view value) {
+        if (auto entry = find(name))
+            entry->second = _arena->copy(value);
+        else
+            push({copyName(name), _arena->copy(value)});
+    }
+
+    void Headers::add(string_view name, string_view value) {
+        if (auto entry = find(name))
+            entry->second = _arena->append(_arena->append(entry->second, ", "), value);
+        else
+            push({copyName(name), _arena->copy(value)});
+    }
+
+    // Adds a header whose name and value are already stored in my arena (used by Parser.)
+    void Headers::addOwned(string_view name, string_view value) {
+        auto begin = const_cast<char*>(name.data());
+        canonicalize(begin, begin + name.size());
+        if (auto entry = find(name))
+            entry->second = _arena->append(_arena->append(entry->second, ", "), value);
+        else
+            push({name, value});
+    }
+
+    bool Headers::remove(string_view name) noexcept {
+        if (auto entry = find(name)) {
+            std::move(entry + 1, _entries + _size, entry);
+            --_size;
+            return true;
+        }
+        return false;
+    }
+
+    void Headers::clear() noexcept {
+        _size = 0;
+        if (_arena == &_ownArena)
+            _ownArena.reset();
+    }
+
+    void Headers::push(Entry entry) {
+        if (_size == _capacity) {
+            size_t newCapacity = 2 * _capacity;
+            auto newEntries = make_unique<Entry[]>(newCapacity);
+            std::copy(_entries, _entries + _size, newEntries.get());
+            _heapEntries = std::move(newEntries);
+            _entries = _heapEntries.get();
+            _capacity = newCapacity;
+        }
+        _entries[_size++] = entry;
+    }
+
+
+#pragma mark - PARSER:
+
+
 #define SELF ((Parser*)parser->data)
 
     Parser::Parser(IStream* stream, Role role)
@@ -59,26 +191,46 @@ namespace crouton::io::http {
     ,_role(role)
     ,_settings(make_unique<llhttp_settings_s>())
     ,_parser(make_unique<llhttp_t>())
+    ,_arena(make_unique<util::Arena>())
     {
+        headers = Headers(*_arena);
         llhttp_settings_init(_settings.get());
 
+        // All strings are accumulated directly in the arena, since llhttp may deliver them in
+        // pieces if they span multiple reads:
         _settings->on_status = [](llhttp_t* parser, const char *data, size_t length) -> int {
-            SELF->statusMessage = string(data, length);
+            SELF->statusMessage = SELF->_arena->append(SELF->statusMessage, {data, length});
             return 0;
         };
         _settings->on_url = [](llhttp_t* parser, const char *data, size_t length) -> int {
-            SELF->requestURI = URL(string(data, length));
+            SELF->_curURL = SELF->_arena->append(SELF->_curURL, {data, length});
+            return 0;
+        };
+        _settings->on_url_complete = [](llhttp_t* parser) -> int {
+            // URLRef needs a C string, so add a NUL terminator:
+            string_view url = SELF->_arena->append(SELF->_curURL, string_view("", 1));
+            SELF->requestURI.emplace(url.data());
+            SELF->_curURL = {};
             return 0;
         };
         _settings->on_header_field = [](llhttp_t* parser, const char *data, size_t length) -> int {
-            SELF->_curHeaderName = string(data, length);
+            SELF->_curHeaderName = SELF->_arena->append(SELF->_curHeaderName, {data, length});
             return 0;
         };
         _settings->on_header_value = [](llhttp_t* parser, const char *data, size_t length) -> int {
-            return SELF->addHeader(string(data, length));
+            SELF->_curHeaderValue = SELF->_arena->append(SELF->_curHeaderValue, {data, length});
+            return 0;
+        };
+        _settings->on_header_value_complete = [](llhttp_t* parser) -> int {
+            precondition(!SELF->_curHeaderName.empty());
+            SELF->headers.addOwned(SELF->_curHeaderName, SELF->_curHeaderValue);
+            SELF->_curHeaderName = SELF->_curHeaderValue = {};
+            return 0;
         };
         _settings->on_headers_complete = [](llhttp_t* parser) -> int {
             SELF->_headersComplete = true;
+            // (llhttp clears the flags this depends on once the message is complete.)
+            SELF->_keepAlive = llhttp_should_keep_alive(parser) != 0;
             return 0;
         };
         _settings->on_body = [](llhttp_t* parser, const char *data, size_t length) -> int {
@@ -86,7 +238,9 @@ namespace crouton::io::http {
         };
         _settings->on_message_complete = [](llhttp_t* parser) -> int {
             SELF->_messageComplete = true;
-            return 0;
+            // Stop here, so that any data after this message (a pipelined request) doesn't get
+            // parsed until `reset`. But let llhttp go on to report an upgrade.
+            return llhttp_get_upgrade(parser) ? 0 : HPE_PAUSED;
         };
 
         llhttp_init(_parser.get(),
@@ -105,11 +259,32 @@ namespace crouton::io::http {
     }
 
 
+    void Parser::reset() {
+        llhttp_reset(_parser.get());
+        requestURI = nullopt;
+        status = Status::Unknown;
+        statusMessage = {};
+        headers.clear();
+        _curURL = _curHeaderName = _curHeaderValue = {};
+        _arena->reset();
+        _body.clear();
+        _headersComplete = _messageComplete = _upgraded = _keepAlive = false;
+        // (`_leftover` is kept, since it's the start of the next message.)
+    }
+
+
     Future<void> Parser::readHeaders() {
         precondition(_stream);
         if (!_stream->isOpen())
             AWAIT _stream->open();
 
+        if (!_leftover.empty()) {
+            // Start with the data that followed the previous message:
+            string leftover = std::move(_leftover);
+            _leftover.clear();
+            if (parseData(leftover))
+                RETURN noerror;
+        }
         while (true) {
             ConstBytes data = AWAIT _stream->readNoCopy();
             if (parseData(data))
@@ -132,7 +307,8 @@ namespace crouton::io::http {
     }
 
     Future<string> Parser::entireBody() {
-        string entireBody;
+        // Start with any body data that arrived along with the headers:
+        string entireBody = latestBodyData();
         while (!complete()) {
             entireBody += (AWAIT readBody());
         }
@@ -156,6 +332,13 @@ namespace crouton::io::http {
                 const char* end = llhttp_get_error_pos(_parser.get());
                 assert((byte*)end >= data.data() && (byte*)end <= data.data() + data.size());
                 _body = string(end, (char*)data.data() + data.size() - end);
+            } else if (err == HPE_PAUSED) {
+                // The message is complete. Save any data after it for the next one:
+                if (data.size() > 0) {
+                    const char* end = llhttp_get_error_pos(_parser.get());
+                    assert((byte*)end >= data.data() && (byte*)end <= data.data() + data.size());
+                    _leftover = string(end, (char*)data.data() + data.size() - end);
+                }
             } else {
                 Error::raise(CroutonError::ParseError, llhttp_get_error_reason(_parser.get()));
             }
@@ -172,14 +355,6 @@ namespace crouton::io::http {
     }
 
 
-    int Parser::addHeader(string const& value) {
-        precondition(!_curHeaderName.empty());
-        this->headers.add(_curHeaderName, value);
-        _curHeaderName = "";
-        return 0;
-    }
-
-
     int Parser::gotBody(const char *data, size_t length) {
         _body.append(data, length);
         return 0;
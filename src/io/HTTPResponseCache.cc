@@ -0,0 +1,231 @@
+//
+// HTTPResponseCache.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/io/HTTPResponseCache.hh"
+#include "support/StringUtils.hh"
+#include <charconv>
+
+namespace crouton::io::http {
+    using namespace std;
+
+
+    // The key of a request: the method (as a byte), followed by the path and query.
+    static string makeKey(Method method, string_view path, string_view query) {
+        string key;
+        key.reserve(1 + path.size() + 1 + query.size());
+        key += char(method);
+        key += path;
+        if (!query.empty()) {
+            key += '?';
+            key += query;
+        }
+        return key;
+    }
+
+    static string makeKey(Method method, URLRef const& uri) {
+        return makeKey(method, uri.path, uri.query);
+    }
+
+
+    // Concatenates the values of the request headers named in a `Vary` header.
+    static string varyValues(string_view vary, Headers const& requestHeaders) {
+        string values;
+        while (!vary.empty()) {
+            auto [name, rest] = split(vary, ',');
+            vary = rest;
+            values += requestHeaders.get(trimWhitespace(name));
+            values += '\0';
+        }
+        return values;
+    }
+
+
+    bool ResponseCache::isCacheable(Method method, Headers const& headers) noexcept {
+        if (method != Method::GET && method != Method::HEAD)
+            return false;
+        for (auto& [name, value] : headers) {
+            if (equalIgnoringCase(name, "Authorization") || equalIgnoringCase(name, "Range")
+                    || equalIgnoringCase(name, "If-None-Match")
+                    || equalIgnoringCase(name, "If-Modified-Since"))
+                return false;
+            if (equalIgnoringCase(name, "Cache-Control") || equalIgnoringCase(name, "Pragma")) {
+                if (value.find("no-cache") != string_view::npos)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+
+    ResponseCache::EntryRef ResponseCache::lookup(Method method,
+                                                  URLRef const& uri,
+                                                  Headers const& requestHeaders)
+    {
+        string key = makeKey(method, uri);
+        auto now = Clock::now();
+        auto [i, end] = _index.equal_range(key);
+        while (i != end) {
+            LRUList::iterator pos = i->second;
+            ++i;        // (in case `pos` is removed)
+            Entry const& entry = **pos;
+            if (entry.expires <= now) {
+                remove(pos);
+            } else if (entry.vary.empty()
+                       || entry.varyValues == varyValues(entry.vary, requestHeaders)) {
+                ++_stats.hits;
+                _lru.splice(_lru.begin(), _lru, pos);       // move to front
+                return *pos;
+            }
+        }
+        ++_stats.misses;
+        return nullptr;
+    }
+
+
+    shared_ptr<ResponseCache::Entry> ResponseCache::newEntry(Method method,
+                                                             URLRef const& uri,
+                                                             Status status,
+                                                             HeaderGetter const& getHeader)
+    {
+        switch (int(status)) {
+            case 200: case 203: case 204: case 301: case 404: case 410:
+                break;
+            default:
+                return nullptr;
+        }
+
+        // The length must be known (and not too big), so the whole response can be captured:
+        size_t length;
+        string_view lengthStr = getHeader("Content-Length");
+        auto [lengthEnd, err] = from_chars(lengthStr.data(), lengthStr.data() + lengthStr.size(),
+                                           length);
+        if (lengthStr.empty() || err != errc{} || length > _options.maxEntrySize)
+            return nullptr;
+
+        string_view vary = getHeader("Vary");
+        if (vary.find('*') != string_view::npos || !getHeader("Set-Cookie").empty()
+                || !getHeader("Connection").empty())
+            return nullptr;
+
+        // Look at the Cache-Control directives:
+        double ttl = _options.ttl;
+        string_view cacheControl = getHeader("Cache-Control");
+        while (!cacheControl.empty()) {
+            auto [directive, rest] = split(cacheControl, ',');
+            cacheControl = rest;
+            auto [name, arg] = split(trimWhitespace(directive), '=');
+            if (equalIgnoringCase(name, "no-store") || equalIgnoringCase(name, "no-cache")
+                    || equalIgnoringCase(name, "private")) {
+                return nullptr;
+            } else if (equalIgnoringCase(name, "max-age") || equalIgnoringCase(name, "s-maxage")) {
+                unsigned maxAge;
+                if (from_chars(arg.data(), arg.data() + arg.size(), maxAge).ec == errc{})
+                    ttl = std::min(ttl, double(maxAge));
+            }
+        }
+        if (ttl <= 0)
+            return nullptr;
+
+        auto entry = make_shared<Entry>();
+        entry->key = makeKey(method, uri);
+        entry->vary = string(vary);
+        entry->expires = Clock::now()
+                       + chrono::duration_cast<Clock::duration>(chrono::duration<double>(ttl));
+        return entry;
+    }
+
+
+    void ResponseCache::store(shared_ptr<Entry> entry, Headers const& requestHeaders) {
+        if (entry->data.size() > _options.maxEntrySize)
+            return;
+        if (!entry->vary.empty())
+            entry->varyValues = varyValues(entry->vary, requestHeaders);
+
+        // Replace any existing response for the same request:
+        auto [i, end] = _index.equal_range(entry->key);
+        while (i != end) {
+            LRUList::iterator pos = i->second;
+            ++i;
+            if ((*pos)->vary == entry->vary && (*pos)->varyValues == entry->varyValues)
+                remove(pos);
+        }
+
+        _size += entry->data.size();
+        _lru.push_front(std::move(entry));
+        _index.emplace(_lru.front()->key, _lru.begin());
+
+        while (_size > _options.maxSize) {
+            remove(std::prev(_lru.end()));
+            ++_stats.evictions;
+        }
+    }
+
+
+    void ResponseCache::noteRequest(Method method, URLRef const& uri, Status status) {
+        switch (method) {
+            case Method::POST:
+            case Method::PUT:
+            case Method::DELETE:
+                if (int(status) >= 200 && int(status) < 400)
+                    invalidate(uri.path, uri.query);
+                break;
+            default:
+                break;
+        }
+    }
+
+
+    void ResponseCache::invalidate(string_view uri) {
+        auto [path, query] = split(uri, '?');
+        invalidate(path, query);
+    }
+
+
+    void ResponseCache::invalidate(string_view path, string_view query) {
+        for (Method method : {Method::GET, Method::HEAD}) {
+            auto [i, end] = _index.equal_range(makeKey(method, path, query));
+            while (i != end) {
+                LRUList::iterator pos = i->second;
+                ++i;
+                remove(pos);
+            }
+        }
+    }
+
+
+    void ResponseCache::clear() {
+        _index.clear();
+        _lru.clear();
+        _size = 0;
+    }
+
+
+    // Removes an Entry. (A response still being written keeps its Entry alive till it's done.)
+    void ResponseCache::remove(LRUList::iterator pos) {
+        auto [i, end] = _index.equal_range((*pos)->key);
+        for (; i != end; ++i) {
+            if (i->second == pos) {
+                _index.erase(i);
+                break;
+            }
+        }
+        _size -= (*pos)->data.size();
+        _lru.erase(pos);
+    }
+
+}
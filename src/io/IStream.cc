@@ -141,11 +141,16 @@ namespace crouton::io {
         if (nBuffers == 1) {
             AWAIT write(buffers[0]);
         } else if (nBuffers > 1) {
-            // After the first AWAIT the caller's stack frame will be gone,
-            // and also the buffers[] C array. So copy it into a vector:
-            vector<ConstBytes> buffersCopy(&buffers[0], &buffers[nBuffers]);
-            for (auto& buffer : buffersCopy)
-                AWAIT write(buffer);
+            // Concatenate the buffers, so they're written in one call that can't be interleaved
+            // with another write (and so the buffers[] array needn't outlive the first AWAIT):
+            size_t total = 0;
+            for (size_t i = 0; i < nBuffers; ++i)
+                total += buffers[i].size();
+            string data;
+            data.reserve(total);
+            for (size_t i = 0; i < nBuffers; ++i)
+                data.append((const char*)buffers[i].data(), buffers[i].size());
+            AWAIT write(ConstBytes(data));
         }
         RETURN noerror;
     }
@@ -156,4 +161,9 @@ namespace crouton::io {
     }
 
 
+    Future<size_t> IStream::sendFile(FileStream&, uint64_t, size_t) {
+        return size_t(0);
+    }
+
+
 }
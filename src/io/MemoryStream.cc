@@ -0,0 +1,228 @@
+//
+// MemoryStream.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/io/MemoryStream.hh"
+#include "crouton/CoCondition.hh"
+#include "crouton/Future.hh"
+#include "Internal.hh"
+#include <deque>
+
+namespace crouton::io {
+    using namespace std;
+
+
+    /** One direction of a MemoryStream pair: the data one stream has written and the other
+        hasn't read yet. */
+    struct MemoryStream::Channel {
+        // A write's data: either the writer's own buffer, or a copy in `owned`.
+        struct Chunk {
+            ConstBytes  bytes;                  // The unread part
+            string      owned;                  // Storage of a buffered copy
+        };
+
+        explicit Channel(size_t bufSize)        :bufferSize(bufSize) { }
+
+        // Forgets the chunks the reader has finished with. Called at the start of every read,
+        // since until then the reader may still be using the bytes returned by the last one.
+        void release() {
+            while (!chunks.empty() && chunks.front().bytes.empty()) {
+                Chunk& chunk = chunks.front();
+                if (chunk.owned.empty())
+                    --borrowed;
+                else
+                    buffered -= chunk.owned.size();
+                chunks.pop_front();
+            }
+            if (borrowed == 0)
+                released.notifyAll();
+        }
+
+        // Discards everything, after the reader closes or the pair is aborted.
+        void drop() {
+            chunks.clear();
+            borrowed = buffered = queued = 0;
+            released.notifyAll();
+        }
+
+        deque<Chunk>    chunks;                 // Unread data, in order
+        size_t const    bufferSize;             // Max total size of copied chunks
+        size_t          buffered = 0;           // Total size of copied chunks
+        size_t          borrowed = 0;           // Number of chunks pointing to the writer's data
+        size_t          queued = 0;             // Total unread bytes
+        bool            writeClosed = false;    // The writer has closed its side
+        bool            readClosed = false;     // The reader has closed its side
+        bool            broken = false;         // Aborted: reads return EOF, writes fail
+        CoCondition     readable;               // Notified when data is added or writing ends
+        CoCondition     released;               // Notified when `borrowed` drops to 0
+    };
+
+
+    pair<MemoryStream::Ref,MemoryStream::Ref> MemoryStream::createPair(size_t bufferSize) {
+        auto a = make_shared<Channel>(bufferSize), b = make_shared<Channel>(bufferSize);
+        return { make_shared<MemoryStream>(a, b), make_shared<MemoryStream>(b, a) };
+    }
+
+
+    MemoryStream::MemoryStream(shared_ptr<Channel> in, shared_ptr<Channel> out)
+    :_in(std::move(in))
+    ,_out(std::move(out))
+    { }
+
+
+    MemoryStream::~MemoryStream() {
+        shutdown();
+    }
+
+
+    Future<void> MemoryStream::open() {
+        return Future<void>();
+    }
+
+
+    // Closes both directions, telling the peer.
+    void MemoryStream::shutdown() {
+        if (_open) {
+            _open = false;
+            _out->writeClosed = true;
+            _out->readable.notifyAll();
+            _in->release();         // a writer whose data I've all read has succeeded
+            _in->readClosed = true;
+            _in->readable.notifyAll();
+            _in->released.notifyAll();
+        }
+    }
+
+
+    Future<void> MemoryStream::close() {
+        shutdown();
+        return Future<void>();
+    }
+
+
+    Future<void> MemoryStream::closeWrite() {
+        precondition(isOpen());
+        _out->writeClosed = true;
+        _out->readable.notifyAll();
+        return Future<void>();
+    }
+
+
+    void MemoryStream::abort() {
+        for (Channel* channel : {_in.get(), _out.get()}) {
+            channel->broken = true;
+            channel->readable.notifyAll();
+            channel->released.notifyAll();
+        }
+    }
+
+
+#pragma mark - READING:
+
+
+    /// Waits until there's unread data, or the peer has stopped writing.
+    Future<void> MemoryStream::waitForData() {
+        Channel& in = *_in;
+        in.release();
+        while (in.chunks.empty() && !in.writeClosed && !in.readClosed && !in.broken)
+            AWAIT in.readable;
+        RETURN noerror;
+    }
+
+
+    Future<ConstBytes> MemoryStream::readNoCopy(size_t maxLen) {
+        precondition(isOpen());
+        NotReentrant nr(_readBusy);
+        AWAIT waitForData();
+        Channel& in = *_in;
+        if (in.chunks.empty() || in.broken)
+            RETURN ConstBytes{};    // EOF
+        ConstBytes result = in.chunks.front().bytes.read(maxLen);
+        in.queued -= result.size();
+        RETURN result;
+    }
+
+
+    Future<ConstBytes> MemoryStream::peekNoCopy() {
+        precondition(isOpen());
+        NotReentrant nr(_readBusy);
+        AWAIT waitForData();
+        Channel& in = *_in;
+        if (in.chunks.empty() || in.broken)
+            RETURN ConstBytes{};    // EOF
+        RETURN in.chunks.front().bytes;
+    }
+
+
+#pragma mark - WRITING:
+
+
+    size_t MemoryStream::bytesQueued() const {
+        return _out->queued;
+    }
+
+
+    Future<void> MemoryStream::write(ConstBytes buf) {
+        return write(&buf, 1);
+    }
+
+
+    Future<void> MemoryStream::write(const ConstBytes buffers[], size_t nBuffers) {
+        precondition(isOpen() && !_out->writeClosed);
+        NotReentrant nr(_writeBusy);
+        Channel& out = *_out;
+        if (out.readClosed || out.broken)
+            RETURN Error(CroutonError::Disconnected, "writing to a MemoryStream");
+
+        size_t total = 0;
+        for (size_t i = 0; i < nBuffers; ++i)
+            total += buffers[i].size();
+        if (total == 0)
+            RETURN noerror;
+        out.queued += total;
+
+        if (out.buffered + total <= out.bufferSize) {
+            // It fits in the buffer, so copy it and return:
+            auto& chunk = out.chunks.emplace_back();
+            chunk.owned.reserve(total);
+            for (size_t i = 0; i < nBuffers; ++i)
+                chunk.owned.append((const char*)buffers[i].data(), buffers[i].size());
+            chunk.bytes = ConstBytes(chunk.owned);
+            out.buffered += total;
+            out.readable.notifyAll();
+            RETURN noerror;
+        }
+
+        // Otherwise lend the reader my buffers, and wait until it's done with them:
+        for (size_t i = 0; i < nBuffers; ++i) {
+            if (!buffers[i].empty()) {
+                out.chunks.push_back({.bytes = buffers[i]});
+                ++out.borrowed;
+            }
+        }
+        out.readable.notifyAll();
+        while (out.borrowed > 0 && !out.readClosed && !out.broken)
+            AWAIT out.released;
+        if (out.borrowed > 0) {
+            // The reader went away before reading it all; forget my buffers before returning:
+            out.drop();
+            RETURN Error(CroutonError::Disconnected, "writing to a MemoryStream");
+        }
+        RETURN noerror;
+    }
+
+}
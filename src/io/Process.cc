@@ -66,14 +66,14 @@ namespace crouton::io {
 
     optional<string_view> Args::first() const {
         optional<string_view> arg;
-        if (size() >= 1)
+        if (size() >= 2)
             arg = at(1);
         return arg;
     }
 
     optional<string_view> Args::popFirst() {
         optional<string_view> arg;
-        if (size() >= 1) {
+        if (size() >= 2) {
             arg = std::move(at(1));
             erase(begin() + 1);
         }
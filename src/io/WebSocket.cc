@@ -17,11 +17,14 @@
 //
 
 #include "crouton/io/WebSocket.hh"
+#include "crouton/EventLoop.hh"
 #include "crouton/util/Logging.hh"
 #include "crouton/Misc.hh"
 #include "crouton/util/MiniOStream.hh"
 #include "support/StringUtils.hh"
 #include "Internal.hh"
+#include "WebSocketDeflate.hh"
+#include "WebSocketMask.hh"
 #include "WebSocketProtocol.hh"
 #include <mbedtls/base64.h>
 #include <mbedtls/sha1.h>
@@ -52,6 +55,76 @@ namespace crouton {
 namespace crouton::io::ws {
     using namespace std;
 
+    static constexpr size_t kMaxMessageLength = 1 << 20;
+
+    // Max size of a frame header: 2 bytes, an 8-byte extended length, and a 4-byte mask key.
+    static constexpr size_t kMaxHeaderSize = 14;
+
+
+    // A client frame has to be copied in order to mask it. The buffers for that are pooled
+    // per thread, except for big ones.
+    struct FrameBuffer {
+        unique_ptr<byte[]>  data;
+        size_t              capacity = 0;
+    };
+
+    static constexpr size_t kMaxPooledBuffers = 8;
+    static constexpr size_t kMaxPooledBufferSize = 64 * 1024;
+    static thread_local vector<FrameBuffer> tFrameBuffers;
+
+    static FrameBuffer takeFrameBuffer(size_t size) {
+        for (auto i = tFrameBuffers.rbegin(); i != tFrameBuffers.rend(); ++i) {
+            if (i->capacity >= size) {
+                FrameBuffer buf = std::move(*i);
+                tFrameBuffers.erase(std::next(i).base());
+                return buf;
+            }
+        }
+        size = std::max(size, size_t(1024));
+        return FrameBuffer{unique_ptr<byte[]>(new byte[size]), size};
+    }
+
+    static void recycleFrameBuffer(FrameBuffer&& buf) {
+        if (buf.capacity > kMaxPooledBufferSize)
+            return;
+        if (tFrameBuffers.size() >= kMaxPooledBuffers)
+            tFrameBuffers.erase(tFrameBuffers.begin());     // drop the least recently used
+        tFrameBuffers.push_back(std::move(buf));
+    }
+
+
+    // Received messages' strings are pooled per thread too, if the app recycles them.
+    // Ones small enough to fit inline in a string aren't worth pooling.
+    static constexpr size_t kMinPooledMessageSize = 64;
+    static thread_local vector<string> tMessageBuffers;
+
+    // Makes `str` empty, with room for `size` bytes, reusing a pooled buffer if possible.
+    static void takeMessageBuffer(string& str, size_t size) {
+        if (size >= kMinPooledMessageSize) {
+            for (auto i = tMessageBuffers.rbegin(); i != tMessageBuffers.rend(); ++i) {
+                if (i->capacity() >= size) {
+                    str.swap(*i);
+                    tMessageBuffers.erase(std::next(i).base());
+                    return;
+                }
+            }
+        }
+        str.reserve(size);
+    }
+
+
+    // Limits on how much data the parser is given at a time; see `consumeUntilFull`.
+    // It's less when compressed, since one byte can expand to a thousand.
+    static constexpr size_t kMinConsumeChunkSize = 64;
+    static constexpr size_t kMaxConsumeChunkSize = 16 * 1024;
+    static constexpr size_t kMaxCompressedConsumeChunkSize = 1024;
+
+    // Size of the pieces `sendStream` sends, and `receiveFragments` produces.
+    static constexpr size_t kStreamFragmentSize = 64 * 1024;
+
+
+
+    WebSocket::WebSocket(bool isClient) :_isClient(isClient) { }
 
     WebSocket::~WebSocket() {disconnect();}
 
@@ -63,6 +136,8 @@ namespace crouton::io::ws {
             if (!_incoming.empty())
                 LNet->warn("WebSocket closing with {} unread incoming messages",
                         _incoming.size());
+            if (!_pending.empty())
+                (void) AWAIT NoThrow(flush());
             AWAIT _stream->close();
             _stream = nullptr;
         }
@@ -74,30 +149,290 @@ namespace crouton::io::ws {
         if (!_incoming.empty())
             LNet->warn("WebSocket disconnected with {} unread incoming messages",
                     _incoming.size());
+        if (_flushTimer)
+            _flushTimer->stop();
+        _flushScheduled = false;
+        dropPending();
         _stream = nullptr;
     }
 
 
+    // Note: The send methods start writing to the stream before they first suspend, which is
+    // what keeps messages in order even if the caller doesn't wait for them.
+
     Future<void> WebSocket::send(ConstBytes message, Message::Type type) {
-        // Note: This method is not a coroutine, and it passes the message to _stream->write
-        // as a `string`, so the caller does not need to keep the data valid.
-        LNet->info("WebSocket sending message: {}, {} bytes", type, message.size());
+        if (Error err = checkSend(type, message.size()))
+            RETURN err;
+        if (shouldCompress(type, message.size())) {
+            // Compressing makes a new buffer, which can be masked in place:
+            AWAIT sendFrame(_deflate->compress(message), type, true);
+        } else {
+            AWAIT writeFrame(message, type, true);
+        }
+        RETURN noerror;
+    }
+
+
+    Future<void> WebSocket::sendStream(IStream& source, Message::Type type) {
+        if (type != Message::Text && type != Message::Binary)
+            RETURN Error(CroutonError::InvalidArgument, "Only Text or Binary messages can be streamed");
+        if (Error err = checkSend(type, 0))
+            RETURN err;
+        _sendingStream = true;
+        // Each frame is sent before the next read, which invalidates the data. Since EOF isn't
+        // known until a read returns nothing, the final frame is an empty one.
+        // Errors are caught, so that `_sendingStream` is always cleared.
+        Message::Type frameType = type;
+        bool started = false;           // True once a frame has been (partly) written
+        Error error;
+        while (true) {
+            Result<ConstBytes> data = AWAIT NoThrow(source.readNoCopy(kStreamFragmentSize));
+            if (data.isError()) {
+                error = data.error();
+                break;
+            }
+            bool fin = data->empty();
+            started = true;
+            Result<void> written = AWAIT NoThrow(writeFrame(*data, frameType, fin));
+            if (written.isError()) {
+                error = written.error();
+                break;
+            }
+            if (fin)
+                break;
+            frameType = Message::Continuation;
+        }
+        _sendingStream = false;
+
+        if (error && started && !_closeSent && _stream) {
+            // The peer has received part of a message that can never be finished, so the only
+            // way to end it is to close the connection:
+            LNet->error("WebSocket failed to finish sending a streamed message: {}", error);
+            (void) AWAIT NoThrow(send(Message(CloseCode::CantFulfill,
+                                              "Couldn't finish sending a message")));
+        }
+        RETURN error;
+    }
+
+
+    Future<void> WebSocket::send(string message, Message::Type type) {
+        if (Error err = checkSend(type, message.size()))
+            RETURN err;
+        bool compressed = shouldCompress(type, message.size());
+        if (compressed)
+            message = _deflate->compress(message);
+        AWAIT sendFrame(std::move(message), type, compressed);
+        RETURN noerror;
+    }
+
+
+    // Sends a frame whose payload this object owns, so it can be masked in place.
+    Future<void> WebSocket::sendFrame(string payload, Message::Type type, bool compressed) {
+        if (canCoalesce(kMaxHeaderSize + payload.size())) {
+            AWAIT waitForBatch(coalesceFrame(payload, type, compressed, true));
+            RETURN noerror;
+        }
+        writePending();
+        std::array<byte, kMaxHeaderSize> header;
+        size_t headerLen = formatHeader(header.data(), payload.size(), type, compressed, true);
+        if (_isClient) {
+            byte* data = (byte*)payload.data();
+            applyMask(data, data, payload.size(), &header[headerLen - 4]);
+        }
+        std::array<ConstBytes, 2> bufs {ConstBytes(header.data(), headerLen), ConstBytes(payload)};
+        AWAIT _stream->write(bufs.data(), bufs.size());
+        RETURN noerror;
+    }
+
+
+    // Sends an uncompressed frame whose payload belongs to the caller.
+    Future<void> WebSocket::writeFrame(ConstBytes payload, Message::Type type, bool fin) {
+        if (canCoalesce(kMaxHeaderSize + payload.size())) {
+            AWAIT waitForBatch(coalesceFrame(payload, type, false, fin));
+            RETURN noerror;
+        }
+        writePending();
+        if (_isClient) {
+            // Copy the payload into a pooled buffer after the header, masking it as it goes:
+            FrameBuffer buf = takeFrameBuffer(kMaxHeaderSize + payload.size());
+            size_t headerLen = formatHeader(buf.data.get(), payload.size(), type, false, fin);
+            applyMask(&buf.data[headerLen], payload.data(), payload.size(), &buf.data[headerLen - 4]);
+            AWAIT _stream->write(ConstBytes(buf.data.get(), headerLen + payload.size()));
+            recycleFrameBuffer(std::move(buf));
+        } else {
+            // Write the header and the caller's payload together, without copying:
+            std::array<byte, kMaxHeaderSize> header;
+            size_t headerLen = formatHeader(header.data(), payload.size(), type, false, fin);
+            std::array<ConstBytes, 2> bufs {ConstBytes(header.data(), headerLen), payload};
+            AWAIT _stream->write(bufs.data(), bufs.size());
+        }
+        RETURN noerror;
+    }
+
+
+    // Returns an error if a message can't be sent, and notes when a Close message is sent.
+    Error WebSocket::checkSend(Message::Type type, size_t size) {
+        LNet->info("WebSocket sending message: {}, {} bytes", type, size);
         if (_closeSent || !_stream)
             return Error(CroutonError::LogicError, "WebSocket is already closing");
+        if (_sendingStream && type != Message::Close && type != Message::Ping
+                           && type != Message::Pong)
+            return Error(CroutonError::LogicError, "WebSocket is still sending a streamed message");
         if (type == Message::Close)
             _closeSent = true;
-        string frame(message.size() + 10, 0);
-        size_t frameLen = formatMessage(frame.data(), message, type);
-        frame.resize(frameLen);
-        return _stream->write(frame);
+        return noerror;
     }
 
 
+    bool WebSocket::shouldCompress(Message::Type type, size_t size) const {
+        return _deflate && (type == Message::Text || type == Message::Binary)
+                        && _deflate->shouldCompress(size);
+    }
+
+
+    size_t WebSocket::bytesQueued() const {
+        return _stream ? _pending.size() + _stream->bytesQueued() : 0;
+    }
+
+
+#pragma mark - COALESCING:
+
+
+    // While coalescing, small frames are appended to `_pending` instead of being written.
+    // `_pending` is written as one batch when `_flushTimer` fires, when it reaches `maxBytes`,
+    // or before any frame that isn't coalesced, so frames are always written in order.
+    // Each sender waits for its batch, identified by the value of `_batchesStarted` after the
+    // batch has been started.
+
+    void WebSocket::setCoalescing(CoalesceOptions const& opts) {
+        _coalesce = opts;
+        if (!_coalesce.enabled)
+            writePending();
+    }
+
+
+    Future<void> WebSocket::flush() {
+        writePending();
+        AWAIT waitForBatch(_batchesStarted);
+        RETURN noerror;
+    }
+
+
+    bool WebSocket::canCoalesce(size_t frameSize) const {
+        return _coalesce.enabled && frameSize <= _coalesce.maxBytes;
+    }
+
+
+    // Appends a frame to `_pending`, masking the payload as it's copied if this is a client.
+    // Returns the number of the batch it'll be written in.
+    uint64_t WebSocket::coalesceFrame(ConstBytes payload, Message::Type type,
+                                      bool compressed, bool fin)
+    {
+        size_t start = _pending.size();
+        _pending.resize(start + kMaxHeaderSize + payload.size());
+        byte* dst = (byte*)&_pending[start];
+        size_t headerLen = formatHeader(dst, payload.size(), type, compressed, fin);
+        if (_isClient)
+            applyMask(dst + headerLen, payload.data(), payload.size(), dst + headerLen - 4);
+        else
+            ::memcpy(dst + headerLen, payload.data(), payload.size());
+        _pending.resize(start + headerLen + payload.size());
+        uint64_t batch = _batchesStarted + 1;
+        pendingAdded();
+        return batch;
+    }
+
+
+    // Appends an already-formatted frame to `_pending`.
+    uint64_t WebSocket::coalesceBytes(ConstBytes frame) {
+        _pending.append((const char*)frame.data(), frame.size());
+        uint64_t batch = _batchesStarted + 1;
+        pendingAdded();
+        return batch;
+    }
+
+
+    void WebSocket::pendingAdded() {
+        if (_pending.size() >= _coalesce.maxBytes) {
+            writePending();
+        } else if (!_flushScheduled) {
+            if (!_flushTimer)
+                _flushTimer = make_unique<Timer>([this] {
+                    _flushScheduled = false;
+                    writePending();
+                });
+            _flushTimer->once(_coalesce.maxDelay);
+            _flushScheduled = true;
+        }
+    }
+
+
+    // Starts writing `_pending`, if it isn't empty.
+    void WebSocket::writePending() {
+        if (_flushScheduled) {
+            _flushTimer->stop();
+            _flushScheduled = false;
+        }
+        if (!_pending.empty()) {
+            if (_stream) {
+                (void) writeBatch(std::move(_pending), ++_batchesStarted);
+                _pending = string();
+            } else {
+                dropPending();
+            }
+        }
+    }
+
+
+    // Discards `_pending`, which can't be written without a stream, and wakes its senders with
+    // an error. The batch it would have been written in counts as done, as do any in progress.
+    void WebSocket::dropPending() {
+        _pending.clear();
+        if (!_batchError)
+            _batchError = Error(CroutonError::Disconnected, "WebSocket disconnected");
+        _batchesWritten = ++_batchesStarted;
+        _batchWritten.notifyAll();
+    }
+
+
+    Future<void> WebSocket::writeBatch(string data, uint64_t batch) {
+        Result<void> result = AWAIT NoThrow(_stream->write(data));
+        if (result.isError() && !_batchError)
+            _batchError = result.error();
+        _batchesWritten = std::max(_batchesWritten, batch);   // (dropPending may be ahead)
+        _batchWritten.notifyAll();
+        RETURN noerror;
+    }
+
+
+    Future<void> WebSocket::waitForBatch(uint64_t batch) {
+        while (_batchesWritten < batch)
+            AWAIT _batchWritten;
+        if (_batchError)
+            RETURN _batchError;
+        RETURN noerror;
+    }
+
+
+#pragma mark - RECEIVING:
+
+
     Generator<Message> WebSocket::receive() {
+        return receiveMessages(false);
+    }
+
+
+    Generator<Message> WebSocket::receiveFragments() {
+        return receiveMessages(true);
+    }
+
+
+    Generator<Message> WebSocket::receiveMessages(bool fragments) {
+        _receivingFragments = fragments;
         while (_stream && !_closeReceived) {
             while (_incoming.empty()) {
                 LNet->warn("WebSocket reading...");
-                ConstBytes data = AWAIT _stream->readNoCopy(100000);
+                ConstBytes data = AWAIT _stream->peekNoCopy();
                 if (data.size() == 0) {
                     LNet->warn("WebSocket closed unexpectedly");
                     YIELD Message(CloseCode::Abnormal, "WebSocket closed unexpectedly");
@@ -105,11 +440,15 @@ namespace crouton::io::ws {
                 }
                 LNet->warn("WebSocket read {} bytes", data.size());
                 // Pass the data to the 3rd-party WebSocket parser, which will call handleFragment.
-                consume(data);
+                // If the queue fills up, the rest of the data is left in the stream, which won't
+                // read any more from the network until it's asked to.
+                size_t consumed = consumeUntilFull(data);
+                (void) AWAIT _stream->readNoCopy(consumed);
             }
 
             Message msg = std::move(_incoming.front());
             _incoming.pop_front();
+            _incomingBytes -= msg.size();
             LNet->info("WebSocket received message: {}, {} bytes", msg.type, msg.size());
 
             using enum Message::Type;
@@ -123,9 +462,11 @@ namespace crouton::io::ws {
                     break;
                 case Ping:
                     (void) send(ConstBytes{}, Pong);
+                    recycle(std::move(msg));
                     break;
                 case Pong:
                     //TODO: Send periodic Pings and disconnect if no Pong received in time
+                    recycle(std::move(msg));
                     break;
                 default:
                     LNet->warn("WebSocket received unknown message type {}", int(msg.type));
@@ -135,6 +476,53 @@ namespace crouton::io::ws {
     }
 
 
+    // Passes data to the parser a chunk at a time, until it's all consumed or the incoming
+    // queue is full. Returns the number of bytes consumed.
+    // Each chunk is small enough that the messages parsed from it can't overshoot the queue's
+    // limits by much: a frame is at least 2 bytes, and uncompressed data doesn't grow.
+    size_t WebSocket::consumeUntilFull(ConstBytes data) {
+        size_t consumed = 0;
+        while (consumed < data.size() && !incomingFull()) {
+            size_t n = std::min(2 * (_receiveLimits.maxQueuedMessages - _incoming.size()),
+                                _receiveLimits.maxQueuedBytes - _incomingBytes);
+            n = std::clamp(n, kMinConsumeChunkSize,
+                           _deflate ? kMaxCompressedConsumeChunkSize : kMaxConsumeChunkSize);
+            n = std::min(n, data.size() - consumed);
+            consume(ConstBytes(data.data() + consumed, n));
+            consumed += n;
+        }
+        return consumed;
+    }
+
+
+    bool WebSocket::incomingFull() const {
+        // (An empty queue is never full, so a message can always be read.)
+        return !_incoming.empty() && (_incoming.size() >= _receiveLimits.maxQueuedMessages
+                                      || _incomingBytes >= _receiveLimits.maxQueuedBytes);
+    }
+
+
+    void WebSocket::recycle(Message&& msg) {
+        static constexpr size_t kMaxPooledMessages = 16;
+        if (msg.capacity() < kMinPooledMessageSize || msg.capacity() > kMaxPooledBufferSize)
+            return;
+        if (tMessageBuffers.size() >= kMaxPooledMessages)
+            tMessageBuffers.erase(tMessageBuffers.begin());
+        msg.clear();
+        tMessageBuffers.push_back(std::move(static_cast<string&>(msg)));
+    }
+
+
+
+    // Called from inside consume() when a frame has the RSV1 bit set, which means the message
+    // is compressed. Returns false if that's not allowed.
+    bool WebSocket::setCompressed() {
+        if (!_deflate)
+            return false;
+        _frameCompressed = true;
+        return true;
+    }
+
 
     // Called from inside consume(), called by receive(), above.
     // A single receive might result in multiple messages, so we queue them in `_incoming`.
@@ -144,20 +532,53 @@ namespace crouton::io::ws {
                                    uint8_t opCode,
                                    bool fin)
     {
+        // (This is called repeatedly for a frame that arrives in pieces, but setCompressed is
+        // only called before the first piece, so the flag is only seen once.)
+        bool frameCompressed = std::exchange(_frameCompressed, false);
+
+        // A control frame may arrive between the frames of a data message, so it's kept apart:
+        bool control = opCode >= Message::Close;
+        std::optional<Message>& cur = control ? _curControl : _curMessage;
+
         // Beginning:
-        if (!_curMessage) {
-            _curMessage.emplace();
-            _curMessage->reserve(dataLen + remainingBytes);
-            _curMessage->type = (Message::Type)opCode;
+        if (!cur) {
+            if (frameCompressed && control)
+                protocolError("Control frame is compressed");
+            cur.emplace();
+            // (When delivering in pieces, a frame of any size is cut into kStreamFragmentSize.)
+            size_t capacity = dataLen + remainingBytes;
+            if (_receivingFragments && !control)
+                capacity = std::min(capacity, kStreamFragmentSize);
+            takeMessageBuffer(*cur, capacity);
+            cur->type = (Message::Type)opCode;
+            if (!control)
+                _curCompressed = frameCompressed;
+        } else if (frameCompressed) {
+            protocolError("Continuation frame has RSV1 bit set");
         }
 
         // Data:
-        _curMessage->append((char*)data, dataLen);
-
-        // End:
-        if (fin && remainingBytes == 0) {
-            _incoming.emplace_back(std::move(_curMessage.value()));
-            _curMessage = nullopt;
+        bool end = fin && remainingBytes == 0;
+        if (!control && _curCompressed)
+            _deflate->decompress(ConstBytes(data, dataLen), *cur, end, kMaxMessageLength);
+        else
+            cur->append((char*)data, dataLen);
+        if (!_receivingFragments && cur->size() > kMaxMessageLength)
+            Error::raise(CloseCode::MessageTooBig, "WebSocket message too big");
+
+        // End, or enough of a message to deliver in pieces:
+        if (end) {
+            _incomingBytes += cur->size();
+            _incoming.emplace_back(std::move(cur.value()));
+            cur = nullopt;
+        } else if (_receivingFragments && !control && cur->size() >= kStreamFragmentSize) {
+            Message::Type type = cur->type;
+            cur->partial = true;
+            _incomingBytes += cur->size();
+            _incoming.emplace_back(std::move(cur.value()));
+            cur.emplace();
+            takeMessageBuffer(*cur, kStreamFragmentSize);
+            cur->type = type;
         }
         return true;
     }
@@ -190,7 +611,8 @@ namespace crouton::io::ws {
 
 
     ClientWebSocket::ClientWebSocket(string_view urlStr)
-    :_connection(urlStr)
+    :WebSocket(true)
+    ,_connection(urlStr)
     ,_clientParser(make_unique<uWS::ClientProtocol>())
     {
         // Generate a base64-encoded 16-byte random `Sec-WebSocket-Key`:
@@ -231,6 +653,9 @@ namespace crouton::io::ws {
 
 
     Future<void> ClientWebSocket::connect() {
+        if (_compressionOptions.enabled)
+            _request.headers.set("Sec-WebSocket-Extensions",
+                                 DeflateParams::clientOffer(_compressionOptions));
         http::Response response = AWAIT _connection.send(_request);
 
         _responseHeaders = response.headers();
@@ -242,6 +667,14 @@ namespace crouton::io::ws {
         if (_accept != _responseHeaders.get("Sec-WebSocket-Accept"))
            protocolError("Server returned wrong Sec-WebSocket-Accept value");
 
+        string_view extensions = _responseHeaders.get("Sec-WebSocket-Extensions");
+        if (!extensions.empty() && !_compressionOptions.enabled)
+            protocolError("Server accepted an unrequested WebSocket extension");
+        if (auto params = DeflateParams::parseServerResponse(extensions, _compressionOptions)) {
+            LNet->info("WebSocket: using permessage-deflate");
+            _deflate = make_unique<PerMessageDeflate>(*params, _compressionOptions);
+        }
+
         _stream = &response.upgradedStream();
         RETURN noerror;
     }
@@ -253,13 +686,17 @@ namespace crouton::io::ws {
     }
 
 
-    size_t ClientWebSocket::formatMessage(void* dst, ConstBytes message, Message::Type type) {
-        return uWS::ClientProtocol::formatMessage((byte*)dst,
-                                             (const char*)message.data(),
-                                             message.size(),
-                                             uWS::OpCode(type),
-                                             message.size(),
-                                             false);
+    size_t ClientWebSocket::formatHeader(byte* dst, size_t payloadLen, Message::Type type,
+                                         bool compressed, bool fin)
+    {
+        // Given no data, formatMessage writes just the header (including the mask key):
+        return uWS::ClientProtocol::formatMessage(dst,
+                                                  (const char*)dst,
+                                                  0,
+                                                  uWS::OpCode(type),
+                                                  payloadLen,
+                                                  compressed,
+                                                  fin);
     }
 
 
@@ -272,7 +709,8 @@ namespace crouton::io::ws {
 
 
     ServerWebSocket::ServerWebSocket()
-    :_serverParser(make_unique<uWS::ServerProtocol>())
+    :WebSocket(false)
+    ,_serverParser(make_unique<uWS::ServerProtocol>())
     { }
 
     ServerWebSocket::~ServerWebSocket() = default;
@@ -298,7 +736,7 @@ namespace crouton::io::ws {
             RETURN false;
         }
 
-        string key = request.headers.get("Sec-WebSocket-Key");
+        string key(request.headers.get("Sec-WebSocket-Key"));
         string accept = ClientWebSocket::generateAcceptResponse(key.c_str());
 
         response.status = http::Status::SwitchingProtocols;
@@ -307,6 +745,14 @@ namespace crouton::io::ws {
         response.writeHeader("Sec-WebSocket-Accept", accept);
         if (!subprotocol.empty())
             response.writeHeader("Sec-WebSocket-Protocol", subprotocol);
+        if (_compressionOptions.enabled) {
+            string_view offers = request.headers.get("Sec-WebSocket-Extensions");
+            if (auto params = DeflateParams::acceptClientOffer(offers, _compressionOptions)) {
+                LNet->info("WebSocket: using permessage-deflate");
+                response.writeHeader("Sec-WebSocket-Extensions", params->serverResponse());
+                _deflate = make_unique<PerMessageDeflate>(*params, _compressionOptions);
+            }
+        }
         
         // Send the response and take over the socket stream:
         _stream = AWAIT response.rawStream();
@@ -314,13 +760,16 @@ namespace crouton::io::ws {
     }
 
 
-    size_t ServerWebSocket::formatMessage(void* dst, ConstBytes message, Message::Type type) {
-        return uWS::ServerProtocol::formatMessage((byte*)dst,
-                                                  (const char*)message.data(),
-                                                  message.size(),
+    size_t ServerWebSocket::formatHeader(byte* dst, size_t payloadLen, Message::Type type,
+                                         bool compressed, bool fin)
+    {
+        return uWS::ServerProtocol::formatMessage(dst,
+                                                  (const char*)dst,
+                                                  0,
                                                   uWS::OpCode(type),
-                                                  message.size(),
-                                                  false);
+                                                  payloadLen,
+                                                  compressed,
+                                                  fin);
     }
 
 
@@ -329,6 +778,88 @@ namespace crouton::io::ws {
     }
 
 
+    Future<void> ServerWebSocket::send(PreparedMessageRef msg) {
+        // (`msg` is a parameter, so the coroutine keeps it alive until the write completes.)
+        if (Error err = checkSend(msg->type(), msg->size()))
+            RETURN err;
+        ConstBytes frame = msg->frameFor(_deflate.get());
+        if (canCoalesce(frame.size())) {
+            AWAIT waitForBatch(coalesceBytes(frame));
+        } else {
+            writePending();
+            AWAIT _stream->write(frame);
+        }
+        RETURN noerror;
+    }
+
+
+    size_t ServerWebSocket::broadcast(PreparedMessageRef const& msg,
+                                      span<ServerWebSocket* const> sockets,
+                                      size_t maxQueued)
+    {
+        size_t count = 0;
+        for (ServerWebSocket* socket : sockets) {
+            if (socket->_closeSent || !socket->_stream)
+                continue;
+            if (socket->bytesQueued() > maxQueued) {
+                LNet->debug("WebSocket broadcast skipping a socket with {} bytes queued",
+                            socket->bytesQueued());
+                continue;
+            }
+            (void) socket->send(msg);   // no need to wait
+            ++count;
+        }
+        return count;
+    }
+
+
+#pragma mark - PREPARED MESSAGE:
+
+
+    PreparedMessage::PreparedMessage(ConstBytes payload,
+                                     Message::Type type,
+                                     CompressionOptions const& compression)
+    :_size(payload.size())
+    ,_type(type)
+    {
+        auto frame = [&](ConstBytes data, bool compressed) {
+            string result(kMaxHeaderSize + data.size(), 0);
+            size_t len = uWS::ServerProtocol::formatMessage((byte*)result.data(),
+                                                            (const char*)data.data(),
+                                                            data.size(),
+                                                            uWS::OpCode(type),
+                                                            data.size(),
+                                                            compressed);
+            result.resize(len);
+            return result;
+        };
+
+        _frame = frame(payload, false);
+
+        if (CROUTON_USE_ZLIB && compression.enabled
+                && (type == Message::Text || type == Message::Binary)
+                && payload.size() >= compression.minSize) {
+            // Compress with a new context, so the output doesn't depend on any earlier message:
+            _windowBits = compression.windowBits;
+            PerMessageDeflate deflate({.windowBits = _windowBits, .noContextTakeover = true},
+                                      compression);
+            string compressed = deflate.compress(payload);
+            if (compressed.size() < payload.size())
+                _compressedFrame = frame(compressed, true);
+        }
+    }
+
+
+    // A compressed frame can only go to a socket that compresses each message independently,
+    // since otherwise the peer expects it to refer back to that socket's earlier messages.
+    ConstBytes PreparedMessage::frameFor(PerMessageDeflate const* deflate) const {
+        if (!_compressedFrame.empty() && deflate && deflate->params().noContextTakeover
+                                      && deflate->params().windowBits >= _windowBits)
+            return ConstBytes(_compressedFrame);
+        return ConstBytes(_frame);
+    }
+
+
 #pragma mark - MESSAGE:
 
 
@@ -423,8 +954,7 @@ namespace crouton::io::ws {
 
 // The rest of the implementation of uWS::WebSocketProtocol, which calls into WebSocket:
 namespace uWS {
-
-    static constexpr size_t kMaxMessageLength = 1 << 20;
+    using crouton::io::ws::kMaxMessageLength;
 
 
 // The `user` parameter points to the owning WebSocketImpl object.
@@ -432,12 +962,13 @@ namespace uWS {
 
     template <const bool isServer>
     bool WebSocketProtocol<isServer>::setCompressed(void* user) {
-        return false;  //TODO: Implement compression
+        return USER_SOCK->setCompressed();
     }
 
     template <const bool isServer>
     bool WebSocketProtocol<isServer>::refusePayloadLength(void* user, size_t length) {
-        return length > kMaxMessageLength;
+        // A frame's size doesn't matter if it's delivered in pieces:
+        return length > kMaxMessageLength && !USER_SOCK->_receivingFragments;
     }
 
     template <const bool isServer>
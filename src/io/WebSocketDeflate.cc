@@ -0,0 +1,320 @@
+//
+// WebSocketDeflate.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// For the permessage-deflate extension, see: https://www.rfc-editor.org/rfc/rfc7692
+// For zlib API documentation, see: https://zlib.net/manual.html
+
+#include "WebSocketDeflate.hh"
+#include "crouton/Error.hh"
+#include "support/StringUtils.hh"
+
+#if CROUTON_USE_ZLIB
+#  include <zlib.h>
+#else
+   struct z_stream_s { };
+#endif
+
+namespace crouton::io::ws {
+    using namespace std;
+
+    static constexpr string_view kExtensionName = "permessage-deflate";
+
+    // zlib won't create a raw deflate stream with an 8-bit window, so that's not supported for
+    // compressing. (Decompressing with one is fine.)
+    static constexpr int kMinWindowBits = 9;
+
+
+#pragma mark - NEGOTIATION:
+
+
+    // Calls `fn(name, value)` for each parameter of an extension in a header, i.e. the items
+    // after the first ';'. Stops and returns false if `fn` does.
+    template <typename Fn>
+    static bool eachParam(string_view extension, Fn fn) {
+        string_view params = split(extension, ';').second;
+        while (!params.empty()) {
+            auto [param, rest] = split(params, ';');
+            params = rest;
+            auto [name, value] = split(param, '=');
+            name = trimWhitespace(name);
+            value = trimWhitespace(value);
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                value = value.substr(1, value.size() - 2);
+            if (!name.empty() && !fn(name, value))
+                return false;
+        }
+        return true;
+    }
+
+
+    // Parses a window-bits parameter value, returning 0 if it's invalid.
+    static int parseWindowBits(string_view value) {
+        if (value.size() == 1 && value[0] >= '8' && value[0] <= '9')
+            return value[0] - '0';
+        else if (value.size() == 2 && value[0] == '1' && value[1] >= '0' && value[1] <= '5')
+            return 10 + (value[1] - '0');
+        else
+            return 0;
+    }
+
+
+    string DeflateParams::clientOffer(CompressionOptions const& opts) {
+        string offer(kExtensionName);
+        // Always send client_max_window_bits, to let the server pick a smaller window:
+        offer += "; client_max_window_bits";
+        if (opts.windowBits < 15)
+            offer += "=" + to_string(opts.windowBits);
+        if (opts.peerWindowBits < 15)
+            offer += "; server_max_window_bits=" + to_string(opts.peerWindowBits);
+        if (opts.noContextTakeover)
+            offer += "; client_no_context_takeover";
+        if (opts.peerNoContextTakeover)
+            offer += "; server_no_context_takeover";
+        return offer;
+    }
+
+
+    optional<DeflateParams> DeflateParams::parseServerResponse(string_view header,
+                                                               CompressionOptions const& opts)
+    {
+        header = trimWhitespace(header);
+        if (header.empty())
+            return nullopt;
+        // We only offered one extension, so the server can't have accepted anything else:
+        if (header.find(',') != string_view::npos
+                || trimWhitespace(split(header, ';').first) != kExtensionName)
+            Error::raise(CloseCode::ProtocolError, "Server accepted an unknown WebSocket extension");
+
+        DeflateParams p {
+            .windowBits        = opts.windowBits,
+            .peerWindowBits    = 15,
+            .noContextTakeover = opts.noContextTakeover,
+        };
+        bool ok = eachParam(header, [&](string_view name, string_view value) {
+            if (name == "server_no_context_takeover") {
+                p.peerNoContextTakeover = true;
+            } else if (name == "client_no_context_takeover") {
+                p.noContextTakeover = true;
+            } else if (name == "server_max_window_bits") {
+                int bits = parseWindowBits(value);
+                if (bits == 0)
+                    return false;
+                p.peerWindowBits = bits;
+            } else if (name == "client_max_window_bits") {
+                int bits = parseWindowBits(value);
+                if (bits < kMinWindowBits)
+                    return false;
+                p.windowBits = std::min(p.windowBits, bits);
+            } else {
+                return false;
+            }
+            return true;
+        });
+        if (!ok)
+            Error::raise(CloseCode::ProtocolError, "Invalid permessage-deflate response");
+        return p;
+    }
+
+
+    optional<DeflateParams> DeflateParams::acceptClientOffer(string_view header,
+                                                             CompressionOptions const& opts)
+    {
+        // The header may contain several offers, in order of preference:
+        while (!header.empty()) {
+            auto [offer, rest] = split(header, ',');
+            header = rest;
+            if (trimWhitespace(split(offer, ';').first) != kExtensionName)
+                continue;
+
+            DeflateParams p {
+                .windowBits            = opts.windowBits,
+                .peerWindowBits        = 15,
+                .noContextTakeover     = opts.noContextTakeover,
+                .peerNoContextTakeover = opts.peerNoContextTakeover,
+            };
+            bool ok = eachParam(offer, [&](string_view name, string_view value) {
+                if (name == "server_no_context_takeover") {
+                    p.noContextTakeover = true;
+                } else if (name == "client_no_context_takeover") {
+                    p.peerNoContextTakeover = true;
+                } else if (name == "server_max_window_bits") {
+                    int bits = parseWindowBits(value);
+                    if (bits < kMinWindowBits)
+                        return false;
+                    p.windowBits = std::min(p.windowBits, bits);
+                } else if (name == "client_max_window_bits") {
+                    // The client lets us limit its window; it may also suggest a limit:
+                    int bits = value.empty() ? 15 : parseWindowBits(value);
+                    if (bits == 0)
+                        return false;
+                    p.peerWindowBits = std::min(opts.peerWindowBits, bits);
+                } else {
+                    return false;
+                }
+                return true;
+            });
+            if (ok)
+                return p;
+        }
+        return nullopt;
+    }
+
+
+    string DeflateParams::serverResponse() const {
+        string response(kExtensionName);
+        if (noContextTakeover)
+            response += "; server_no_context_takeover";
+        if (peerNoContextTakeover)
+            response += "; client_no_context_takeover";
+        if (windowBits < 15)
+            response += "; server_max_window_bits=" + to_string(windowBits);
+        if (peerWindowBits < 15)
+            response += "; client_max_window_bits=" + to_string(peerWindowBits);
+        return response;
+    }
+
+
+#if CROUTON_USE_ZLIB
+
+
+#pragma mark - COMPRESSION:
+
+
+    PerMessageDeflate::PerMessageDeflate(DeflateParams const& params,
+                                         CompressionOptions const& opts)
+    :_params(params)
+    ,_level(opts.level)
+    ,_minSize(std::max(opts.minSize, size_t(1)))
+    { }
+
+
+    PerMessageDeflate::~PerMessageDeflate() = default;
+
+
+    void PerMessageDeflate::DeflateEnd::operator()(z_stream_s* z) const noexcept {
+        deflateEnd(z);
+        delete z;
+    }
+
+    void PerMessageDeflate::InflateEnd::operator()(z_stream_s* z) const noexcept {
+        inflateEnd(z);
+        delete z;
+    }
+
+
+    static void checkErr(int err) {
+        if (err == Z_MEM_ERROR)
+            throw std::bad_alloc();
+        else if (err != Z_OK)
+            Error::raise(CroutonError::LogicError, "unexpected zlib error");
+    }
+
+
+    string PerMessageDeflate::compress(ConstBytes payload) {
+        if (!_deflater) {
+            // A negative window size makes zlib write raw deflate data, with no header:
+            auto z = make_unique<z_stream>();
+            checkErr(deflateInit2(z.get(), _level, Z_DEFLATED, -_params.windowBits,
+                                  8, Z_DEFAULT_STRATEGY));
+            _deflater.reset(z.release());
+        }
+        z_stream* z = _deflater.get();
+        z->next_in = (Bytef*)payload.data();
+        z->avail_in = unsigned(payload.size());
+        string output;
+        size_t outputSize = 0;
+        int err;
+        do {
+            size_t room = deflateBound(z, z->avail_in) + 16;
+            output.resize(outputSize + room);
+            z->next_out = (Bytef*)&output[outputSize];
+            z->avail_out = unsigned(room);
+            err = ::deflate(z, Z_SYNC_FLUSH);
+            outputSize += room - z->avail_out;
+        } while (err == Z_OK && z->avail_out == 0);
+        if (err != Z_OK && err != Z_BUF_ERROR)
+            Error::raise(CroutonError::LogicError, "zlib deflate failed");
+        // The flush ends with an empty stored block, 00 00 FF FF, which is left off (RFC 7692 §7.2.1):
+        assert(outputSize >= 4 && output.compare(outputSize - 4, 4, "\0\0\xFF\xFF", 4) == 0);
+        output.resize(outputSize - 4);
+        if (_params.noContextTakeover)
+            checkErr(deflateReset(z));
+        return output;
+    }
+
+
+    void PerMessageDeflate::decompress(ConstBytes input, string& output, bool fin, size_t maxSize) {
+        if (!_inflater) {
+            auto z = make_unique<z_stream>();
+            checkErr(inflateInit2(z.get(), -_params.peerWindowBits));
+            _inflater.reset(z.release());
+        }
+        inflate(input, output, maxSize);
+        if (fin) {
+            // Put back the empty stored block that the sender left off:
+            static constexpr uint8_t kTrailer[4] = {0x00, 0x00, 0xFF, 0xFF};
+            inflate(ConstBytes(kTrailer, sizeof(kTrailer)), output, maxSize);
+            if (_params.peerNoContextTakeover)
+                checkErr(inflateReset(_inflater.get()));
+        }
+    }
+
+
+    void PerMessageDeflate::inflate(ConstBytes input, string& output, size_t maxSize) {
+        z_stream* z = _inflater.get();
+        z->next_in = (Bytef*)input.data();
+        z->avail_in = unsigned(input.size());
+        do {
+            // Grow the output string, but only to one byte past maxSize, to detect overflow:
+            size_t outputSize = output.size();
+            size_t room = std::min(std::max(2 * size_t(z->avail_in), size_t(1024)),
+                                   maxSize + 1 - std::min(outputSize, maxSize));
+            output.resize(outputSize + room);
+            z->next_out = (Bytef*)&output[outputSize];
+            z->avail_out = unsigned(room);
+            int err = ::inflate(z, Z_SYNC_FLUSH);
+            output.resize(outputSize + room - z->avail_out);
+            if (output.size() > maxSize)
+                Error::raise(CloseCode::MessageTooBig, "Decompressed WebSocket message too big");
+            if (err == Z_STREAM_END)
+                checkErr(inflateReset(z));     // sender ended the stream with a final block
+            else if (err == Z_MEM_ERROR)
+                throw std::bad_alloc();
+            else if (err == Z_BUF_ERROR && z->avail_out > 0)
+                break;                          // no progress possible
+            else if (err != Z_OK && err != Z_BUF_ERROR)
+                Error::raise(CloseCode::BadMessageFormat, "Invalid compressed WebSocket message");
+        } while (z->avail_in > 0 || z->avail_out == 0);
+    }
+
+
+#else // CROUTON_USE_ZLIB
+
+
+    PerMessageDeflate::PerMessageDeflate(DeflateParams const&, CompressionOptions const&) {
+        Error::raise(CroutonError::Unimplemented, "WebSocket compression requires zlib");
+    }
+    PerMessageDeflate::~PerMessageDeflate() = default;
+    void PerMessageDeflate::DeflateEnd::operator()(z_stream_s* z) const noexcept {delete z;}
+    void PerMessageDeflate::InflateEnd::operator()(z_stream_s* z) const noexcept {delete z;}
+    string PerMessageDeflate::compress(ConstBytes) {return "";}
+    void PerMessageDeflate::decompress(ConstBytes, string&, bool, size_t) { }
+
+#endif // CROUTON_USE_ZLIB
+
+}
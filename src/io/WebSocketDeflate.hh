@@ -0,0 +1,91 @@
+//
+// WebSocketDeflate.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "crouton/io/WebSocket.hh"
+#include <memory>
+#include <optional>
+
+struct z_stream_s;
+
+namespace crouton::io::ws {
+
+    /** The parameters of the permessage-deflate extension (RFC 7692) agreed on by both sides
+        of a connection. Unlike the RFC's "client_" and "server_" parameters, these are from
+        the point of view of the local side. */
+    struct DeflateParams {
+        int  windowBits            = 15;    // Log2 of the window of messages I compress
+        int  peerWindowBits        = 15;    // Log2 of the window of messages the peer compresses
+        bool noContextTakeover     = false; // I reset my compressor after each message
+        bool peerNoContextTakeover = false; // Peer resets its compressor after each message
+
+        /// Client side: the `Sec-WebSocket-Extensions` request header to send.
+        static string clientOffer(CompressionOptions const&);
+
+        /// Client side: parses the server's `Sec-WebSocket-Extensions` response header.
+        /// Returns nullopt if the server declined.
+        /// @throws CloseCode::ProtocolError if the response is invalid.
+        static std::optional<DeflateParams> parseServerResponse(string_view header,
+                                                                CompressionOptions const&);
+
+        /// Server side: picks the first acceptable offer in the client's
+        /// `Sec-WebSocket-Extensions` request header, or returns nullopt if there is none.
+        static std::optional<DeflateParams> acceptClientOffer(string_view header,
+                                                              CompressionOptions const&);
+
+        /// Server side: the `Sec-WebSocket-Extensions` response header to send.
+        string serverResponse() const;
+    };
+
+
+    /** Compresses and decompresses the payloads of a WebSocket connection's messages.
+        The zlib streams are created lazily, the first time they're needed, since each one
+        takes a lot of memory. */
+    class PerMessageDeflate {
+    public:
+        PerMessageDeflate(DeflateParams const&, CompressionOptions const&);
+        ~PerMessageDeflate();
+
+        DeflateParams const& params() const     {return _params;}
+
+        /// True if a message of this size should be compressed.
+        bool shouldCompress(size_t size) const  {return size >= _minSize;}
+
+        /// Compresses an entire message payload.
+        string compress(ConstBytes payload);
+
+        /// Decompresses part of a message payload, appending the output to `output`.
+        /// `fin` must be true for the last part of the message.
+        /// @throws CloseCode::BadMessageFormat if the data is invalid, or
+        ///         CloseCode::MessageTooBig if `output` would grow larger than `maxSize`.
+        void decompress(ConstBytes input, string& output, bool fin, size_t maxSize);
+
+    private:
+        void inflate(ConstBytes input, string& output, size_t maxSize);
+
+        struct DeflateEnd { void operator()(z_stream_s*) const noexcept; };
+        struct InflateEnd { void operator()(z_stream_s*) const noexcept; };
+
+        DeflateParams   _params;
+        int             _level;
+        size_t          _minSize;
+        std::unique_ptr<z_stream_s,DeflateEnd> _deflater;
+        std::unique_ptr<z_stream_s,InflateEnd> _inflater;
+    };
+
+}
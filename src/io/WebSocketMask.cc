@@ -0,0 +1,199 @@
+//
+// WebSocketMask.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "WebSocketMask.hh"
+#include <cstring>
+
+// SSE2 is always available on x86-64. AVX2 isn't, so it's compiled with a `target` attribute
+// (GCC and Clang only) and used only if the CPU supports it. NEON is always available on ARM64.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#  define CROUTON_MASK_SSE2 1
+#  include <emmintrin.h>
+#  if defined(__GNUC__) || defined(__clang__)
+#    define CROUTON_MASK_AVX2 1
+#    include <immintrin.h>
+#  endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  define CROUTON_MASK_NEON 1
+#  include <arm_neon.h>
+#endif
+
+namespace crouton::io::ws {
+    using namespace std;
+
+
+    // Masks bytes one at a time. Used for short runs and for the ends of longer ones.
+    static inline void maskBytes(byte* dst, const byte* src, size_t len, uint32_t mask) noexcept {
+        byte m[4];
+        memcpy(m, &mask, 4);
+        for (size_t i = 0; i < len; ++i)
+            dst[i] = src[i] ^ m[i & 3];
+    }
+
+
+    // Returns the mask to use for the data following the first `n` bytes.
+    static inline uint32_t rotateMask(uint32_t mask, size_t n) noexcept {
+        byte m[4], r[4];
+        memcpy(m, &mask, 4);
+        for (size_t i = 0; i < 4; ++i)
+            r[i] = m[(i + n) & 3];
+        memcpy(&mask, r, 4);
+        return mask;
+    }
+
+
+    // Portable implementation that works 8 bytes at a time.
+    static void maskScalar(byte* dst, const byte* src, size_t len, uint32_t mask) noexcept {
+        uint64_t mask64 = (uint64_t(mask) << 32) | mask;
+        for (; len >= 8; len -= 8, src += 8, dst += 8) {
+            uint64_t word;
+            memcpy(&word, src, 8);
+            word ^= mask64;
+            memcpy(dst, &word, 8);
+        }
+        maskBytes(dst, src, len, mask);
+    }
+
+
+    // Note: Each SIMD loop below loads a whole block before storing any of it. That's what
+    // makes it safe for `dst` to overlap `src` from below.
+
+
+#if CROUTON_MASK_SSE2
+    static void maskSSE2(byte* dst, const byte* src, size_t len, uint32_t mask) noexcept {
+        if (len >= 64) {
+            // Handle the unaligned head separately, so the stores are aligned:
+            size_t head = (-uintptr_t(dst)) & 15;
+            maskBytes(dst, src, head, mask);
+            dst += head; src += head; len -= head;
+            mask = rotateMask(mask, head);
+        }
+        __m128i m = _mm_set1_epi32(int(mask));
+        for (; len >= 64; len -= 64, src += 64, dst += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+            _mm_storeu_si128((__m128i*)(dst),      _mm_xor_si128(a, m));
+            _mm_storeu_si128((__m128i*)(dst + 16), _mm_xor_si128(b, m));
+            _mm_storeu_si128((__m128i*)(dst + 32), _mm_xor_si128(c, m));
+            _mm_storeu_si128((__m128i*)(dst + 48), _mm_xor_si128(d, m));
+        }
+        for (; len >= 16; len -= 16, src += 16, dst += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            _mm_storeu_si128((__m128i*)dst, _mm_xor_si128(a, m));
+        }
+        maskBytes(dst, src, len, mask);
+    }
+#endif
+
+
+#if CROUTON_MASK_AVX2
+    __attribute__((target("avx2")))
+    static void maskAVX2(byte* dst, const byte* src, size_t len, uint32_t mask) noexcept {
+        if (len >= 128) {
+            size_t head = (-uintptr_t(dst)) & 31;
+            maskBytes(dst, src, head, mask);
+            dst += head; src += head; len -= head;
+            mask = rotateMask(mask, head);
+        }
+        __m256i m = _mm256_set1_epi32(int(mask));
+        for (; len >= 128; len -= 128, src += 128, dst += 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(src));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+            _mm256_storeu_si256((__m256i*)(dst),      _mm256_xor_si256(a, m));
+            _mm256_storeu_si256((__m256i*)(dst + 32), _mm256_xor_si256(b, m));
+            _mm256_storeu_si256((__m256i*)(dst + 64), _mm256_xor_si256(c, m));
+            _mm256_storeu_si256((__m256i*)(dst + 96), _mm256_xor_si256(d, m));
+        }
+        for (; len >= 32; len -= 32, src += 32, dst += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)src);
+            _mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(a, m));
+        }
+        if (len >= 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            _mm_storeu_si128((__m128i*)dst, _mm_xor_si128(a, _mm256_castsi256_si128(m)));
+            len -= 16; src += 16; dst += 16;
+        }
+        // Avoid the penalty for mixing AVX with SSE code compiled without VEX encoding.
+        // (GCC doesn't always add this itself, with the `target` attribute.)
+        _mm256_zeroupper();
+        maskBytes(dst, src, len, mask);
+    }
+#endif
+
+
+#if CROUTON_MASK_NEON
+    static void maskNEON(byte* dst, const byte* src, size_t len, uint32_t mask) noexcept {
+        uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+        for (; len >= 64; len -= 64, src += 64, dst += 64) {
+            uint8x16_t a = vld1q_u8((const uint8_t*)(src));
+            uint8x16_t b = vld1q_u8((const uint8_t*)(src + 16));
+            uint8x16_t c = vld1q_u8((const uint8_t*)(src + 32));
+            uint8x16_t d = vld1q_u8((const uint8_t*)(src + 48));
+            vst1q_u8((uint8_t*)(dst),      veorq_u8(a, m));
+            vst1q_u8((uint8_t*)(dst + 16), veorq_u8(b, m));
+            vst1q_u8((uint8_t*)(dst + 32), veorq_u8(c, m));
+            vst1q_u8((uint8_t*)(dst + 48), veorq_u8(d, m));
+        }
+        for (; len >= 16; len -= 16, src += 16, dst += 16)
+            vst1q_u8((uint8_t*)dst, veorq_u8(vld1q_u8((const uint8_t*)src), m));
+        maskBytes(dst, src, len, mask);
+    }
+#endif
+
+
+    static span<const MaskKernel> findKernels() noexcept {
+        static MaskKernel kernels[4];
+        size_t n = 0;
+#if CROUTON_MASK_AVX2
+        if (__builtin_cpu_supports("avx2"))
+            kernels[n++] = {"AVX2", maskAVX2};
+#endif
+#if CROUTON_MASK_SSE2
+        kernels[n++] = {"SSE2", maskSSE2};
+#endif
+#if CROUTON_MASK_NEON
+        kernels[n++] = {"NEON", maskNEON};
+#endif
+        kernels[n++] = {"scalar", maskScalar};
+        return {kernels, n};
+    }
+
+
+    span<const MaskKernel> availableMaskKernels() noexcept {
+        static const span<const MaskKernel> sKernels = findKernels();
+        return sKernels;
+    }
+
+
+    void applyMask(byte* dst, const byte* src, size_t len, const byte mask[4]) noexcept {
+        uint32_t mask32;
+        memcpy(&mask32, mask, 4);
+        if (len < 16) {
+            // Not worth the overhead of a SIMD kernel:
+            maskBytes(dst, src, len, mask32);
+        } else {
+            static const auto sApply = availableMaskKernels().front().apply;
+            sApply(dst, src, len, mask32);
+        }
+    }
+
+}
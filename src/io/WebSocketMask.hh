@@ -0,0 +1,46 @@
+//
+// WebSocketMask.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace crouton::io::ws {
+
+    /// XORs `len` bytes from `src` with the repeating 4-byte WebSocket `mask`, writing the
+    /// result to `dst`; byte `i` is XORed with `mask[i % 4]`.
+    /// `dst` may equal `src` (masking in place), or precede it (shifting the data down, as
+    /// when a frame header is removed), but must not overlap the input from above.
+    /// This uses the fastest SIMD instructions available on the CPU.
+    void applyMask(std::byte* dst, const std::byte* src, size_t len,
+                   const std::byte mask[4]) noexcept;
+
+
+    /// A specific implementation of `applyMask`, for testing and benchmarking.
+    /// (Its mask is a `uint32_t` whose in-memory bytes are the mask bytes.)
+    struct MaskKernel {
+        const char* name;
+        void (*apply)(std::byte* dst, const std::byte* src, size_t len, uint32_t mask) noexcept;
+    };
+
+    /// The implementations of `applyMask` that this CPU supports, fastest first.
+    /// The last one is always the portable scalar code.
+    std::span<const MaskKernel> availableMaskKernels() noexcept;
+
+}
@@ -70,6 +70,9 @@
 #endif
 //COUCHBASE: End of code adapted from Networking.h
 
+#include "WebSocketMask.hh"     //COUCHBASE: SIMD masking
+#include "crouton/Misc.hh"      //COUCHBASE: FastRandomize
+
 #include <algorithm>
 #include <array>
 #include <cstring>
@@ -104,13 +107,7 @@ namespace uWS {
         static inline bool getMask(frameFormat& frame) { return frame & 32768; }
 
         static inline void unmaskPrecise(std::byte* dst, std::byte* src, std::byte* mask, size_t length) {
-            for ( ; length >= 4; length -= 4 ) {
-                *(dst++) = *(src++) ^ mask[0];
-                *(dst++) = *(src++) ^ mask[1];
-                *(dst++) = *(src++) ^ mask[2];
-                *(dst++) = *(src++) ^ mask[3];
-            }
-            for ( ; length > 0; --length ) *(dst++) = *(src++) ^ *(mask++);
+            crouton::io::ws::applyMask(dst, src, length, mask);  //COUCHBASE: SIMD
         }
 
         static inline void unmaskPreciseCopyMask(std::byte* dst, std::byte* src, std::byte* maskPtr, size_t length) {
@@ -127,14 +124,7 @@ namespace uWS {
         }
 
         static inline void unmaskInplace(std::byte* data, std::byte* stop, std::byte* mask) {
-            std::byte* stop1 = stop - 3;
-            while ( data < stop1 ) {
-                *(data++) ^= mask[0];
-                *(data++) ^= mask[1];
-                *(data++) ^= mask[2];
-                *(data++) ^= mask[3];
-            }
-            while ( data < stop ) *(data++) ^= *(mask++);
+            crouton::io::ws::applyMask(data, data, stop - data, mask);  //COUCHBASE: SIMD
         }
 
         enum state_t : uint8_t { READ_HEAD, READ_MESSAGE };
@@ -298,8 +288,9 @@ namespace uWS {
             return 0;
         }
 
+        //COUCHBASE: Added `fin` parameter, to send a message in fragments (opCode 0 is a continuation)
         static inline size_t formatMessage(std::byte* dst, const char* src, size_t length, OpCode opCode,
-                                           size_t reportedLength, bool compressed) {
+                                           size_t reportedLength, bool compressed, bool fin = true) {
             size_t messageLength;
             size_t headerLength;
             if ( reportedLength < 126 ) {
@@ -315,7 +306,7 @@ namespace uWS {
                 *((uint64_t*)&dst[2]) = htobe64(reportedLength);
             }
 
-            int flags = 0;
+            int flags = fin ? 0 : SND_NO_FIN;
             dst[0]    = (std::byte)((flags & SND_NO_FIN ? 0 : 128) | (compressed ? SND_COMPRESSED : 0));
             if ( !(flags & SND_CONTINUATION) ) { dst[0] |= (std::byte)opCode; }
 
@@ -323,37 +314,17 @@ namespace uWS {
 
             if ( !isServer ) {
                 ((uint8_t*)dst)[1] |= 0x80;
-                crouton::Randomize(mask.data(), 4);
+                crouton::FastRandomize(mask.data(), 4);    //COUCHBASE: was Randomize (a syscall)
                 memcpy(dst + headerLength, mask.data(), 4);
                 headerLength += 4;
             }
 
             messageLength = headerLength + length;
-            memcpy(dst + headerLength, src, length);
-
-            if ( !isServer ) {
-                std::byte* start_byte = dst + headerLength;
-                std::byte* end_byte   = start_byte + length;
-                size_t     offset     = 0;
-
-                // Handle first x amount of bytes individually until we are aligned with the 4-byte alignment
-                for ( ; (reinterpret_cast<uintptr_t>(start_byte) & 3) != 0 && start_byte != end_byte; ++offset ) {
-                    *start_byte++ ^= mask[offset % 4];
-                }
-
-                // Rotate mask by the offset we reached in the first loop to become memory-aligned
-                std::rotate(mask.begin(), mask.begin() + offset, mask.end());
-
-                // Process majority of bytes in chunks of 4 (until end or < 4 bytes away from end)
-                auto*     start = reinterpret_cast<uint32_t*>(start_byte);
-                uint32_t* end   = start + ((end_byte - start_byte) / 4);
-                uint32_t  mask_i32{};
-                std::memcpy(&mask_i32, mask.data(), 4);
-                while ( start != end ) { *start++ ^= mask_i32; }
-
-                // Process remaining bytes individually (if any)
-                start_byte = reinterpret_cast<std::byte*>(start);
-                for ( int i = 0; start_byte != end_byte; ++i ) { *start_byte++ ^= mask[i % 4]; }
+            if ( isServer ) {
+                memcpy(dst + headerLength, src, length);
+            } else {
+                //COUCHBASE: Copy and mask in one pass, with SIMD
+                crouton::io::ws::applyMask(dst + headerLength, (const std::byte*)src, length, mask.data());
             }
             return messageLength;
         }
@@ -51,7 +51,7 @@ namespace crouton::io::blip {
             Log->warn("outputTask awaited");
             if (!frame)
                 break; // BLIPIO's send side has closed.
-            AWAIT _socket->send(*frame, ws::Message::Binary);
+            AWAIT _socket->send(std::move(*frame), ws::Message::Binary);
         } while (YIELD true);
     }
 
@@ -28,7 +28,8 @@ namespace crouton::io {
     using namespace crouton::io::esp;
 
 
-    Future<AddrInfo> AddrInfo::lookup(string hostname, uint16_t port) {
+    // lwIP has its own DNS cache, and only looks up IPv4 addresses, so `family` is ignored.
+    Future<AddrInfo> AddrInfo::lookup(string hostname, uint16_t port, int family) {
         Blocker<ip_addr_t> blocker;
         auto callback = [] (const char *name, const ip_addr_t *ipaddr, void *ctx) {
             // Warning: Callback is called on the lwip thread
@@ -43,13 +44,13 @@ namespace crouton::io {
         ip_addr addr;
         switch (err_t err = dns_gethostbyname(hostname.c_str(), &addr, callback, &blocker)) {
             case ERR_OK:
-                RETURN AddrInfo(&addr);
+                RETURN AddrInfo(make_shared<ip_addr>(addr));
             case ERR_INPROGRESS:
                 LNet->debug("Awaiting DNS lookup of {}", hostname);
                 addr = AWAIT blocker;
                 LNet->debug("DNS lookup {}", (addr.type != 0xFF ? "succeeded" : "failed"));
                 if (addr.type != 0xFF)
-                    RETURN AddrInfo(&addr);
+                    RETURN AddrInfo(make_shared<ip_addr>(addr));
                 else
                     RETURN ESPError::HostNotFound;
             default:
@@ -58,9 +59,13 @@ namespace crouton::io {
     }
 
 
-    AddrInfo::AddrInfo(ip_addr* addr)
-    :_info(make_unique<ip_addr>(*addr))
-    { }
+    void AddrInfo::setCacheOptions(CacheOptions const&)     { }
+    void AddrInfo::clearCache()                             { }
+
+    AddrInfo::CacheStats const& AddrInfo::cacheStats() {
+        static CacheStats sStats;
+        return sStats;
+    }
 
     ip_addr const& AddrInfo::primaryAddress() const {
         return *_info;
@@ -73,6 +78,10 @@ namespace crouton::io {
             Error(ESPError::HostNotFound).raise();
     }
 
+    vector<ip_addr const*> AddrInfo::allAddresses() const {
+        return {_info.get()};
+    }
+
     /// The primary address converted to a numeric string.
     string AddrInfo::primaryAddressString() const {
         char buf[32];
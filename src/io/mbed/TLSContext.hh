@@ -55,6 +55,9 @@
 #pragma once
 
 #include "crouton/Error.hh"
+#include "crouton/io/mbed/TLSSocket.hh"
+#include "crouton/io/TCPServer.hh"
+#include "support/StringUtils.hh"
 #include "crouton/util/Logging.hh"
 
 #if defined(_WIN32)
@@ -77,9 +80,15 @@
 #include <mbedtls/error.h>
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/pem.h>
+#include <mbedtls/pk.h>
 #include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/version.h>
+#include <algorithm>
 #include <cstring>
 #include <mutex>
+#include <vector>
 
 #ifdef __APPLE__
     // macOS, iOS:
@@ -110,6 +119,16 @@
 #endif
 
 
+// mbedTLS 3.3 added the certificate-selection callback, which lets each server handshake use its
+// own copies of the private keys (see `TLSContext::borrowKeys`.) Without it, concurrent
+// handshakes would share the keys, which isn't safe, so they're never offloaded to other threads.
+#if MBEDTLS_VERSION_NUMBER >= 0x03030000 && defined(MBEDTLS_SSL_SRV_C)
+#   define CROUTON_TLS_KEY_COPIES 1
+#else
+#   define CROUTON_TLS_KEY_COPIES 0
+#endif
+
+
 namespace crouton::io::mbed {
     /// Domain for mbedTLS error codes.
     enum class MbedError : errorcode_t { };
@@ -160,6 +179,84 @@ namespace crouton::io::mbed {
         ~cert() {mbedtls_x509_crt_free(this);}
     };
 
+    // Simple RAII helper for mbedTLS private key struct
+    struct pkey : public mbedtls_pk_context {
+        pkey()  {mbedtls_pk_init(this);}
+        ~pkey() {mbedtls_pk_free(this);}
+    };
+
+    // Simple RAII helper for mbedTLS session struct
+    struct session : public mbedtls_ssl_session {
+        session()  {mbedtls_ssl_session_init(this);}
+        ~session() {mbedtls_ssl_session_free(this);}
+    };
+
+
+    // The counters returned by `TLSSocket::sessionStats`.
+    inline TLSSocket::SessionStats sSessionStats;
+
+    // The counters returned by `TLSSocket::handshakeStats`.
+    inline TLSSocket::HandshakeStats sHandshakeStats;
+
+
+    /** An in-memory cache of client TLS sessions, keyed by "host:port". Offering a cached session
+        when reconnecting lets the server resume it with an abbreviated handshake, which saves a
+        round trip and all the public-key operations.
+        Thread-safe, since a TLSContext can be shared between threads. */
+    class TLSSessionCache {
+    public:
+        explicit TLSSessionCache(size_t maxEntries = 64)    :_maxEntries(maxEntries) { }
+
+        /// Gives the session cached for `key`, if any, to a client SSL context that's about to
+        /// start its handshake. Returns true if there was one.
+        bool restore(string const& key, mbedtls_ssl_context* ssl) {
+            ++sSessionStats.clientLookups;
+            unique_lock lock(_mutex);
+            auto i = find(key);
+            if (i == _entries.end())
+                return false;
+            if (mbedtls_ssl_set_session(ssl, i->second.get()) != 0) {
+                _entries.erase(i);
+                return false;
+            }
+            std::rotate(i, i + 1, _entries.end());      // make it the most recently used
+            ++sSessionStats.clientHits;
+            return true;
+        }
+
+        /// Saves the session of a client that's completed its handshake.
+        void save(string const& key, mbedtls_ssl_context const* ssl) {
+            auto s = make_unique<session>();
+            if (mbedtls_ssl_get_session(ssl, s.get()) != 0)
+                return;
+            unique_lock lock(_mutex);
+            if (auto i = find(key); i != _entries.end())
+                _entries.erase(i);
+            else if (_entries.size() >= _maxEntries)
+                _entries.erase(_entries.begin());       // evict the least recently used
+            _entries.emplace_back(key, std::move(s));
+        }
+
+        /// Forgets the session for `key`, as when a handshake using it failed.
+        void remove(string const& key) {
+            unique_lock lock(_mutex);
+            if (auto i = find(key); i != _entries.end())
+                _entries.erase(i);
+        }
+
+    private:
+        using Entry = pair<string, unique_ptr<session>>;
+
+        vector<Entry>::iterator find(string const& key) {
+            return std::find_if(_entries.begin(), _entries.end(),
+                                [&](Entry const& e) {return e.first == key;});
+        }
+
+        mutex           _mutex;
+        vector<Entry>   _entries;           // Ordered from least to most recently used
+        size_t const    _maxEntries;
+    };
+
 
     /** Context / configuration for TLS (SSL) connections.
         A single context can be shared by any number of connection instances.
@@ -179,7 +276,7 @@ namespace crouton::io::mbed {
         explicit TLSContext(int endpoint) {
             mbedtls_ssl_config_init(&_config);
             setupLogging();
-            mbedtls_ssl_conf_rng(&_config, mbedtls_ctr_drbg_random, get_drbg_context());
+            mbedtls_ssl_conf_rng(&_config, lockedRandom, get_drbg_context());
             check(mbedtls_ssl_config_defaults(&_config,
                                               endpoint,
                                               MBEDTLS_SSL_TRANSPORT_STREAM,
@@ -192,18 +289,263 @@ namespace crouton::io::mbed {
             if (auto roots = get_system_root_certs())
                 mbedtls_ssl_conf_ca_chain(&_config, roots, nullptr);
 #endif
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+            mbedtls_ssl_cache_init(&_serverCache);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+            mbedtls_ssl_ticket_init(&_tickets);
+#endif
+            if (endpoint == MBEDTLS_SSL_IS_SERVER)
+                setupSessionResumption();
+        }
+
+        /// Constructs a server context with the given certificates and options.
+        explicit TLSContext(TLSServerConfig const& config)
+        :TLSContext(MBEDTLS_SSL_IS_SERVER)
+        {
+            if (config.identities.empty())
+                Error::raise(CroutonError::InvalidArgument, "TLS server has no certificate");
+            for (auto& id : config.identities) {
+                auto& ident = _identities.emplace_back(make_unique<credentials>());
+                ident->hostName = id.hostName;
+                ident->certChain = parse_cert(id.certChain, false);
+                ident->keyPEM = id.privateKey;
+                ident->keyPassword = id.keyPassword;
+                parse_key(ident->key, id.privateKey, id.keyPassword);
+            }
+            credentials& dflt = *_identities.front();
+            check(mbedtls_ssl_conf_own_cert(&_config, dflt.certChain.get(), &dflt.key),
+                  "mbedtls_ssl_conf_own_cert");
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+            if (_identities.size() > 1)
+                mbedtls_ssl_conf_sni(&_config, sniCallback, this);
+#endif
+#if CROUTON_TLS_KEY_COPIES
+            mbedtls_ssl_conf_cert_cb(&_config, certCallback);
+            _offloadHandshakes = config.offloadHandshakes;
+#else
+            if (config.offloadHandshakes)
+                LMbed->warn("This mbedTLS is too old to run handshakes on other threads");
+#endif
+            _handshakeTimeout = config.handshakeTimeout;
         }
 
         ~TLSContext() {
             mbedtls_ssl_config_free(&_config);
+#if defined(MBEDTLS_SSL_TICKET_C)
+            mbedtls_ssl_ticket_free(&_tickets);
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+            mbedtls_ssl_cache_free(&_serverCache);
+#endif
         }
 
         mbedtls_ssl_config* config() {
             return &_config;
         }
 
+        /// The sessions of client connections, for resuming them when reconnecting.
+        TLSSessionCache& sessionCache() {
+            return _sessionCache;
+        }
+
+        /// True if handshakes should run on background threads.
+        bool offloadHandshakes() const {
+            return _offloadHandshakes;
+        }
+
+        /// Max seconds a server's handshake may take, or 0 for no limit.
+        double handshakeTimeout() const {
+            return _handshakeTimeout;
+        }
+
+        /// One handshake's own copies of a server's private keys; see `borrowKeys`.
+        struct keySet {
+            TLSContext*             context;
+            vector<unique_ptr<pkey>> keys;          // Parallel to the context's _identities
+            size_t                  identity = 0;   // Index of the identity chosen by SNI
+        };
+
+        // Deleter for a KeysRef, which puts the keys back in their context's pool.
+        struct keyReturner {
+            void operator() (keySet* keys) const {
+                unique_lock lock(keys->context->_keyMutex);
+                keys->context->_spareKeys.emplace_back(keys);
+            }
+        };
+        using KeysRef = unique_ptr<keySet, keyReturner>;
+
+        /// Lends a server's handshake its own copy of each private key, and makes `ssl` use them.
+        /// mbedTLS keys aren't thread-safe (unless it's built with MBEDTLS_THREADING_C): RSA
+        /// updates its blinding values on every private-key operation, and ECP builds its
+        /// precomputed table on first use. With their own copies, handshakes on background
+        /// threads can run at once. The copies go back into a pool when the KeysRef is released,
+        /// so there are never more of them than there have been concurrent handshakes.
+        /// Returns nullptr for a client, which has no private keys.
+        KeysRef borrowKeys(mbedtls_ssl_context* ssl) {
+#if CROUTON_TLS_KEY_COPIES
+            if (_identities.empty())
+                return nullptr;
+            KeysRef keys;
+            {
+                unique_lock lock(_keyMutex);
+                if (!_spareKeys.empty()) {
+                    keys.reset(_spareKeys.back().release());
+                    _spareKeys.pop_back();
+                }
+            }
+            if (!keys) {
+                keys.reset(new keySet{this});
+                for (auto& ident : _identities)
+                    parse_key(*keys->keys.emplace_back(make_unique<pkey>()),
+                              ident->keyPEM, ident->keyPassword);
+            }
+            keys->identity = 0;
+            mbedtls_ssl_set_user_data_p(ssl, keys.get());
+            return keys;
+#else
+            return nullptr;
+#endif
+        }
+
+        /// Makes this context trust the given CA certs (PEM), in addition to the ones it already
+        /// trusts. Should be called before any connections using this context are opened.
+        void addTrustedCerts(string const& certsPEM) {
+            auto roots = make_unique<cert>();
+            mbedtls_x509_crt const* oldRoots = _trustedCerts.get();
+#if !defined(ESP_PLATFORM)
+            if (!oldRoots)
+                oldRoots = get_system_root_certs();
+#endif
+            for (auto c = oldRoots; c && c->raw.p; c = c->next)
+                check(mbedtls_x509_crt_parse_der(roots.get(), c->raw.p, c->raw.len),
+                      "mbedtls_x509_crt_parse_der");
+            check(mbedtls_x509_crt_parse(roots.get(), (const uint8_t*)certsPEM.c_str(),
+                                         certsPEM.size() + 1),
+                  "mbedtls_x509_crt_parse");
+            mbedtls_ssl_conf_ca_chain(&_config, roots.get(), nullptr);
+            _trustedCerts = std::move(roots);
+        }
+
     private:
 
+        // A server's certificate chain and private key.
+        struct credentials {
+            string              hostName;
+            unique_ptr<cert>    certChain;
+            pkey                key;
+            string              keyPEM, keyPassword;    // For parsing copies of the key
+        };
+
+
+        // mbedTLS callback when a client names the host it wants, with SNI.
+        static int sniCallback(void* ctx, mbedtls_ssl_context* ssl,
+                               const unsigned char* name, size_t nameLen) {
+            string_view hostName((const char*)name, nameLen);
+            auto& identities = ((TLSContext*)ctx)->_identities;
+            for (size_t i = 0; i < identities.size(); ++i) {
+                if (equalIgnoringCase(identities[i]->hostName, hostName)) {
+#if CROUTON_TLS_KEY_COPIES
+                    if (auto keys = (keySet*)mbedtls_ssl_get_user_data_p(ssl)) {
+                        keys->identity = i;     // certCallback will use this handshake's copy
+                        return 0;
+                    }
+#endif
+                    return mbedtls_ssl_set_hs_own_cert(ssl, identities[i]->certChain.get(),
+                                                       &identities[i]->key);
+                }
+            }
+            return 0;   // Unknown name: use the default identity
+        }
+
+
+#if CROUTON_TLS_KEY_COPIES
+        // mbedTLS callback once a server has read the ClientHello, to choose its certificate.
+        // Gives the handshake the chosen identity with its own copy of the key.
+        static int certCallback(mbedtls_ssl_context* ssl) {
+            auto keys = (keySet*)mbedtls_ssl_get_user_data_p(ssl);
+            if (!keys)
+                return 0;
+            auto& ident = *keys->context->_identities[keys->identity];
+            return mbedtls_ssl_set_hs_own_cert(ssl, ident.certChain.get(),
+                                               keys->keys[keys->identity].get());
+        }
+#endif
+
+
+        static void parse_key(pkey& key, string const& pem, string const& password) {
+            check(mbedtls_pk_parse_key(&key,
+                                       (const uint8_t*)pem.c_str(), pem.size() + 1,
+                                       (const uint8_t*)password.data(), password.size(),
+                                       lockedRandom, get_drbg_context()),
+                  "mbedtls_pk_parse_key");
+        }
+
+
+        // The shared RNG isn't thread-safe (unless mbedTLS is built with MBEDTLS_THREADING_C),
+        // and handshakes may be running on background threads.
+        static int lockedRandom(void* drbg, unsigned char* output, size_t len) {
+            static mutex sMutex;
+            unique_lock lock(sMutex);
+            return mbedtls_ctr_drbg_random(drbg, output, len);
+        }
+
+
+        // Secs that a server keeps a session resumable; also how often the ticket key rotates.
+        static constexpr uint32_t kSessionLifetime = 6 * 3600;
+
+        // Lets clients resume sessions, either with a session ID that's in the in-memory cache,
+        // or with a session ticket, which holds the session state encrypted with a key only the
+        // server knows. mbedTLS generates a new ticket key every kSessionLifetime seconds, and
+        // accepts tickets made with the previous one until they expire.
+        // The callbacks are wrapped to count lookups, and to serialize handshakes running on
+        // background threads.
+        void setupSessionResumption() {
+#if defined(MBEDTLS_SSL_CACHE_C)
+#if defined(MBEDTLS_HAVE_TIME)
+            mbedtls_ssl_cache_set_timeout(&_serverCache, int(kSessionLifetime));
+#endif
+            auto cacheGet = [](void* cache, unsigned char const* id, size_t idLen,
+                               mbedtls_ssl_session* session) {
+                unique_lock lock(sSessionMutex);
+                ++sSessionStats.serverLookups;
+                int err = mbedtls_ssl_cache_get(cache, id, idLen, session);
+                if (err == 0)
+                    ++sSessionStats.serverHits;
+                return err;
+            };
+            auto cacheSet = [](void* cache, unsigned char const* id, size_t idLen,
+                               mbedtls_ssl_session const* session) {
+                unique_lock lock(sSessionMutex);
+                return mbedtls_ssl_cache_set(cache, id, idLen, session);
+            };
+            mbedtls_ssl_conf_session_cache(&_config, &_serverCache, cacheGet, cacheSet);
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+            check(mbedtls_ssl_ticket_setup(&_tickets, lockedRandom, get_drbg_context(),
+                                           MBEDTLS_CIPHER_AES_256_GCM, kSessionLifetime),
+                  "mbedtls_ssl_ticket_setup");
+            auto ticketWrite = [](void* tickets, mbedtls_ssl_session const* session,
+                                  unsigned char* start, unsigned char const* end,
+                                  size_t* len, uint32_t* lifetime) {
+                unique_lock lock(sSessionMutex);
+                return mbedtls_ssl_ticket_write(tickets, session, start, end, len, lifetime);
+            };
+            auto ticketParse = [](void* tickets, mbedtls_ssl_session* session,
+                                  unsigned char* buf, size_t len) {
+                unique_lock lock(sSessionMutex);
+                ++sSessionStats.serverLookups;
+                int err = mbedtls_ssl_ticket_parse(tickets, session, buf, len);
+                if (err == 0)
+                    ++sSessionStats.serverHits;
+                return err;
+            };
+            mbedtls_ssl_conf_session_tickets_cb(&_config, ticketWrite, ticketParse, &_tickets);
+#endif
+        }
+
+
         void setupLogging() {
 #ifdef ESP_PLATFORM
     #ifdef CONFIG_MBEDTLS_DEBUG
@@ -432,7 +774,22 @@ namespace crouton::io::mbed {
 
 #endif
 
-        mbedtls_ssl_config  _config;
+        static inline mutex         sSessionMutex;  // Guards _serverCache and _tickets
+
+        mbedtls_ssl_config          _config;
+        vector<unique_ptr<credentials>> _identities;   // Server's certs; the first is the default
+        mutex                       _keyMutex;      // Guards _spareKeys
+        vector<unique_ptr<keySet>>  _spareKeys;     // Key copies not in use by a handshake
+        unique_ptr<cert>            _trustedCerts;  // Roots set by addTrustedCerts, if any
+        bool                        _offloadHandshakes = false;
+        double                      _handshakeTimeout = 0;
+        TLSSessionCache             _sessionCache;  // Client sessions, by host:port
+#if defined(MBEDTLS_SSL_CACHE_C)
+        mbedtls_ssl_cache_context   _serverCache;   // Server sessions, by session ID
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+        mbedtls_ssl_ticket_context  _tickets;       // Server's session ticket keys
+#endif
     };
 
 }
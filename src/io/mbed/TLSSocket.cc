@@ -18,9 +18,12 @@
 
 #include "crouton/io/mbed/TLSSocket.hh"
 #include "crouton/io/ISocket.hh"
+#include "crouton/EventLoop.hh"
 #include "crouton/Future.hh"
 #include "Internal.hh"
 #include "TLSContext.hh"
+#include <array>
+#include <cstring>
 #include <optional>
 
 // Code adapted from Couchbase's fork of sockpp:
@@ -63,9 +66,11 @@ namespace crouton::io::mbed {
     class TLSSocket::Impl {
     public:
 
-        Impl(std::shared_ptr<IStream> stream, TLSContext& context, string const& hostname)
+        Impl(std::shared_ptr<IStream> stream, TLSContext& context, string const& hostname,
+             string sessionKey = "")
         :_stream(std::move(stream))
         ,_context(context)
+        ,_sessionKey(std::move(sessionKey))
         {
             mbedtls_ssl_init(&_ssl);
 
@@ -91,16 +96,33 @@ namespace crouton::io::mbed {
 
         // Coroutine that opens the underlying stream and then runs the TLS handshake.
         Future<void> handshake() {
-            AWAIT _stream->open();
+            if (!_stream->isOpen())
+                AWAIT _stream->open();
             _tcpOpen = true;
 
+            // Offer the server the session from the last connection, if any, to resume:
+            if (!_sessionKey.empty())
+                _context.sessionCache().restore(_sessionKey, &_ssl);
+
+            // A server's handshake gets its own copies of the private keys, so it can run on a
+            // background thread at the same time as others:
+            TLSContext::KeysRef keys = _context.borrowKeys(&_ssl);
             int status;
             do {
                 AWAIT processIO();
-                status = mbedtls_ssl_handshake(&_ssl);
+                if (_context.offloadHandshakes()) {
+                    // The BIO callbacks don't touch the stream, so this can run on any thread:
+                    AWAIT OnBackgroundThread([&] {status = offloadedStep();});
+                } else {
+                    status = mbedtls_ssl_handshake(&_ssl);
+                }
             } while (status == MBEDTLS_ERR_SSL_WANT_READ || status == MBEDTLS_ERR_SSL_WANT_WRITE
                      || status == MBEDTLS_ERR_SSL_CRYPTO_IN_PROGRESS);
+            keys = nullptr;     // The handshake is done with them
+            if (status != 0 && !_sessionKey.empty())
+                _context.sessionCache().remove(_sessionKey);
             check(status, "mbedtls_ssl_handshake");
+            AWAIT sendOutput();     // the last flight of handshake messages
 
             // After the handshake, verify the peer cert:
             uint32_t verify_flags = mbedtls_ssl_get_verify_result(&_ssl);
@@ -109,18 +131,71 @@ namespace crouton::io::mbed {
                 char vrfy_buf[512];
                 mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "", verify_flags);
                 LNet->warn("Cert verify failed: {}", vrfy_buf);
+                if (!_sessionKey.empty())
+                    _context.sessionCache().remove(_sessionKey);
                 check(MBEDTLS_ERR_X509_CERT_VERIFY_FAILED, "verifying cert");
             }
+            if (!_sessionKey.empty())
+                _context.sessionCache().save(_sessionKey, &_ssl);
             _tlsOpen = true;
             RETURN noerror;
         }
 
 
+        // Runs a step of the handshake on a background thread, and updates sHandshakeStats.
+        int offloadedStep() {
+            static atomic<uint32_t> sRunning = 0;
+            uint32_t running = ++sRunning;
+            uint32_t maxRunning = sHandshakeStats.maxConcurrentSteps;
+            while (running > maxRunning
+                   && !sHandshakeStats.maxConcurrentSteps.compare_exchange_weak(maxRunning, running))
+                { }
+            int status = mbedtls_ssl_handshake(&_ssl);
+            --sRunning;
+            ++sHandshakeStats.offloadedSteps;
+            return status;
+        }
+
+
         // TLSSocket wants to write.
         Future<void> write(ConstBytes buf) {
             //cerr << "TLSStream write(" << buf.size() << ") ...\n";
             if (buf.size() == 0)
                 RETURN noerror;
+            AWAIT encrypt(buf);
+            // Start sending the records that are still in _outBuf:
+            AWAIT sendOutput();
+            RETURN noerror;
+        }
+
+
+        // TLSSocket wants to write multiple buffers. Small ones are gathered together, so they
+        // don't each become a TLS record; the rest go to mbedTLS without being copied.
+        Future<void> write(const ConstBytes buffers[], size_t nBuffers) {
+            std::array<byte, kGatherSize> gather;
+            size_t gathered = 0;
+            for (size_t i = 0; i < nBuffers; ++i) {
+                ConstBytes buf = buffers[i];
+                if (gathered + buf.size() > kGatherSize && gathered > 0) {
+                    AWAIT encrypt(ConstBytes(gather.data(), gathered));
+                    gathered = 0;
+                }
+                if (buf.size() < kGatherSize) {
+                    ::memcpy(&gather[gathered], buf.data(), buf.size());
+                    gathered += buf.size();
+                } else {
+                    AWAIT encrypt(buf);
+                }
+            }
+            if (gathered > 0)
+                AWAIT encrypt(ConstBytes(gather.data(), gathered));
+            AWAIT sendOutput();
+            RETURN noerror;
+        }
+
+
+        // Passes data to mbedTLS, which encrypts it into _outBuf.
+        Future<void> encrypt(ConstBytes buf) {
             while (true) {
                 int result = mbedtls_ssl_write(&_ssl,  (const uint8_t*)buf.data(), buf.size());
                 if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
@@ -134,7 +209,6 @@ namespace crouton::io::mbed {
                     //cerr << "\tTLSStream.write wrote " << result << "; continuing..." << endl;
                     buf = buf.last(buf.size() - result);
                 } else {
-                    // Done!
                     //cerr << "\tTLSStream.write done" << endl;
                     RETURN noerror;
                 }
@@ -142,6 +216,18 @@ namespace crouton::io::mbed {
         }
 
 
+        // Waits until mbedTLS has data for `read` to return, or the stream is at EOF,
+        // so the caller doesn't need a buffer to read into until then.
+        Future<void> waitReadable() {
+            while (mbedtls_ssl_get_bytes_avail(&_ssl) == 0 && !mbedtls_ssl_check_pending(&_ssl)
+                        && _readBuf.empty() && !_readEOF) {
+                _wantRead = true;
+                AWAIT processIO();
+            }
+            RETURN noerror;
+        }
+
+
         // TLSSocket wants to read.
         Future<intptr_t> read(void *buf, size_t maxLen) {
             //cerr << "TLSStream read(" << maxLen << ") ...\n";
@@ -155,7 +241,9 @@ namespace crouton::io::mbed {
                     // Need to complete some async I/O:
                     AWAIT processIO();
                 } else if (result > 0) {
-                    // Done!
+                    // Done! (Reading may have produced records to send, like a key update.)
+                    if (!_outBuf.empty())
+                        AWAIT sendOutput();
                     //cerr << "\tTLSStream.read got " << result << endl;
                     //cerr << "\t\t" << string_view((char*)buf, result) << endl;
                     RETURN result;
@@ -171,12 +259,19 @@ namespace crouton::io::mbed {
         }
 
 
+        // Makes the underlying stream's pending and future reads hit EOF, and its writes fail.
+        void abort() {
+            _stream->abort();
+        }
+
+
         // Implements both TLSSocket's close() and closeWrite() methods.
         Future<void> close(bool fully) {
             if (_tcpOpen) {
                 //cerr << "TLSStream close ...\n";
                 mbedtls_ssl_close_notify(&_ssl);
-                AWAIT processIO();
+                AWAIT sendOutput();
+                AWAIT finishWrite();
                 _tlsOpen = false;
                 if (fully) {
                     _tcpOpen = _tlsOpen = false;
@@ -193,16 +288,18 @@ namespace crouton::io::mbed {
     private:
 
         // mbedTLS callback: it wants to write to the network.
+        // The callbacks never call the stream; they only append to `_outBuf` or consume
+        // `_readBuf`, leaving the I/O to `processIO`. That lets records accumulate so they can
+        // be sent in one write, and lets handshakes run on other threads.
         int bio_send(const void* buf, size_t length) {
             //cerr << "BIO_SEND(" << length << ") ";
             int result;
             if (!_tcpOpen)
                 result = MBEDTLS_ERR_NET_CONN_RESET;
-            else if (_pendingWrite)
-                result = MBEDTLS_ERR_SSL_WANT_WRITE;  // still busy with the last write
+            else if (_outBuf.size() >= kMaxOutputSize)
+                result = MBEDTLS_ERR_SSL_WANT_WRITE;  // processIO needs to send _outBuf first
             else {
-                //cerr << "[async write " << length << "] " << endl;
-                _pendingWrite.emplace(_stream->write(string((char*)buf, length)));
+                _outBuf.append((const char*)buf, length);
                 result = int(length);
             }
             //cerr << "-> " << result << endl;
@@ -217,20 +314,15 @@ namespace crouton::io::mbed {
             if (!_tcpOpen) {
                 // socket is closed
                 result = MBEDTLS_ERR_NET_CONN_RESET;
-            } else if (_pendingRead) {
-                // waiting for a read to complete
-                result = MBEDTLS_ERR_SSL_WANT_READ;
             } else if (_readBuf.size() > 0) {
-                // Copy bytes to the mbed buffer:
+                // Copy bytes from the stream's buffer to the mbed buffer:
                 size_t length = std::min(_readBuf.size(), maxLength);
                 ::memcpy(dst, _readBuf.data(), length);
                 _readBuf = _readBuf.last(_readBuf.size() - length);
                 result = int(length);
             } else if (!_readEOF) {
-                // We've read the entire buffer; time to read again:
-                //cerr << "[async read] " << endl;
-                _pendingRead.emplace(_stream->readNoCopy(100000));
-                _readBuf = ConstBytes{};
+                // We've read the entire buffer; processIO needs to read again:
+                _wantRead = true;
                 result = MBEDTLS_ERR_SSL_WANT_READ;
             } else {
                 // At EOF:
@@ -241,37 +333,73 @@ namespace crouton::io::mbed {
         }
 
 
-        // Awaits any read/write calls initiated by bio_send or bio_recv.
+        // Starts writing `_outBuf`, unless it's empty. A write must not already be in progress.
+        void startWrite() {
+            assert(!_pendingWrite);
+            if (!_outBuf.empty()) {
+                std::swap(_outBuf, _sendingBuf);
+                _outBuf.clear();
+                _pendingWrite.emplace(_stream->write(ConstBytes(_sendingBuf)));
+            }
+        }
+
+
+        // Waits for the write in progress, if any, to complete.
+        Future<void> finishWrite() {
+            if (_pendingWrite) {
+                auto &pw = *_pendingWrite;
+                AWAIT pw;
+                _pendingWrite.reset();
+            }
+            RETURN noerror;
+        }
+
+
+        // Makes sure the records in `_outBuf` are being written. If a write is already in
+        // progress it waits for it first, so at most two buffers' worth is in flight.
+        Future<void> sendOutput() {
+            if (!_outBuf.empty()) {
+                AWAIT finishWrite();
+                startWrite();
+            }
+            RETURN noerror;
+        }
+
+
+        // Does the I/O that bio_send and bio_recv asked for.
         // It's important to process writes before reads, to avoid deadlocks where each peer is
         // waiting for the other to send data.
         Future<void> processIO() {
-            while (_pendingWrite || _pendingRead) {
-                if (_pendingWrite) {
-                    //cerr << "processIO writing...\n";
-                    auto &pw = *_pendingWrite;
-                    AWAIT pw;
-                    _pendingWrite.reset();
-                } else if (_pendingRead) {
-                    //cerr << "processIO reading...\n";
-                    auto& pr = *_pendingRead;
-                    _readBuf = AWAIT pr;
-                    //cerr << "processIO read " << _readBuf.size() << " bytes\n";
-                    if (_readBuf.size() == 0)
-                        _readEOF = true;
-                    _pendingRead.reset();
-                }
+            AWAIT sendOutput();
+            if (_wantRead) {
+                AWAIT finishWrite();
+                //cerr << "processIO reading...\n";
+                _readBuf = AWAIT _stream->readNoCopy(100000);
+                //cerr << "processIO read " << _readBuf.size() << " bytes\n";
+                if (_readBuf.size() == 0)
+                    _readEOF = true;
+                _wantRead = false;
             }
             RETURN noerror;
         }
 
 
+        // Max size of `_outBuf`; beyond this, bio_send makes mbedTLS wait for it to be sent.
+        static constexpr size_t kMaxOutputSize = 64 * 1024;
+
+        // Buffers smaller than this are copied together by the multi-buffer `write`.
+        static constexpr size_t kGatherSize = 1024;
+
     private:
         std::shared_ptr<IStream>    _stream;            // The socket's stream
         TLSContext&                 _context;           // The shared mbedTLS context
+        string                      _sessionKey;        // Key of client's session in the cache
         mbedtls_ssl_context         _ssl;               // The mbedTLS SSL object
         optional<Future<void>>      _pendingWrite;      // In-progress write operation, if any
-        optional<Future<ConstBytes>>  _pendingRead;       // In-progress read operation, if any
-        ConstBytes                    _readBuf;           // The (remaining) data read from _stream
+        string                      _outBuf;            // Records waiting to be written
+        string                      _sendingBuf;        // Records being written by _pendingWrite
+        ConstBytes                  _readBuf;           // The (remaining) data read from _stream
+        bool                        _wantRead = false;  // bio_recv needs more data from _stream
         bool                        _readEOF = false;   // True when TCP read stream reaches EOF
         bool                        _tcpOpen = false;   // True when the TCP stream is open
         bool                        _tlsOpen = false;   // True when the TLS connection is open
@@ -281,12 +409,44 @@ namespace crouton::io::mbed {
 #pragma mark - TLS STREAM:
 
 
-    TLSSocket::TLSSocket()
-    :_inputBuf(make_unique<Buffer>())
-    { }
+    // The buffers that decrypted data is read into are pooled per thread. A socket only has one
+    // while it has unread data, not while it's waiting for the peer, so idle connections and
+    // connections that only write don't each tie up 64KB.
+    static constexpr size_t kMaxPooledBuffers = 8;
+    static thread_local vector<BufferRef> tBufferPool;
 
+    static BufferRef takeBuffer() {
+        if (tBufferPool.empty())
+            return make_unique<Buffer>();
+        BufferRef buf = std::move(tBufferPool.back());
+        tBufferPool.pop_back();
+        return buf;
+    }
 
-    TLSSocket::~TLSSocket() = default;
+    static void recycleBuffer(BufferRef&& buf) {
+        if (buf && tBufferPool.size() < kMaxPooledBuffers) {
+            buf->size = buf->used = 0;
+            tBufferPool.emplace_back(std::move(buf));
+        }
+        buf.reset();
+    }
+
+
+    TLSSocket::TLSSocket() = default;
+
+
+    TLSSocket::~TLSSocket() {
+        recycleBuffer(std::move(_inputBuf));
+    }
+
+
+    TLSSocket::SessionStats const& TLSSocket::sessionStats() {
+        return sSessionStats;
+    }
+
+    TLSSocket::HandshakeStats const& TLSSocket::handshakeStats() {
+        return sHandshakeStats;
+    }
 
 
     bool TLSSocket::isOpen() const  {
@@ -300,7 +460,8 @@ namespace crouton::io::mbed {
         socket->bind(*_binding);
         _impl = make_unique<Impl>(socket->stream(),
                                   TLSContext::defaultClientContext(),
-                                  _binding->address);
+                                  _binding->address,
+                                  _binding->address + ":" + std::to_string(_binding->port));
         _binding = nullptr;
         return _impl->handshake();
     }
@@ -310,6 +471,15 @@ namespace crouton::io::mbed {
     }
 
 
+    Future<void> TLSSocket::accept(shared_ptr<ISocket> socket, shared_ptr<TLSContext> context) {
+        precondition(!_impl);
+        NotReentrant nr(_busy);
+        _context = std::move(context);
+        _impl = make_unique<Impl>(socket->stream(), *_context, "");
+        return _impl->handshake();
+    }
+
+
     Future<ConstBytes> TLSSocket::readNoCopy(size_t maxLen)  {
         return _readNoCopy(maxLen, false);
     }
@@ -320,14 +490,18 @@ namespace crouton::io::mbed {
 
     Future<ConstBytes> TLSSocket::_readNoCopy(size_t maxLen, bool peek)  {
         NotReentrant nr(_busy);
-        if (_inputBuf->empty()) {
+        if (!_inputBuf || _inputBuf->empty()) {
+            // Give up the buffer while waiting for the peer, then decrypt into a pooled one:
+            recycleBuffer(std::move(_inputBuf));
+            AWAIT _impl->waitReadable();
+            _inputBuf = takeBuffer();
             auto len = AWAIT _impl->read(_inputBuf->data, _inputBuf->kCapacity);
             _inputBuf->size = uint32_t(len);
             _inputBuf->used = 0;
             if (_inputBuf->empty())
                 RETURN ConstBytes{};  // Reached EOF
         }
-        RETURN peek ? _inputBuf->data : _inputBuf->read(maxLen);
+        RETURN peek ? _inputBuf->bytes() : _inputBuf->read(maxLen);
     }
 
     Future<void> TLSSocket::write(ConstBytes buf)  {
@@ -335,8 +509,14 @@ namespace crouton::io::mbed {
         return _impl->write(buf);
     }
 
+    Future<void> TLSSocket::write(const ConstBytes buffers[], size_t nBuffers)  {
+        NotReentrant nr(_busy);
+        return _impl->write(buffers, nBuffers);
+    }
+
     Future<void> TLSSocket::close()  {
         NotReentrant nr(_busy);
+        recycleBuffer(std::move(_inputBuf));
         AWAIT _impl->close(true);
         RETURN noerror;
     }
@@ -347,4 +527,9 @@ namespace crouton::io::mbed {
         RETURN noerror;
     }
 
+    void TLSSocket::abort() {
+        if (_impl)
+            _impl->abort();
+    }
+
 }
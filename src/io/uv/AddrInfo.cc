@@ -17,8 +17,13 @@
 //
 
 #include "crouton/io/AddrInfo.hh"
+#include "crouton/CoCondition.hh"
 #include "crouton/Future.hh"
+#include "crouton/Task.hh"
 #include "UVInternal.hh"
+#include <chrono>
+#include <map>
+#include <mutex>
 
 namespace crouton::io {
     using namespace std;
@@ -28,9 +33,10 @@ namespace crouton::io {
 #pragma mark - DNS LOOKUP:
 
 
-    class getaddrinfo_request : public AwaitableRequest<uv_getaddrinfo_s> {
+    // Unlike AwaitableRequest, awaiting this returns the status instead of throwing it,
+    // since failures get cached too.
+    class getaddrinfo_request : public uv_getaddrinfo_s, public Blocker<int> {
     public:
-        explicit getaddrinfo_request(const char* what) :AwaitableRequest(what) { }
         static void callback(uv_getaddrinfo_s *req, int status, struct addrinfo *res) {
             auto self = static_cast<getaddrinfo_request*>(req);
             self->info = res;
@@ -41,14 +47,27 @@ namespace crouton::io {
     };
 
 
-    void AddrInfo::deleter::operator()(addrinfo* info)  {uv_freeaddrinfo(info);}
+    static int addressFamily(int family) {
+        switch (family) {
+            case 4:     return AF_INET;
+            case 6:     return AF_INET6;
+            case 0:     return AF_UNSPEC;
+            default:    return family;
+        }
+    }
 
-    AddrInfo::AddrInfo(addrinfo* info)                  :_info(info, deleter{}) { }
+
+    /// The outcome of a lookup: either an addrinfo list or a libuv error code.
+    struct LookupResult {
+        shared_ptr<addrinfo>    info;
+        int                     status = 0;
+    };
 
 
-    Future<AddrInfo> AddrInfo::lookup(string hostName, uint16_t port) {
+    /// Asks the resolver, via libuv's thread pool.
+    static Future<LookupResult> query(string const& hostName, uint16_t port, int family) {
         addrinfo hints = {
-            .ai_family = AF_UNSPEC,
+            .ai_family = family,
             .ai_socktype = SOCK_STREAM,
             .ai_protocol = IPPROTO_TCP,
         };
@@ -60,13 +79,213 @@ namespace crouton::io {
             service = portStr;  // This causes the 'port' fields of the addrinfos to be filled in
         }
 
-        getaddrinfo_request req("looking up hostname");
-        CHECK_RETURN(uv_getaddrinfo(curLoop(), &req, req.callback,
-                                 hostName.c_str(), service, &hints),
-                     "looking up hostname");
-        AWAIT req;
+        getaddrinfo_request req;
+        int status = uv_getaddrinfo(curLoop(), &req, req.callback,
+                                    hostName.c_str(), service, &hints);
+        if (status == 0)
+            status = AWAIT req;
+        LookupResult result {.status = status};
+        if (req.info)
+            result.info = shared_ptr<addrinfo>(req.info, uv_freeaddrinfo);
+        RETURN result;
+    }
+
+
+#pragma mark - DNS CACHE:
+
+
+    /** The process-wide cache of lookup results. Its lookups may be called on any thread. */
+    class DNSCache {
+    public:
+        using Clock = chrono::steady_clock;
+
+        struct Key {
+            string      host;
+            uint16_t    port;
+            int         family;
+            auto operator<=> (Key const&) const = default;
+        };
+
+        enum Found {
+            Fresh,      // `result` is valid
+            Stale,      // `result` is valid, but the caller should refresh it
+            Pending,    // Another lookup is querying; the Blocker will receive its result
+            Missing,    // The caller should query, then call `store`
+        };
+
+        static DNSCache& instance() {
+            static DNSCache sCache;
+            return sCache;
+        }
+
+        AddrInfo::CacheStats stats;
+
+        void setOptions(AddrInfo::CacheOptions const& options) {
+            unique_lock lock(_mutex);
+            _options = options;
+            trim();
+        }
+
+        void clear() {
+            unique_lock lock(_mutex);
+            // Entries being queried stay, since lookups are waiting on them:
+            erase_if(_entries, [](auto& item) {return !item.second.querying;});
+        }
+
+        Found find(Key const& key, Blocker<LookupResult>& blocker, LookupResult& result) {
+            ++stats.lookups;
+            unique_lock lock(_mutex);
+            if (_options.maxEntries == 0) {
+                ++stats.queries;
+                return Missing;
+            }
+            auto now = Clock::now();
+            auto [i, added] = _entries.try_emplace(key);
+            Entry& entry = i->second;
+            entry.lastUsed = now;
+            if (entry.valid) {
+                if (now < entry.expires) {
+                    ++stats.hits;
+                    result = entry.result;
+                    return Fresh;
+                } else if (entry.result.status == 0
+                                && now < entry.expires + seconds(_options.staleTTL)) {
+                    ++stats.hits;
+                    ++stats.staleHits;
+                    result = entry.result;
+                    if (entry.querying)
+                        return Fresh;       // it's already being refreshed
+                    entry.querying = true;
+                    ++stats.queries;
+                    return Stale;
+                }
+            }
+            if (entry.querying) {
+                ++stats.coalesced;
+                entry.waiters.push_back(&blocker);
+                return Pending;
+            }
+            entry.querying = true;
+            ++stats.queries;
+            if (added)
+                trim();
+            return Missing;
+        }
+
+        void store(Key const& key, LookupResult const& result) {
+            vector<Blocker<LookupResult>*> waiters;
+            {
+                unique_lock lock(_mutex);
+                auto i = _entries.find(key);
+                if (i == _entries.end())
+                    return;
+                Entry& entry = i->second;
+                entry.querying = false;
+                std::swap(waiters, entry.waiters);
+                auto now = Clock::now();
+                if (result.status == 0) {
+                    entry.result = result;
+                    entry.expires = now + seconds(_options.ttl);
+                    entry.valid = true;
+                } else if (isNegative(result.status)) {
+                    entry.result = result;
+                    entry.expires = now + seconds(_options.negativeTTL);
+                    entry.valid = true;
+                } else if (!entry.valid) {
+                    // Don't cache a transient failure. (But if a refresh failed, the stale
+                    // result can still be used.)
+                    _entries.erase(i);
+                }
+            }
+            for (auto waiter : waiters)
+                waiter->notify(result);
+        }
+
+    private:
+        struct Entry {
+            LookupResult                    result;
+            Clock::time_point               expires;            // When `result` becomes stale
+            Clock::time_point               lastUsed;
+            vector<Blocker<LookupResult>*>  waiters;            // Lookups awaiting `querying`
+            bool                            valid = false;      // True once `result` is set
+            bool                            querying = false;   // True while a query is running
+        };
+
+        static Clock::duration seconds(double secs) {
+            return chrono::duration_cast<Clock::duration>(chrono::duration<double>(secs));
+        }
+
+        // Errors meaning the name doesn't exist, as opposed to the resolver being unavailable.
+        static bool isNegative(int status) {
+            return status == UV_EAI_NONAME || status == UV_EAI_NODATA;
+        }
+
+        // Evicts the least recently used entries that aren't being queried, down to maxEntries.
+        void trim() {
+            while (_entries.size() > _options.maxEntries) {
+                auto victim = _entries.end();
+                for (auto i = _entries.begin(); i != _entries.end(); ++i) {
+                    if (!i->second.querying && (victim == _entries.end()
+                                                || i->second.lastUsed < victim->second.lastUsed))
+                        victim = i;
+                }
+                if (victim == _entries.end())
+                    break;
+                _entries.erase(victim);
+            }
+        }
+
+        mutex                   _mutex;
+        AddrInfo::CacheOptions  _options;
+        map<Key,Entry>          _entries;
+    };
+
 
-        RETURN AddrInfo(req.info);
+    /// Queries a name whose cached result is stale, updating the cache.
+    static Task refresh(DNSCache::Key key) {
+        LookupResult result = AWAIT query(key.host, key.port, key.family);
+        DNSCache::instance().store(key, result);
+    }
+
+
+    void AddrInfo::setCacheOptions(CacheOptions const& options) {
+        DNSCache::instance().setOptions(options);
+    }
+
+    void AddrInfo::clearCache() {
+        DNSCache::instance().clear();
+    }
+
+    AddrInfo::CacheStats const& AddrInfo::cacheStats() {
+        return DNSCache::instance().stats;
+    }
+
+
+#pragma mark - ADDRINFO:
+
+
+    Future<AddrInfo> AddrInfo::lookup(string hostName, uint16_t port, int family) {
+        DNSCache& cache = DNSCache::instance();
+        DNSCache::Key key {std::move(hostName), port, addressFamily(family)};
+        Blocker<LookupResult> blocker;
+        LookupResult result;
+        switch (cache.find(key, blocker, result)) {
+            case DNSCache::Fresh:
+                break;
+            case DNSCache::Stale:
+                refresh(key);
+                break;
+            case DNSCache::Pending:
+                result = AWAIT blocker;
+                break;
+            case DNSCache::Missing:
+                result = AWAIT query(key.host, key.port, key.family);
+                cache.store(key, result);
+                break;
+        }
+        if (result.status != 0)
+            RETURN Error(uv::UVError(result.status), "looking up hostname");
+        RETURN AddrInfo(std::move(result.info));
     }
 
 
@@ -86,6 +305,17 @@ namespace crouton::io {
         return nullptr;
     }
 
+    vector<sockaddr const*> AddrInfo::allAddresses() const {
+        assert(_info);
+        vector<sockaddr const*> addrs;
+        for (auto i = _info.get(); i; i = i->ai_next) {
+            if (i->ai_socktype == SOCK_STREAM && i->ai_protocol == IPPROTO_TCP
+                    && (i->ai_family == AF_INET || i->ai_family == AF_INET6))
+                addrs.push_back(i->ai_addr);
+        }
+        return addrs;
+    }
+
     sockaddr const& AddrInfo::primaryAddress() const {
         auto addr = primaryAddress(4);
         if (!addr)
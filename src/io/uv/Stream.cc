@@ -17,6 +17,7 @@
 //
 
 #include "crouton/io/Stream.hh"
+#include "crouton/io/FileStream.hh"
 #include "crouton/Future.hh"
 #include "UVInternal.hh"
 
@@ -57,6 +58,12 @@ namespace crouton::io {
         _inputBuf.reset();
         LNet->info("Stream::close");
         closeHandle(_stream);
+        _reading = false;
+        if (_readFuture) {
+            // libuv won't call the read callback after closing, so end the pending read now:
+            _readFuture->setResult(nullptr);
+            _readFuture = nullptr;
+        }
     }
 
     Future<void> Stream::close() {
@@ -65,6 +72,21 @@ namespace crouton::io {
     }
 
 
+    void Stream::abort() {
+        // Shutting down the socket makes reads hit EOF and writes fail, but unlike closing
+        // the handle it leaves this object usable by the coroutines that are using it:
+        uv_os_fd_t fd;
+        if (_stream && uv_fileno((uv_handle_t*)_stream, &fd) == 0) {
+            LNet->info("Stream::abort");
+#ifdef _WIN32
+            ::shutdown((SOCKET)fd, SD_BOTH);
+#else
+            ::shutdown(fd, SHUT_RDWR);
+#endif
+        }
+    }
+
+
 #pragma mark - READING:
 
 
@@ -227,6 +249,10 @@ namespace crouton::io {
         return _stream && uv_is_writable(_stream);
     }
 
+    size_t Stream::bytesQueued() const {
+        return _stream ? uv_stream_get_write_queue_size(_stream) : 0;
+    }
+
     Future<void> Stream::write(const ConstBytes bufs[], size_t nbufs) {
         precondition(isOpen());
 
@@ -250,6 +276,33 @@ namespace crouton::io {
     }
 
 
+    Future<size_t> Stream::sendFile(FileStream& file, uint64_t offset, size_t length) {
+        precondition(isOpen() && file.isOpen());
+#ifdef _WIN32
+        RETURN 0;   // libuv's sendfile can't write to a socket HANDLE
+#else
+        // Data queued by earlier writes has to go first; and sendfile needs a file descriptor:
+        uv_os_fd_t fd;
+        if (uv_stream_get_write_queue_size(_stream) > 0 || uv_fileno((uv_handle_t*)_stream, &fd) != 0)
+            RETURN 0;
+
+        struct sendfile_request : public uv_fs_s, public Blocker<ssize_t> { };
+        sendfile_request req;
+        check(uv_fs_sendfile(curLoop(), &req, fd, file.fileDescriptor(), int64_t(offset), length,
+                             [](uv_fs_t* r) {
+                                 static_cast<sendfile_request*>(r)->notify(r->result);
+                             }),
+              "sending a file");
+        ssize_t result = AWAIT req;
+        uv_fs_req_cleanup(&req);
+        if (result == UV_EAGAIN)
+            RETURN 0;   // The socket's send buffer is full
+        check(result, "sending a file");
+        RETURN size_t(result);
+#endif
+    }
+
+
     size_t Stream::tryWrite(ConstBytes buf) {
         uv_buf_t uvbuf(buf);
         int result = uv_try_write(_stream, &uvbuf, 1);
@@ -17,6 +17,11 @@
 //
 
 #include "crouton/io/TCPServer.hh"
+#include "crouton/io/Deadline.hh"
+#include "crouton/io/mbed/TLSSocket.hh"
+#include "crouton/Future.hh"
+#include "crouton/Task.hh"
+#include "io/mbed/TLSContext.hh"
 #include "io/uv/TCPSocket.hh"
 #include "UVInternal.hh"
 #include "crouton/util/Logging.hh"
@@ -49,15 +54,15 @@ namespace crouton::io {
         int addrLen = sizeof(addr);
         check(uv_tcp_getsockname(_tcpHandle, (sockaddr*)&addr, &addrLen), "getting server port");
         if (addr.ss_family == AF_INET)
-            return ((sockaddr_in&)addr).sin_port;
+            return ntohs(((sockaddr_in&)addr).sin_port);
         else
-            return ((sockaddr_in6&)addr).sin6_port;
+            return ntohs(((sockaddr_in6&)addr).sin6_port);
     }
 
 
-    void TCPServer::listen(std::function<void(std::shared_ptr<ISocket>)> acceptor) {
+    void TCPServer::listen(std::function<void(std::shared_ptr<ISocket>)> acceptor, int backlog) {
         _acceptor = std::move(acceptor);
-        check(uv_listen((uv_stream_t*)_tcpHandle, 2, [](uv_stream_t *server, int status) noexcept {
+        check(uv_listen((uv_stream_t*)_tcpHandle, backlog, [](uv_stream_t *server, int status) noexcept {
             try {
                 ((TCPServer*)server->data)->accept(status);
             } catch (...) {
@@ -68,6 +73,12 @@ namespace crouton::io {
     }
 
 
+    void TCPServer::useTLS(TLSServerConfig const& config) {
+        precondition(!_isOpen);
+        _tlsContext = make_shared<mbed::TLSContext>(config);
+    }
+
+
     void TCPServer::close() {
         LNet->info("TCPServer closing listener socket");
         _isOpen = false;
@@ -84,10 +95,38 @@ namespace crouton::io {
             uv_tcp_init(curLoop(), clientHandle);
             check(uv_accept((uv_stream_t*)_tcpHandle, (uv_stream_t*)clientHandle),
                   "accepting client connection");
+            if (_admission && !_admission->shouldAccept()) {
+                closeHandle(clientHandle);
+                return;
+            }
             auto client = make_shared<TCPSocket>();
             client->accept(clientHandle);
-            _acceptor(std::move(client));
+            if (_tlsContext)
+                acceptTLS(std::move(client), _tlsContext, _acceptor);
+            else
+                _acceptor(std::move(client));
         }
     }
 
+
+    // Runs the TLS handshake with a new client, then passes its TLSSocket to the acceptor.
+    // (It copies the context and acceptor, since the server may be closed in the meantime.)
+    Task TCPServer::acceptTLS(shared_ptr<ISocket> client,
+                              shared_ptr<mbed::TLSContext> context,
+                              Acceptor acceptor)
+    {
+        auto tlsSocket = mbed::TLSSocket::create();
+        Deadline deadline([tlsSocket] {
+            LNet->warn("TCPServer: TLS handshake with client timed out; aborting it");
+            tlsSocket->abort();
+        });
+        deadline.set(context->handshakeTimeout());
+        Result<void> result = AWAIT NoThrow(tlsSocket->accept(std::move(client), std::move(context)));
+        deadline.clear();
+        if (result.ok())
+            acceptor(std::move(tlsSocket));
+        else
+            LNet->warn("TCPServer: TLS handshake with client failed: {}", result.error());
+    }
+
 }
@@ -17,14 +17,138 @@
 //
 
 #include "TCPSocket.hh"
+#include "crouton/CoCondition.hh"
+#include "crouton/EventLoop.hh"
 #include "crouton/Future.hh"
 #include "crouton/io/AddrInfo.hh"
 #include "UVInternal.hh"
+#include <algorithm>
+#include <cstring>
 
 namespace crouton::io::uv {
     using namespace std;
 
-    using connect_request = AwaitableRequest<uv_connect_s>;
+    // RFC 8305's recommended "Connection Attempt Delay".
+    static constexpr double kAttemptDelay = 0.25;
+
+
+    /** Connects to the first reachable one of a list of addresses, following RFC 8305
+        ("Happy Eyeballs"): attempts start `kAttemptDelay` apart, or as soon as the previous
+        one fails; the first to connect wins, and the others are cancelled. So an unreachable
+        address, like an IPv6 address without IPv6 routing, costs a quarter second instead of a
+        whole connect timeout. */
+    class ConnectRace : public enable_shared_from_this<ConnectRace> {
+    public:
+        ConnectRace(vector<sockaddr_storage> addrs, bool noDelay, unsigned keepAlive)
+        :_addrs(std::move(addrs))
+        ,_noDelay(noDelay)
+        ,_keepAlive(keepAlive)
+        { }
+
+        /// Runs the race, returning the connected handle of the winner, or the last error.
+        Future<uv_tcp_t*> run() {
+            startNext();
+            AWAIT _done;
+            if (!_winner)
+                RETURN Error(UVError(_lastError), "opening connection");
+            RETURN _winner;
+        }
+
+    private:
+        // A connection attempt; deletes itself when its callback is called.
+        struct Attempt : public uv_connect_s {
+            Attempt(shared_ptr<ConnectRace> r, uv_tcp_t* h)  :race(std::move(r)), handle(h) { }
+            shared_ptr<ConnectRace> race;   // Keeps the race alive until every attempt ends
+            uv_tcp_t*               handle;
+        };
+
+        // Starts an attempt on the next address, if any.
+        void startNext() {
+            while (!_finished && _next < _addrs.size()) {
+                auto& addr = _addrs[_next++];
+                auto handle = new uv_tcp_t;
+                uv_tcp_init(curLoop(), handle);
+                uv_tcp_nodelay(handle, _noDelay);
+                uv_tcp_keepalive(handle, (_keepAlive > 0), _keepAlive);
+                auto attempt = new Attempt(shared_from_this(), handle);
+                int err = uv_tcp_connect(attempt, handle, (sockaddr*)&addr, &connected);
+                if (err == 0) {
+                    _attempting.push_back(handle);
+                    if (_next < _addrs.size())
+                        _timer.once(kAttemptDelay);
+                    return;
+                }
+                delete attempt;
+                closeHandle(handle);
+                _lastError = err;
+            }
+            if (_attempting.empty())
+                finish();           // Every address failed
+        }
+
+        static void connected(uv_connect_t* req, int status) {
+            unique_ptr<Attempt> attempt(static_cast<Attempt*>(req));
+            attempt->race->attemptFinished(attempt->handle, status);
+        }
+
+        void attemptFinished(uv_tcp_t* handle, int status) {
+            auto i = std::find(_attempting.begin(), _attempting.end(), handle);
+            if (i == _attempting.end())
+                return;             // It was cancelled, and already closed
+            _attempting.erase(i);
+            if (status == 0 && !_finished) {
+                _winner = handle;
+                finish();
+            } else {
+                if (status != 0)
+                    _lastError = status;
+                closeHandle(handle);
+                _timer.stop();
+                startNext();        // Don't wait for the timer to try the next address
+            }
+        }
+
+        void finish() {
+            _finished = true;
+            _timer.stop();
+            for (uv_tcp_t* handle : _attempting)
+                closeHandle(handle);   // Closing the handle cancels its connect request
+            _attempting.clear();
+            _done.notify();
+        }
+
+        vector<sockaddr_storage>    _addrs;                 // Addresses, in order to try them
+        size_t                      _next = 0;              // Index of next address to try
+        vector<uv_tcp_t*>           _attempting;            // Handles of attempts in progress
+        uv_tcp_t*                   _winner = nullptr;      // The handle that connected
+        int                         _lastError = UV_EAI_NONAME;
+        bool                        _finished = false;
+        bool                        _noDelay;
+        unsigned                    _keepAlive;
+        Timer                       _timer {[this] {startNext();}};
+        Blocker<void>               _done;
+    };
+
+
+    // Orders addresses for connecting, per RFC 8305 section 4: alternating between families,
+    // starting with the family of the resolver's first choice.
+    static vector<sockaddr_storage> interleave(vector<sockaddr const*> const& addrs) {
+        vector<sockaddr const*> first, second;
+        for (auto addr : addrs)
+            (addr->sa_family == addrs[0]->sa_family ? first : second).push_back(addr);
+        vector<sockaddr_storage> result;
+        for (size_t i = 0; i < max(first.size(), second.size()); ++i) {
+            for (auto list : {&first, &second}) {
+                if (i < list->size()) {
+                    sockaddr const* addr = (*list)[i];
+                    sockaddr_storage& storage = result.emplace_back();
+                    memcpy(&storage, addr, (addr->sa_family == AF_INET6) ? sizeof(sockaddr_in6)
+                                                                         : sizeof(sockaddr_in));
+                }
+            }
+        }
+        return result;
+    }
 
     
     TCPSocket::TCPSocket() = default;
@@ -35,27 +159,20 @@ namespace crouton::io::uv {
         precondition(_binding);
 
         // Resolve the address/hostname:
-        sockaddr addr;
-        int status = uv_ip4_addr(_binding->address.c_str(), _binding->port, (sockaddr_in*)&addr);
+        vector<sockaddr_storage> addrs(1);
+        int status = uv_ip4_addr(_binding->address.c_str(), _binding->port,
+                                 (sockaddr_in*)&addrs[0]);
         if (status < 0) {
             AddrInfo ai = AWAIT AddrInfo::lookup(_binding->address, _binding->port);
-            addr = ai.primaryAddress();
+            addrs = interleave(ai.allAddresses());
+            if (addrs.empty())
+                RETURN Error(UVError(UV__EAI_ADDRFAMILY), "opening connection");
         }
 
-        auto tcpHandle = new uv_tcp_t;
-        uv_tcp_init(curLoop(), tcpHandle);
-        uv_tcp_nodelay(tcpHandle, _binding->noDelay);
-        uv_tcp_keepalive(tcpHandle, (_binding->keepAlive > 0), _binding->keepAlive);
+        auto race = make_shared<ConnectRace>(std::move(addrs), _binding->noDelay,
+                                             _binding->keepAlive);
         _binding.reset();
-
-        connect_request req("opening connection");
-        int err = uv_tcp_connect(&req, tcpHandle, &addr, req.callback);
-        if (err < 0) {
-            closeHandle(tcpHandle);
-            check(err, "opening connection");
-        }
-
-        AWAIT req;
+        uv_tcp_t* tcpHandle = AWAIT race->run();
 
         opened((uv_stream_t*)tcpHandle);
         RETURN noerror;
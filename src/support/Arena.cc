@@ -0,0 +1,166 @@
+//
+// Arena.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/util/Arena.hh"
+#include "crouton/util/betterassert.hh"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace crouton::util {
+    using namespace std;
+
+
+    // Header of a chunk; the chunk's data immediately follows it in memory.
+    struct alignas(std::max_align_t) Arena::Chunk {
+        Chunk*  prev;           // Previously-allocated chunk, or nullptr
+        size_t  capacity;       // Size of data
+        size_t  used;           // Number of bytes of data allocated
+
+        char* data()            {return reinterpret_cast<char*>(this + 1);}
+        char* end()             {return data() + used;}
+    };
+
+
+    Arena::Arena(Arena&& other) noexcept
+    :_chunk(other._chunk)
+    ,_chunkSize(other._chunkSize)
+    ,_bytesAllocated(other._bytesAllocated)
+    {
+        other._chunk = nullptr;
+        other._bytesAllocated = 0;
+    }
+
+    Arena& Arena::operator=(Arena&& other) noexcept {
+        if (this != &other) {
+            freeChunks(_chunk);
+            _chunk = other._chunk;
+            _chunkSize = other._chunkSize;
+            _bytesAllocated = other._bytesAllocated;
+            other._chunk = nullptr;
+            other._bytesAllocated = 0;
+        }
+        return *this;
+    }
+
+    Arena::~Arena() {
+        freeChunks(_chunk);
+    }
+
+
+    void Arena::freeChunks(Chunk* chunk) noexcept {
+        while (chunk) {
+            Chunk* prev = chunk->prev;
+            ::operator delete(chunk);
+            chunk = prev;
+        }
+    }
+
+
+    Arena::Chunk* Arena::newChunk(size_t minSize) {
+        size_t capacity = std::max(minSize, _chunkSize);
+        auto chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk) + capacity));
+        chunk->prev = _chunk;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        _chunk = chunk;
+        return chunk;
+    }
+
+
+    void* Arena::alloc(size_t size, size_t alignment) {
+        precondition(alignment > 0 && (alignment & (alignment - 1)) == 0);
+        precondition(alignment <= alignof(std::max_align_t));
+        Chunk* chunk = _chunk;
+        size_t start = 0;
+        if (chunk) {
+            start = (chunk->used + alignment - 1) & ~(alignment - 1);
+            if (start + size > chunk->capacity)
+                chunk = nullptr;
+        }
+        if (!chunk) {
+            chunk = newChunk(size);
+            start = 0;
+        }
+        chunk->used = start + size;
+        _bytesAllocated += size;
+        return chunk->data() + start;
+    }
+
+
+    string_view Arena::copy(string_view str) {
+        if (str.empty())
+            return {};
+        auto dst = static_cast<char*>(alloc(str.size(), 1));
+        ::memcpy(dst, str.data(), str.size());
+        return {dst, str.size()};
+    }
+
+
+    string_view Arena::append(string_view str, string_view more) {
+        if (more.empty())
+            return str;
+        if (str.empty())
+            return copy(more);
+        if (Chunk* chunk = _chunk; chunk && str.data() + str.size() == chunk->end()
+                                          && chunk->used + more.size() <= chunk->capacity) {
+            // `str` is the latest allocation and there's room to extend it in place:
+            ::memcpy(chunk->end(), more.data(), more.size());
+            chunk->used += more.size();
+            _bytesAllocated += more.size();
+            return {str.data(), str.size() + more.size()};
+        }
+        auto dst = static_cast<char*>(alloc(str.size() + more.size(), 1));
+        ::memcpy(dst, str.data(), str.size());
+        ::memcpy(dst + str.size(), more.data(), more.size());
+        return {dst, str.size() + more.size()};
+    }
+
+
+    void Arena::reset() noexcept {
+        if (_chunk) {
+            // Free all but the oldest chunk, and keep that one if it's the standard size:
+            Chunk* first = _chunk;
+            while (first->prev)
+                first = first->prev;
+            if (first->capacity == _chunkSize) {
+                Chunk* chunk = _chunk;
+                while (chunk != first) {
+                    Chunk* prev = chunk->prev;
+                    ::operator delete(chunk);
+                    chunk = prev;
+                }
+                first->used = 0;
+                _chunk = first;
+            } else {
+                freeChunks(_chunk);
+                _chunk = nullptr;
+            }
+        }
+        _bytesAllocated = 0;
+    }
+
+
+    size_t Arena::chunkCount() const noexcept {
+        size_t n = 0;
+        for (Chunk* chunk = _chunk; chunk; chunk = chunk->prev)
+            ++n;
+        return n;
+    }
+
+}
@@ -0,0 +1,115 @@
+//
+// FastRandom.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "FastRandom.hh"
+#include "crouton/Misc.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace crouton {
+    using namespace std;
+
+
+    static inline uint32_t rotl(uint32_t x, int n) {return (x << n) | (x >> (32 - n));}
+
+    static inline void quarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+        a += b;  d ^= a;  d = rotl(d, 16);
+        c += d;  b ^= c;  b = rotl(b, 12);
+        a += b;  d ^= a;  d = rotl(d, 8);
+        c += d;  b ^= c;  b = rotl(b, 7);
+    }
+
+    void ChaCha20Block(uint32_t const state[16], uint8_t out[64]) {
+        uint32_t x[16];
+        memcpy(x, state, sizeof(x));
+        for (int i = 0; i < 10; ++i) {
+            quarterRound(x[0], x[4], x[ 8], x[12]);
+            quarterRound(x[1], x[5], x[ 9], x[13]);
+            quarterRound(x[2], x[6], x[10], x[14]);
+            quarterRound(x[3], x[7], x[11], x[15]);
+            quarterRound(x[0], x[5], x[10], x[15]);
+            quarterRound(x[1], x[6], x[11], x[12]);
+            quarterRound(x[2], x[7], x[ 8], x[13]);
+            quarterRound(x[3], x[4], x[ 9], x[14]);
+        }
+        for (int i = 0; i < 16; ++i) {
+            uint32_t w = x[i] + state[i];
+            out[4*i + 0] = uint8_t(w);
+            out[4*i + 1] = uint8_t(w >> 8);
+            out[4*i + 2] = uint8_t(w >> 16);
+            out[4*i + 3] = uint8_t(w >> 24);
+        }
+    }
+
+
+    /** A CSPRNG that produces the ChaCha20 keystream (RFC 8439 §2.3) of a random key and nonce.
+        It's reseeded from `Randomize` after every kBlocksPerSeed blocks. */
+    class ChaChaRandom {
+    public:
+        void fill(void* dst, size_t len) {
+            auto out = (uint8_t*)dst;
+            while (len > 0) {
+                if (_avail == 0)
+                    refill();
+                size_t n = std::min(len, _avail);
+                memcpy(out, &_buf[sizeof(_buf) - _avail], n);
+                _avail -= n;
+                out += n;
+                len -= n;
+            }
+        }
+
+    private:
+        static constexpr size_t kBlockSize = 64;
+        static constexpr size_t kBlocksPerRefill = 4;
+        static constexpr size_t kBlocksPerSeed = 16384;     // i.e. reseed after 1MB of output
+
+        void refill() {
+            if (_blocksLeft == 0)
+                reseed();
+            for (size_t i = 0; i < kBlocksPerRefill; ++i) {
+                ChaCha20Block(_state, &_buf[i * kBlockSize]);
+                if (++_state[12] == 0)                      // 64-bit block counter
+                    ++_state[13];
+            }
+            _blocksLeft -= kBlocksPerRefill;
+            _avail = sizeof(_buf);
+        }
+
+        void reseed() {
+            _state[0] = 0x61707865;  _state[1] = 0x3320646e;    // "expand 32-byte k"
+            _state[2] = 0x79622d32;  _state[3] = 0x6b206574;
+            Randomize(&_state[4], 8 * sizeof(uint32_t));        // key
+            _state[12] = _state[13] = 0;                        // block counter
+            Randomize(&_state[14], 2 * sizeof(uint32_t));       // nonce
+            _blocksLeft = kBlocksPerSeed;
+        }
+
+        uint32_t    _state[16];
+        uint8_t     _buf[kBlocksPerRefill * kBlockSize];
+        size_t      _avail = 0;                 // Number of unused bytes at the end of _buf
+        size_t      _blocksLeft = 0;            // Blocks to generate before reseeding
+    };
+
+
+    void FastRandomize(void* buf, size_t len) {
+        static thread_local ChaChaRandom tRandom;
+        tRandom.fill(buf, len);
+    }
+
+}
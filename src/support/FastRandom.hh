@@ -0,0 +1,31 @@
+//
+// FastRandom.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace crouton {
+
+    /// Computes the ChaCha20 block function (RFC 8439 §2.3) of a state: 4 constant words,
+    /// 8 words of key, a 32-bit block counter and 3 words of nonce. (`FastRandomize` uses the
+    /// 13th word as the high half of a 64-bit counter instead.)
+    /// Writes the 64-byte block to `out`, serialized in little-endian order.
+    void ChaCha20Block(uint32_t const state[16], uint8_t out[64]);
+
+}
@@ -71,6 +71,15 @@ namespace crouton {
     }
 
 
+    string_view trimWhitespace(string_view str) noexcept {
+        while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+            str.remove_prefix(1);
+        while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+            str.remove_suffix(1);
+        return str;
+    }
+
+
     void replaceStringInPlace(string &str,
                               string_view substring,
                               string_view replacement)
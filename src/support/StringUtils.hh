@@ -97,6 +97,9 @@ namespace crouton {
     Pure std::pair<string_view,string_view> 
         splitAt(string_view str, size_t pos, size_t delimSize = 0) noexcept;
 
+    /// Removes leading and trailing spaces and tabs.
+    Pure string_view trimWhitespace(string_view str) noexcept;
+
     /// Replaces all occurrences of `substring` with `replacement`, in-place.
     void replaceStringInPlace(string &str,
                               string_view substring,
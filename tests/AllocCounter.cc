@@ -0,0 +1,44 @@
+//
+// AllocCounter.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "AllocCounter.hh"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // GCC doesn't know new calls malloc
+#endif
+
+
+static std::atomic<size_t> sHeapAllocations = 0;
+
+size_t HeapAllocationCount() {
+    return sHeapAllocations;
+}
+
+
+void* operator new(size_t size) {
+    ++sHeapAllocations;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept              {std::free(p);}
+void operator delete(void* p, size_t) noexcept      {std::free(p);}
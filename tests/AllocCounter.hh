@@ -0,0 +1,25 @@
+//
+// AllocCounter.hh
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <cstddef>
+
+/// The number of heap allocations made so far by `operator new`, on all threads.
+/// Tests and benchmarks use this to measure how much a code path allocates.
+/// @note  This requires linking with AllocCounter.cc, which replaces the global `operator new`.
+size_t HeapAllocationCount();
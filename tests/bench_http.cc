@@ -0,0 +1,226 @@
+//
+// bench_http.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/Crouton.hh"
+#include "crouton/io/HTTPHandler.hh"
+#include "crouton/io/HTTPParser.hh"
+#include "crouton/io/TCPServer.hh"
+#include "crouton/util/Logging.hh"
+#include "crouton/util/MiniOStream.hh"
+#include "AllocCounter.hh"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <vector>
+
+using namespace crouton;
+using namespace crouton::mini;
+using namespace crouton::io;
+using std::vector;
+
+/* HTTP server benchmark. Runs an http::Handler behind a TCPServer, and drives it over loopback
+   with a load generator running on the same event loop, then reports throughput, latency
+   percentiles and heap allocations per request (client and server combined.)
+
+   Usage: bench_http [-c connections] [-n requests] [-b bodySize] [--close]
+        -c      Number of concurrent client connections (default 16)
+        -n      Total number of requests (default 20000)
+        -b      Size in bytes of the response body (default 0)
+        --close Don't use keep-alive; open a new connection for every request
+
+   Build it with NDEBUG defined (a CMake Release build); in debug builds, coroutine lifecycle
+   tracking adds so much overhead that the results are meaningless.
+*/
+
+
+#pragma mark - SERVER:
+
+
+struct Options {
+    unsigned connections = 16;
+    unsigned requests    = 20000;
+    size_t   bodySize    = 0;
+    bool     keepAlive   = true;
+};
+
+static Options sOptions;
+static string  sBody;
+static string  sContentLength;
+
+
+staticASYNC<void> serveBench(http::Handler::Request const&, http::Handler::Response& res) {
+    res.writeHeader("Content-Length", sContentLength);
+    if (!sBody.empty())
+        AWAIT res.writeToBody(sBody);
+    RETURN noerror;
+}
+
+
+static http::Router sRoutes = {
+    {http::Method::GET, "/bench", serveBench},
+};
+
+
+static Task connectionTask(std::shared_ptr<ISocket> client) {
+    http::Handler handler(client->stream(), sRoutes);
+    AWAIT handler.run();
+}
+
+
+#pragma mark - LOAD GENERATOR:
+
+
+using Clock = std::chrono::steady_clock;
+
+
+// Sends `nRequests` requests, one at a time, recording each one's latency in microseconds.
+staticASYNC<void> runClient(uint16_t port, unsigned nRequests, vector<double>& latencies) {
+    string request = "GET /bench HTTP/1.1\r\nHost: localhost\r\n";
+    if (!sOptions.keepAlive)
+        request += "Connection: close\r\n";
+    request += "\r\n";
+
+    std::shared_ptr<ISocket> socket;
+    std::optional<http::Parser> parser;
+    for (unsigned i = 0; i < nRequests; ++i) {
+        auto start = Clock::now();
+        if (!socket) {
+            socket = ISocket::newSocket(false);
+            socket->bind("127.0.0.1", port);
+            socket->setNoDelay(true);
+            AWAIT socket->open();
+            parser.emplace(*socket->stream(), http::Parser::Response);
+        }
+        AWAIT socket->stream()->write(ConstBytes(request));
+        AWAIT parser->readHeaders();
+        if (parser->status != http::Status::OK)
+            Error::raise(CroutonError::InvalidState, "Unexpected HTTP status");
+        while (!parser->complete())
+            (void) AWAIT parser->readBody();
+        latencies.push_back(std::chrono::duration<double,std::micro>(Clock::now() - start).count());
+
+        if (sOptions.keepAlive && parser->keepAlive()) {
+            parser->reset();
+        } else {
+            AWAIT socket->close();
+            parser.reset();
+            socket = nullptr;
+        }
+    }
+    if (socket)
+        AWAIT socket->close();
+    RETURN noerror;
+}
+
+
+static double percentile(vector<double> const& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(size_t(p * double(sorted.size())), sorted.size() - 1);
+    return sorted[i];
+}
+
+
+static bool parseNumber(std::optional<string_view> arg, auto& value) {
+    if (!arg)
+        return false;
+    auto [ptr, ec] = std::from_chars(arg->data(), arg->data() + arg->size(), value);
+    return ec == std::errc{} && ptr == arg->data() + arg->size();
+}
+
+
+staticASYNC<int> run() {
+    // Read flags:
+    auto args = MainArgs();
+    while (auto flag = args.popFlag()) {
+        bool ok = true;
+        if (flag == "-c")
+            ok = parseNumber(args.popFirst(), sOptions.connections) && sOptions.connections > 0;
+        else if (flag == "-n")
+            ok = parseNumber(args.popFirst(), sOptions.requests);
+        else if (flag == "-b")
+            ok = parseNumber(args.popFirst(), sOptions.bodySize);
+        else if (flag == "--close")
+            sOptions.keepAlive = false;
+        else
+            ok = false;
+        if (!ok) {
+            cerr << "Invalid flag or value " << *flag << endl;
+            RETURN 1;
+        }
+    }
+
+    // Per-request logging would dominate the results:
+    InitLogging();
+    for (auto logger : {Log, LCoro, LSched, LLoop, LNet})
+        logger->set_level(log::level::warn);
+
+    sBody = string(sOptions.bodySize, 'x');
+    sContentLength = std::to_string(sOptions.bodySize);
+
+    static TCPServer server(0, "127.0.0.1");
+    server.listen([](std::shared_ptr<ISocket> client) {
+        connectionTask(std::move(client));
+    });
+    uint16_t port = server.port();
+
+#ifndef NDEBUG
+    cout << "WARNING: This is a debug build, so the results will be much too slow!\n";
+#endif
+    cout << "Sending " << sOptions.requests << " requests over " << sOptions.connections
+         << (sOptions.keepAlive ? " keep-alive" : " non-keep-alive")
+         << " connections; body size " << sOptions.bodySize << " bytes..." << endl;
+
+    // Run the clients:
+    vector<vector<double>> latencies(sOptions.connections);
+    for (auto& l : latencies)
+        l.reserve(sOptions.requests / sOptions.connections + 1);
+    vector<Future<void>> clients;
+    clients.reserve(sOptions.connections);
+
+    size_t allocsBefore = HeapAllocationCount();
+    auto start = Clock::now();
+    for (unsigned c = 0; c < sOptions.connections; ++c) {
+        unsigned n = sOptions.requests / sOptions.connections
+                   + (c < sOptions.requests % sOptions.connections);
+        clients.push_back(runClient(port, n, latencies[c]));
+    }
+    for (auto& client : clients)
+        AWAIT client;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t allocs = HeapAllocationCount() - allocsBefore;
+    server.close();
+
+    // Report:
+    vector<double> all;
+    for (auto& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    double n = double(std::max(all.size(), size_t(1)));
+    cout << "Requests:      " << all.size() << " in " << elapsed << " sec\n"
+         << "Throughput:    " << unsigned(double(all.size()) / elapsed) << " req/sec\n"
+         << "Latency p50:   " << percentile(all, 0.50) << " µs\n"
+         << "Latency p99:   " << percentile(all, 0.99) << " µs\n"
+         << "Latency p99.9: " << percentile(all, 0.999) << " µs\n"
+         << "Allocations:   " << double(allocs) / n << " per request\n";
+    RETURN 0;
+}
+
+
+CROUTON_MAIN(run)
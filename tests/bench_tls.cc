@@ -0,0 +1,317 @@
+//
+// bench_tls.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/Crouton.hh"
+#include "crouton/io/TCPServer.hh"
+#include "crouton/io/mbed/TLSSocket.hh"
+#include "crouton/util/Logging.hh"
+#include "crouton/util/MiniOStream.hh"
+#include "io/mbed/TLSContext.hh"
+#include "AllocCounter.hh"
+#include "TestCerts.hh"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+using namespace crouton;
+using namespace crouton::mini;
+using namespace crouton::io;
+using std::vector;
+
+/* TLS benchmark. Runs a TLS TCPServer, and drives it over loopback with mbed::TLSSockets running
+   on the same event loop, so each byte is encrypted and decrypted once per direction.
+
+   Handshakes: Clients connect and disconnect repeatedly, first with full handshakes (the client
+   session cache is cleared before each) and then resuming their sessions. Reports handshakes/sec
+   and latency percentiles.
+
+   Throughput: Each client uploads its share of the data to the server, then downloads the same
+   amount. Reports MB/sec and heap allocations per MB (client and server combined.)
+
+   Usage: bench_tls [-c connections] [-m megabytes] [-h handshakes] [--offload]
+        -c        Number of concurrent clients (default 4)
+        -m        Megabytes to transfer in each direction (default 256)
+        -h        Number of handshakes of each kind (default 1000; 0 skips them)
+        --offload Run the server's handshakes on the thread pool
+
+   Build it with NDEBUG defined (a CMake Release build); in debug builds, coroutine lifecycle
+   tracking adds so much overhead that the results are meaningless.
+*/
+
+
+#pragma mark - SERVER:
+
+
+struct Options {
+    unsigned connections = 4;
+    size_t   megabytes   = 256;
+    unsigned handshakes  = 1000;
+    bool     offload     = false;
+};
+
+static Options sOptions;
+
+static constexpr size_t kChunkSize = 64 * 1024;       // Size of each write
+static char sChunk[kChunkSize];                         // Data to send
+
+
+// A client's request is a command byte followed by a 64-bit byte count:
+//   'U' -- the client then sends that many bytes, and the server replies with one byte.
+//   'D' -- the server sends that many bytes.
+// A client that only wants to handshake closes without sending anything.
+struct Command {
+    char     mode;
+    uint64_t length;
+};
+
+
+static Task connectionTask(std::shared_ptr<ISocket> client) {
+    auto stream = client->stream();
+    Command cmd;
+    Result<void> ok = AWAIT NoThrow(stream->readExactly(MutableBytes(&cmd.mode, 1)));
+    if (ok.ok())
+        ok = AWAIT NoThrow(stream->readExactly(MutableBytes(&cmd.length, sizeof(cmd.length))));
+    if (ok.ok()) {
+        if (cmd.mode == 'U') {
+            for (uint64_t left = cmd.length; left > 0; ) {
+                size_t n = size_t(std::min<uint64_t>(left, kChunkSize));
+                ConstBytes bytes = AWAIT stream->readNoCopy(n);
+                if (bytes.empty())
+                    break;
+                left -= bytes.size();
+            }
+            AWAIT stream->write(string("K"));
+        } else if (cmd.mode == 'D') {
+            for (uint64_t left = cmd.length; left > 0; ) {
+                size_t n = size_t(std::min<uint64_t>(left, kChunkSize));
+                AWAIT stream->write(ConstBytes(sChunk, n));
+                left -= n;
+            }
+        }
+    }
+    (void) AWAIT NoThrow(client->close());
+}
+
+
+#pragma mark - CLIENTS:
+
+
+using Clock = std::chrono::steady_clock;
+
+
+static double percentile(vector<double> const& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(size_t(p * double(sorted.size())), sorted.size() - 1);
+    return sorted[i];
+}
+
+
+staticASYNC<std::shared_ptr<mbed::TLSSocket>> connect(uint16_t port) {
+    auto socket = mbed::TLSSocket::create();
+    socket->bind("127.0.0.1", port);
+    socket->setNoDelay(true);
+    AWAIT socket->open();
+    RETURN socket;
+}
+
+
+// Connects and disconnects `n` times, recording each handshake's latency in microseconds.
+staticASYNC<void> runHandshakeClient(uint16_t port, unsigned n, bool resume,
+                                     vector<double>& latencies)
+{
+    auto& sessions = mbed::TLSContext::defaultClientContext().sessionCache();
+    string sessionKey = "127.0.0.1:" + std::to_string(port);
+    for (unsigned i = 0; i < n; ++i) {
+        if (!resume)
+            sessions.remove(sessionKey);
+        auto start = Clock::now();
+        auto socket = AWAIT connect(port);
+        latencies.push_back(std::chrono::duration<double,std::micro>(Clock::now() - start).count());
+        AWAIT socket->close();
+    }
+    RETURN noerror;
+}
+
+
+staticASYNC<void> runHandshakes(uint16_t port, bool resume) {
+    unsigned nClients = std::min(sOptions.connections, sOptions.handshakes);
+    vector<vector<double>> latencies(nClients);
+    vector<Future<void>> clients;
+    clients.reserve(nClients);
+
+    if (resume) {
+        // Make sure there's a session to resume:
+        auto socket = AWAIT connect(port);
+        AWAIT socket->close();
+    }
+    auto& stats = mbed::TLSSocket::sessionStats();
+    uint64_t hitsBefore = stats.serverHits;
+
+    auto start = Clock::now();
+    for (unsigned c = 0; c < nClients; ++c) {
+        unsigned n = sOptions.handshakes / nClients + (c < sOptions.handshakes % nClients);
+        clients.push_back(runHandshakeClient(port, n, resume, latencies[c]));
+    }
+    for (auto& client : clients)
+        AWAIT client;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    vector<double> all;
+    for (auto& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    cout << (resume ? "resumed\t" : "full\t")
+         << unsigned(double(all.size()) / elapsed) << '\t'
+         << percentile(all, 0.50) << '\t'
+         << percentile(all, 0.99) << '\t'
+         << (stats.serverHits - hitsBefore) << endl;
+    RETURN noerror;
+}
+
+
+// Uploads or downloads `length` bytes over a new connection.
+staticASYNC<void> runTransferClient(uint16_t port, char mode, uint64_t length) {
+    auto socket = AWAIT connect(port);
+    auto stream = socket->stream();
+    Command cmd {mode, length};
+    AWAIT stream->write(ConstBytes(&cmd.mode, 1));
+    AWAIT stream->write(ConstBytes(&cmd.length, sizeof(cmd.length)));
+    if (mode == 'U') {
+        for (uint64_t left = length; left > 0; ) {
+            size_t n = size_t(std::min<uint64_t>(left, kChunkSize));
+            AWAIT stream->write(ConstBytes(sChunk, n));
+            left -= n;
+        }
+        char reply;
+        AWAIT stream->readExactly(MutableBytes(&reply, 1));
+    } else {
+        for (uint64_t left = length; left > 0; ) {
+            ConstBytes bytes = AWAIT stream->readNoCopy(kChunkSize);
+            if (bytes.empty())
+                RETURN Error(CroutonError::UnexpectedEOF);
+            left -= bytes.size();
+        }
+    }
+    AWAIT socket->close();
+    RETURN noerror;
+}
+
+
+staticASYNC<void> runTransfer(uint16_t port, char mode) {
+    uint64_t total = uint64_t(sOptions.megabytes) << 20;
+    vector<Future<void>> clients;
+    clients.reserve(sOptions.connections);
+
+    size_t allocsBefore = HeapAllocationCount();
+    auto start = Clock::now();
+    for (unsigned c = 0; c < sOptions.connections; ++c) {
+        uint64_t n = total / sOptions.connections + (c < total % sOptions.connections);
+        clients.push_back(runTransferClient(port, mode, n));
+    }
+    for (auto& client : clients)
+        AWAIT client;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t allocs = HeapAllocationCount() - allocsBefore;
+
+    double mb = double(total) / (1 << 20);
+    cout << (mode == 'U' ? "upload\t" : "download\t")
+         << unsigned(mb / elapsed) << '\t'
+         << double(allocs) / std::max(mb, 1.0) << endl;
+    RETURN noerror;
+}
+
+
+#pragma mark - MAIN:
+
+
+static bool parseNumber(std::optional<string_view> arg, auto& value) {
+    if (!arg)
+        return false;
+    auto [ptr, ec] = std::from_chars(arg->data(), arg->data() + arg->size(), value);
+    return ec == std::errc{} && ptr == arg->data() + arg->size();
+}
+
+
+staticASYNC<int> run() {
+    // Read flags:
+    auto args = MainArgs();
+    while (auto flag = args.popFlag()) {
+        bool ok = true;
+        if (flag == "-c")
+            ok = parseNumber(args.popFirst(), sOptions.connections) && sOptions.connections > 0;
+        else if (flag == "-m")
+            ok = parseNumber(args.popFirst(), sOptions.megabytes) && sOptions.megabytes > 0;
+        else if (flag == "-h")
+            ok = parseNumber(args.popFirst(), sOptions.handshakes);
+        else if (flag == "--offload")
+            sOptions.offload = true;
+        else
+            ok = false;
+        if (!ok) {
+            cerr << "Invalid flag or value " << *flag << endl;
+            RETURN 1;
+        }
+    }
+
+    // Per-connection logging would dominate the results:
+    InitLogging();
+    for (auto logger : {Log, LCoro, LSched, LLoop, LNet})
+        logger->set_level(log::level::warn);
+
+    std::memset(sChunk, 'x', sizeof(sChunk));
+
+    static TCPServer server(0, "127.0.0.1");
+    server.useTLS({
+        .identities = {{.certChain = kTestCertPEM, .privateKey = kTestKeyPEM}},
+        .offloadHandshakes = sOptions.offload,
+    });
+    server.listen([](std::shared_ptr<ISocket> client) {
+        connectionTask(std::move(client));
+    });
+    uint16_t port = server.port();
+
+    // Make the clients trust the server's self-signed cert:
+    TrustTestCerts();
+
+#ifndef NDEBUG
+    cout << "WARNING: This is a debug build, so the results will be much too slow!\n";
+#endif
+    cout << "Using " << sOptions.connections << " connections; server handshakes "
+         << (sOptions.offload ? "offloaded" : "on the event loop") << ".\n\n";
+
+    if (sOptions.handshakes > 0) {
+        cout << "handshake\tper sec\tp50 µs\tp99 µs\tresumed\n";
+        AWAIT runHandshakes(port, false);
+        AWAIT runHandshakes(port, true);
+        cout << endl;
+    }
+
+    cout << "transfer\tMB/sec\tallocs/MB\n";
+    AWAIT runTransfer(port, 'U');
+    AWAIT runTransfer(port, 'D');
+
+    server.close();
+    RETURN 0;
+}
+
+
+CROUTON_MAIN(run)
@@ -0,0 +1,369 @@
+//
+// bench_websocket.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/Crouton.hh"
+#include "crouton/io/HTTPHandler.hh"
+#include "crouton/io/TCPServer.hh"
+#include "crouton/io/WebSocket.hh"
+#include "crouton/util/Logging.hh"
+#include "crouton/util/MiniOStream.hh"
+#include "io/WebSocketMask.hh"
+#include "AllocCounter.hh"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <vector>
+
+using namespace crouton;
+using namespace crouton::mini;
+using namespace crouton::io;
+using std::vector;
+
+/* WebSocket benchmark. Runs ServerWebSockets behind a TCPServer, and drives them over loopback
+   with ClientWebSockets running on the same event loop.
+
+   Echo: Each client sends a message, waits for the server to echo it, and repeats. Reports
+   messages/sec, round-trip latency percentiles, heap allocations per message (client and
+   server combined), and the share of the time spent masking and unmasking. This runs for each
+   message size, Binary and Text.
+
+   Fan-out: The server broadcasts PreparedMessages to many clients, waiting each time until
+   they've all received it. Reports deliveries/sec, latency until the last client has the
+   message, and allocations per delivery.
+
+   Usage: bench_websocket [-c connections] [-n messages] [-s size] [-f fanout] [--deflate]
+        -c        Number of concurrent echo clients (default 4)
+        -n        Number of messages per test (default 10000; fewer for big messages)
+        -s        Only test this message size (default 16, 1K, 64K and 1M bytes)
+        -f        Number of clients in the fan-out test (default 100; 0 skips it)
+        --deflate Use permessage-deflate compression
+
+   Build it with NDEBUG defined (a CMake Release build); in debug builds, coroutine lifecycle
+   tracking adds so much overhead that the results are meaningless.
+*/
+
+
+#pragma mark - SERVER:
+
+
+struct Options {
+    unsigned connections = 4;
+    unsigned messages    = 10000;
+    size_t   size        = 0;       // 0 means the default sizes
+    unsigned fanout      = 100;
+    bool     deflate     = false;
+};
+
+static Options sOptions;
+
+static constexpr size_t kMaxBytesPerTest = 256 << 20;   // Limits the messages sent when big
+
+static vector<ws::ServerWebSocket*> sFanoutSockets;     // Server sockets of fan-out clients
+
+
+// Echoes every message, including the client's Close.
+staticASYNC<void> serveEcho(http::Handler::Request const& req, http::Handler::Response& res) {
+    ws::ServerWebSocket socket;
+    socket.setCompressionOptions({.enabled = sOptions.deflate});
+    if (! AWAIT socket.connect(req, res))
+        RETURN noerror;
+    Generator<ws::Message> rcvr = socket.receive();
+    Result<ws::Message> msg;
+    while ((msg = AWAIT rcvr))
+        AWAIT socket.send(std::move(*msg));
+    AWAIT socket.close();
+    RETURN noerror;
+}
+
+
+// Registers the socket in sFanoutSockets so `runFanout` can broadcast to it.
+staticASYNC<void> serveFanout(http::Handler::Request const& req, http::Handler::Response& res) {
+    ws::ServerWebSocket socket;
+    socket.setCompressionOptions({.enabled = sOptions.deflate, .noContextTakeover = true});
+    if (! AWAIT socket.connect(req, res))
+        RETURN noerror;
+    sFanoutSockets.push_back(&socket);
+    Generator<ws::Message> rcvr = socket.receive();
+    Result<ws::Message> msg;
+    while ((msg = AWAIT rcvr))
+        AWAIT socket.send(std::move(*msg));
+    std::erase(sFanoutSockets, &socket);
+    AWAIT socket.close();
+    RETURN noerror;
+}
+
+
+static http::Router sRoutes = {
+    {http::Method::GET, "/echo",   serveEcho},
+    {http::Method::GET, "/fanout", serveFanout},
+};
+
+
+static Task connectionTask(std::shared_ptr<ISocket> client) {
+    http::Handler handler(client->stream(), sRoutes);
+    AWAIT handler.run();
+}
+
+
+#pragma mark - CLIENTS:
+
+
+using Clock = std::chrono::steady_clock;
+
+
+static double percentile(vector<double> const& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(size_t(p * double(sorted.size())), sorted.size() - 1);
+    return sorted[i];
+}
+
+
+static string url(uint16_t port, const char* path) {
+    return "ws://127.0.0.1:" + std::to_string(port) + path;
+}
+
+
+staticASYNC<void> closeClient(ws::ClientWebSocket& client, Generator<ws::Message>& rcvr) {
+    AWAIT client.send(ws::Message(ws::CloseCode::Normal, "done"));
+    while (Result<ws::Message> msg = AWAIT rcvr) {
+        if (msg->type == ws::Message::Close)
+            break;
+    }
+    AWAIT client.close();
+    RETURN noerror;
+}
+
+
+// Sends `n` messages one at a time, recording each one's round-trip time in microseconds.
+staticASYNC<void> runEchoClient(uint16_t port, ws::Message::Type type, size_t size, unsigned n,
+                                vector<double>& latencies)
+{
+    ws::ClientWebSocket client(url(port, "/echo"));
+    client.setCompressionOptions({.enabled = sOptions.deflate});
+    AWAIT client.connect();
+    Generator<ws::Message> rcvr = client.receive();
+
+    string payload(size, 'x');
+    for (unsigned i = 0; i < n; ++i) {
+        auto start = Clock::now();
+        AWAIT client.send(ConstBytes(payload), type);
+        Result<ws::Message> reply = AWAIT rcvr;
+        if (!reply || reply->type != type || reply->size() != size)
+            Error::raise(CroutonError::InvalidState, "Unexpected echo from server");
+        ws::WebSocket::recycle(std::move(*reply));
+        latencies.push_back(std::chrono::duration<double,std::micro>(Clock::now() - start).count());
+    }
+    AWAIT closeClient(client, rcvr);
+    RETURN noerror;
+}
+
+
+// Returns the time in seconds to mask `size` bytes, as each end of a client frame does.
+static double maskingTime(size_t size) {
+    vector<std::byte> src(size), dst(size);
+    const std::byte mask[4] = {std::byte(1), std::byte(2), std::byte(3), std::byte(4)};
+    size_t calls = 0, batch = 1;
+    auto start = Clock::now();
+    double elapsed;
+    do {
+        for (size_t i = 0; i < batch; ++i)
+            ws::applyMask(dst.data(), src.data(), size, mask);
+        calls += batch;
+        batch *= 2;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < 0.05);
+    return elapsed / double(calls);
+}
+
+
+staticASYNC<void> runEcho(uint16_t port, ws::Message::Type type, size_t size) {
+    unsigned messages = unsigned(std::min(size_t(sOptions.messages),
+                                          std::max(kMaxBytesPerTest / size, size_t(100))));
+    unsigned connections = std::min(sOptions.connections, messages);
+
+    vector<vector<double>> latencies(connections);
+    vector<Future<void>> clients;
+    clients.reserve(connections);
+
+    size_t allocsBefore = HeapAllocationCount();
+    auto start = Clock::now();
+    for (unsigned c = 0; c < connections; ++c) {
+        unsigned n = messages / connections + (c < messages % connections);
+        latencies[c].reserve(n);
+        clients.push_back(runEchoClient(port, type, size, n, latencies[c]));
+    }
+    for (auto& client : clients)
+        AWAIT client;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t allocs = HeapAllocationCount() - allocsBefore;
+
+    vector<double> all;
+    for (auto& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    double n = double(std::max(all.size(), size_t(1)));
+    // Each round trip masks the payload once, and unmasks it once, on one thread:
+    double masking = 2 * maskingTime(size) * n / elapsed;
+
+    cout << (type == ws::Message::Text ? "Text  " : "Binary") << '\t'
+         << size << '\t'
+         << unsigned(n / elapsed) << '\t'
+         << percentile(all, 0.50) << '\t'
+         << percentile(all, 0.99) << '\t'
+         << percentile(all, 0.999) << '\t'
+         << double(allocs) / n << '\t'
+         << 100 * masking << "%\n";
+    RETURN noerror;
+}
+
+
+// Broadcasts messages to `sOptions.fanout` clients, one at a time.
+staticASYNC<void> runFanout(uint16_t port, size_t size) {
+    unsigned nClients = sOptions.fanout;
+    unsigned messages = unsigned(std::min(size_t(sOptions.messages) / 10,
+                                          std::max(kMaxBytesPerTest / size / nClients, size_t(10))));
+    messages = std::max(messages, 1u);
+
+    vector<std::unique_ptr<ws::ClientWebSocket>> clients;
+    vector<Generator<ws::Message>> receivers;
+    for (unsigned i = 0; i < nClients; ++i) {
+        auto client = std::make_unique<ws::ClientWebSocket>(url(port, "/fanout"));
+        client->setCompressionOptions({.enabled = sOptions.deflate});
+        AWAIT client->connect();
+        receivers.push_back(client->receive());
+        clients.push_back(std::move(client));
+    }
+    while (sFanoutSockets.size() < nClients)
+        AWAIT Timer::sleep(0.001);
+
+    string payload(size, 'x');
+    vector<double> latencies;
+    latencies.reserve(messages);
+    size_t skipped = 0;
+
+    size_t allocsBefore = HeapAllocationCount();
+    auto start = Clock::now();
+    for (unsigned m = 0; m < messages; ++m) {
+        auto sent = Clock::now();
+        auto msg = std::make_shared<ws::PreparedMessage>(ConstBytes(payload), ws::Message::Binary,
+                                                         ws::CompressionOptions{.enabled = sOptions.deflate});
+        skipped += nClients - ws::ServerWebSocket::broadcast(msg, sFanoutSockets);
+        for (auto& rcvr : receivers) {
+            Result<ws::Message> received = AWAIT rcvr;
+            if (!received || received->size() != size)
+                Error::raise(CroutonError::InvalidState, "Unexpected broadcast message");
+            ws::WebSocket::recycle(std::move(*received));
+        }
+        latencies.push_back(std::chrono::duration<double,std::micro>(Clock::now() - sent).count());
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t allocs = HeapAllocationCount() - allocsBefore;
+
+    for (size_t i = 0; i < clients.size(); ++i)
+        AWAIT closeClient(*clients[i], receivers[i]);
+
+    std::sort(latencies.begin(), latencies.end());
+    double deliveries = double(messages) * nClients;
+    cout << size << '\t'
+         << nClients << '\t'
+         << unsigned(deliveries / elapsed) << '\t'
+         << percentile(latencies, 0.50) << '\t'
+         << percentile(latencies, 0.99) << '\t'
+         << double(allocs) / deliveries << '\t'
+         << skipped << '\n';
+    RETURN noerror;
+}
+
+
+#pragma mark - MAIN:
+
+
+static bool parseNumber(std::optional<string_view> arg, auto& value) {
+    if (!arg)
+        return false;
+    auto [ptr, ec] = std::from_chars(arg->data(), arg->data() + arg->size(), value);
+    return ec == std::errc{} && ptr == arg->data() + arg->size();
+}
+
+
+staticASYNC<int> run() {
+    // Read flags:
+    auto args = MainArgs();
+    while (auto flag = args.popFlag()) {
+        bool ok = true;
+        if (flag == "-c")
+            ok = parseNumber(args.popFirst(), sOptions.connections) && sOptions.connections > 0;
+        else if (flag == "-n")
+            ok = parseNumber(args.popFirst(), sOptions.messages) && sOptions.messages > 0;
+        else if (flag == "-s")
+            ok = parseNumber(args.popFirst(), sOptions.size) && sOptions.size > 0;
+        else if (flag == "-f")
+            ok = parseNumber(args.popFirst(), sOptions.fanout);
+        else if (flag == "--deflate")
+            sOptions.deflate = true;
+        else
+            ok = false;
+        if (!ok) {
+            cerr << "Invalid flag or value " << *flag << endl;
+            RETURN 1;
+        }
+    }
+
+    // Per-message logging would dominate the results:
+    InitLogging();
+    for (auto logger : {Log, LCoro, LSched, LLoop, LNet})
+        logger->set_level(log::level::warn);
+
+    static TCPServer server(0, "127.0.0.1");
+    server.listen([](std::shared_ptr<ISocket> client) {
+        connectionTask(std::move(client));
+    });
+    uint16_t port = server.port();
+
+#ifndef NDEBUG
+    cout << "WARNING: This is a debug build, so the results will be much too slow!\n";
+#endif
+    vector<size_t> sizes {16, 1024, 64 * 1024, 1024 * 1024};
+    if (sOptions.size)
+        sizes = {sOptions.size};
+
+    cout << "Echo, " << sOptions.connections << " connections"
+         << (sOptions.deflate ? ", compressed" : "") << ":\n"
+         << "Type\tBytes\tMsg/sec\tp50 µs\tp99 µs\tp99.9 µs\tAllocs/msg\tMasking\n";
+    for (size_t size : sizes) {
+        for (auto type : {ws::Message::Binary, ws::Message::Text})
+            AWAIT runEcho(port, type, size);
+    }
+
+    if (sOptions.fanout > 0) {
+        cout << "\nFan-out (broadcast of PreparedMessages):\n"
+             << "Bytes\tClients\tDeliveries/sec\tp50 µs\tp99 µs\tAllocs/delivery\tSkipped\n";
+        for (size_t size : sizes) {
+            if (size <= 64 * 1024 || sOptions.size)
+                AWAIT runFanout(port, size);
+        }
+    }
+
+    server.close();
+    RETURN 0;
+}
+
+
+CROUTON_MAIN(run)
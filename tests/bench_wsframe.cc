@@ -0,0 +1,128 @@
+//
+// bench_wsframe.cc
+//
+// Copyright 2023-Present Couchbase, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "crouton/Misc.hh"
+#include "crouton/util/MiniOStream.hh"
+#include "io/WebSocketMask.hh"
+#include "io/WebSocketProtocol.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace crouton;
+using namespace crouton::mini;
+using namespace crouton::io::ws;
+using std::vector;
+
+/* Micro-benchmarks of the WebSocket framing code, with no I/O involved.
+
+   Masking: Times each `applyMask` kernel that this CPU supports, for a range of message sizes,
+   both copying (as a client does when framing a message) and in place (as a server does when
+   receiving one), and reports the throughput in GB/s.
+
+   Mask keys: Compares generating a client frame's 4-byte mask key with `Randomize` (a system
+   call each time, as client framing used to) and with `FastRandomize`; then the same for
+   framing whole small client messages, in frames per second.
+
+   Usage: bench_wsframe
+
+   Build it with NDEBUG defined (a CMake Release build) for meaningful results.
+*/
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr double kSecondsPerTest = 0.2;
+
+
+// Calls `fn` repeatedly for about kSecondsPerTest, and returns the number of calls per second.
+template <typename Fn>
+static double callsPerSecond(Fn fn) {
+    size_t calls = 0, batch = 1;
+    auto start = Clock::now();
+    double elapsed;
+    do {
+        for (size_t i = 0; i < batch; ++i)
+            fn();
+        calls += batch;
+        batch *= 2;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < kSecondsPerTest);
+    return double(calls) / elapsed;
+}
+
+
+static void benchMasking() {
+    static constexpr size_t kSizes[] = {16, 125, 1024, 16 * 1024, 256 * 1024, 1024 * 1024};
+    constexpr size_t kMaxSize = 1024 * 1024;
+
+    vector<std::byte> src(kMaxSize + 1), dst(kMaxSize + 1);
+    for (size_t i = 0; i < src.size(); ++i)
+        src[i] = std::byte(i * 7);
+    uint32_t mask = 0x9E3779B9;
+
+    cout << "Masking throughput (GB/s), copying / in place:\n";
+    for (auto& kernel : availableMaskKernels()) {
+        cout << "  " << kernel.name << ":\n";
+        for (size_t size : kSizes) {
+            // Offset the source by a byte, since incoming frame payloads are rarely aligned:
+            double copying = callsPerSecond([&] {
+                kernel.apply(dst.data(), src.data() + 1, size, mask);
+            }) * double(size) / 1e9;
+            double inPlace = callsPerSecond([&] {
+                kernel.apply(dst.data() + 1, dst.data() + 1, size, mask);
+            }) * double(size) / 1e9;
+            cout << "    " << size << " bytes:\t" << copying << "\t/ " << inPlace << '\n';
+        }
+    }
+}
+
+
+static void benchMaskKeys() {
+    std::byte key[4];
+    double syscall = callsPerSecond([&] {Randomize(key, sizeof(key));});
+    double fast = callsPerSecond([&] {FastRandomize(key, sizeof(key));});
+    cout << "\nMask keys per second:\n"
+         << "  Randomize:     " << uint64_t(syscall) << '\n'
+         << "  FastRandomize: " << uint64_t(fast) << '\n';
+
+    // Frame a typical small client message, as `ClientWebSocket::send` does:
+    static constexpr size_t kSize = 100;
+    std::byte payload[kSize] = {}, frame[kSize + 14];
+    auto formatFrame = [&] {
+        return uWS::WebSocketProtocol<false>::formatMessage(frame, (const char*)payload, kSize,
+                                                           uWS::BINARY, kSize, false);
+    };
+    // (Calling Randomize as well as formatMessage reproduces the old cost of framing.)
+    double before = callsPerSecond([&] {Randomize(key, sizeof(key)); formatFrame();});
+    double after = callsPerSecond([&] {formatFrame();});
+    cout << "Client frames per second, " << kSize << "-byte payload:\n"
+         << "  with Randomize:     " << uint64_t(before) << '\n'
+         << "  with FastRandomize: " << uint64_t(after) << '\n';
+}
+
+
+int main(int argc, const char* argv[]) {
+#ifndef NDEBUG
+    cout << "WARNING: This is a debug build, so the results will be much too slow!\n";
+#endif
+    benchMasking();
+    benchMaskKeys();
+    cout.flush();
+    return 0;
+}
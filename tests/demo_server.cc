@@ -40,7 +40,8 @@ static constexpr uint16_t kPort = 34567;
 
 
 staticASYNC<void> serveRoot(http::Handler::Request const& req, http::Handler::Response& res) {
-    res.writeHeader("Content-Type", "text/plain");
+    static const http::HeaderBlock kHeaders {{"Content-Type", "text/plain"}};
+    res.writeHeaders(kHeaders);
     AWAIT res.writeToBody("Hi!\r\n");
     RETURN noerror;
 }
@@ -74,9 +75,10 @@ staticASYNC<void> serveWebSocket(http::Handler::Request const& req, http::Handle
 }
 
 
-static std::vector<http::Handler::Route> sRoutes = {
-    {http::Method::GET, regex("/"),     serveRoot},
-    {http::Method::GET, regex("/ws/?"), serveWebSocket},
+static http::Router sRoutes = {
+    {http::Method::GET, "/",    serveRoot},
+    {http::Method::GET, "/ws",  serveWebSocket},
+    {http::Method::GET, "/ws/", serveWebSocket},
 };
 
 
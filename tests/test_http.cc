@@ -17,7 +17,19 @@
 //
 
 #include "tests.hh"
+#include "AllocCounter.hh"
+#include "crouton/io/HTTPCompression.hh"
+#include "crouton/io/HTTPConnection.hh"
+#include "crouton/io/HTTPFileHandler.hh"
+#include "crouton/io/FileStream.hh"
+#include "crouton/io/Filesystem.hh"
+#include "crouton/io/HTTPHandler.hh"
 #include "crouton/io/HTTPParser.hh"
+#include "crouton/io/TCPServer.hh"
+#include "crouton/io/WebSocket.hh"
+#include <fstream>
+#include <functional>
+#include <thread>
 
 using namespace crouton::io::http;
 
@@ -39,6 +51,18 @@ TEST_CASE("HTTP Request Parser", "[http]") {
 }
 
 
+TEST_CASE("HTTP Request Parser Pipelined", "[http]") {
+    string_view reqs = "GET /one HTTP/1.1\r\n\r\n"
+                       "GET /two HTTP/1.1\r\nFoo: Bar\r\n\r\n";
+    Parser parser(Parser::Request);
+    CHECK(parser.parseData(reqs));
+    CHECK(parser.complete());
+    CHECK(parser.requestURI.value().path == "/one");
+    CHECK(parser.headers.empty());
+    CHECK(parser.hasPipelinedData());
+}
+
+
 TEST_CASE("HTTP Request Parser With Body", "[http]") {
     string_view req = "POST /foo/bar?x=y HTTP/1.1\r\n"
     "Content-Length: 20\r\n"
@@ -109,6 +133,1380 @@ TEST_CASE("WebSocket Response Parser", "[http]") {
 }
 
 
+TEST_CASE("HTTP Headers", "[http]") {
+    Headers headers;
+    headers.set("content-TYPE", "text/plain");
+    headers.add("X-Foo", "1");
+    headers.add("x-foo", "2");
+    CHECK(headers.size() == 2);
+    CHECK(headers.get("Content-Type") == "text/plain");
+    CHECK(headers["CONTENT-type"] == "text/plain");
+    CHECK(headers["X-Foo"] == "1, 2");
+    CHECK(headers["Missing"] == "");
+    CHECK(headers.begin()->first == "Content-Type");
+
+    headers.set("Content-Type", "text/html");
+    CHECK(headers["Content-Type"] == "text/html");
+    CHECK(headers.remove("content-type"));
+    CHECK(!headers.remove("content-type"));
+    CHECK(headers.size() == 1);
+
+    // Grow past the inline capacity:
+    for (int i = 0; i < 40; ++i)
+        headers.set("H" + std::to_string(i), std::to_string(i));
+    CHECK(headers.size() == 41);
+    CHECK(headers["h39"] == "39");
+
+    Headers copied = headers;
+    Headers moved = std::move(headers);
+    CHECK(headers.empty());
+    CHECK(copied.size() == 41);
+    CHECK(moved.size() == 41);
+    CHECK(copied["X-Foo"] == "1, 2");
+    CHECK(moved["H20"] == "20");
+
+    Headers small;
+    small.set("A", "b");
+    Headers movedSmall = std::move(small);
+    CHECK(movedSmall["a"] == "b");
+}
+
+
+TEST_CASE("HTTP Parser Split Headers", "[http]") {
+    // Header names and values split across reads must be reassembled:
+    string_view req = "GET / HTTP/1.1\r\n"
+    "Content-Type: text/plain\r\n"
+    "x-custom-header: some value here\r\n\r\n";
+    for (size_t split = 1; split < req.size(); ++split) {
+        Parser parser(Parser::Request);
+        CHECK(!parser.parseData(req.substr(0, split)));
+        CHECK(parser.parseData(req.substr(split)));
+        CHECK(parser.complete());
+        CHECK(parser.headers.size() == 2);
+        CHECK(parser.headers["content-type"] == "text/plain");
+        CHECK(parser.headers["X-Custom-Header"] == "some value here");
+    }
+}
+
+
+TEST_CASE("HTTP Parser Steady State", "[http]") {
+    // Once warmed up, parsing a request and resetting should not touch the heap:
+    string_view req = "GET /foo/bar?x=y HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Crouton\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Foo: Bar\r\n"
+    "Foo: Zab\r\n\r\n";
+
+    Parser parser(Parser::Request);
+    parser.parseData(req);
+    parser.reset();
+
+    bool ok = true;
+    size_t allocsBefore = HeapAllocationCount();
+    for (int i = 0; i < 100; ++i) {
+        size_t split = i % req.size();
+        parser.parseData(req.substr(0, split));
+        ok = ok && parser.parseData(req.substr(split))
+                && parser.complete()
+                && parser.requestURI->path == "/foo/bar"
+                && parser.headers.size() == 5
+                && parser.headers["foo"] == "Bar, Zab";
+        parser.reset();
+    }
+    size_t allocs = HeapAllocationCount() - allocsBefore;
+    CHECK(ok);
+    CHECK(allocs == 0);
+}
+
+
+TEST_CASE("HTTP HeaderBlock", "[http]") {
+    HeaderBlock block {{"content-type", "text/plain"}, {"Cache-Control", "max-age=60"}};
+    CHECK(block.data() == "Content-Type: text/plain\r\nCache-Control: max-age=60\r\n");
+
+    Headers headers;
+    headers.set("X-Foo", "bar");
+    CHECK(HeaderBlock(headers).data() == "X-Foo: bar\r\n");
+}
+
+
+TEST_CASE("HTTP Router", "[http]") {
+    Handler::HandlerFunction fn = [](Handler::Request const&, Handler::Response&) {
+        return Future<void>();
+    };
+    Router router {
+        {Method::GET,    "/",                         fn},
+        {Method::GET,    "/users",                    fn},
+        {Method::GET,    "/users/new",                fn},
+        {Method::GET,    "/users/:id<int>",           fn},
+        {Method::DELETE, "/users/:id<int>",           fn},
+        {Method::GET,    "/users/:name/posts/:post",  fn},
+        {Method::GET,    "/files/*path",              fn},
+        {Method::GET,    std::regex("/old/.*\\.html"), fn},
+    };
+
+    auto check = [&](Method method, string_view path, Status status, int routeIndex = -1) {
+        INFO("Path is " << path);
+        Router::Match m = router.match(method, path);
+        CHECK(m.status == status);
+        if (routeIndex >= 0)
+            CHECK(m.route != nullptr);
+        return m;
+    };
+
+    check(Method::GET, "/", Status::OK);
+    check(Method::GET, "/users", Status::OK);
+    check(Method::GET, "/users/", Status::NotFound);
+    check(Method::GET, "/users/new", Status::OK);
+    check(Method::POST, "/users/new", Status::MethodNotAllowed);
+
+    auto m = check(Method::GET, "/users/1234", Status::OK, 3);
+    CHECK(m.params.size() == 1);
+    CHECK(m.params.get("id") == "1234");
+    CHECK(m.params.getInt("id") == 1234);
+    CHECK(m.route->method == Method::GET);
+
+    m = check(Method::DELETE, "/users/1234", Status::OK, 4);
+    CHECK(m.route->method == Method::DELETE);
+    CHECK(m.params.getInt("id") == 1234);
+
+    m = check(Method::GET, "/users/snej/posts/hello", Status::OK, 5);
+    CHECK(m.params.size() == 2);
+    CHECK(m.params["name"] == "snej");
+    CHECK(m.params["post"] == "hello");
+    CHECK(m.params["id"] == "");
+    CHECK(m.params.getInt("name") == std::nullopt);
+
+    m = check(Method::GET, "/users/1234/posts/5", Status::OK, 5);   // backtracks from <int>
+    CHECK(m.params["name"] == "1234");
+
+    check(Method::GET, "/users/snej", Status::NotFound);
+    check(Method::DELETE, "/users/snej", Status::NotFound);
+
+    m = check(Method::GET, "/files/a/b/c.txt", Status::OK, 6);
+    CHECK(m.params["path"] == "a/b/c.txt");
+
+    m = check(Method::GET, "/old/some/page.html", Status::OK, 7);
+    CHECK(m.params.empty());
+    check(Method::PUT, "/old/some/page.html", Status::MethodNotAllowed);
+    check(Method::GET, "/old/some/page.txt", Status::NotFound);
+    check(Method::GET, "/nope", Status::NotFound);
+
+    // The parser can produce methods routes can't have, like PATCH (llhttp_method 28):
+    check(Method{28}, "/users/1234", Status::NotImplemented);
+    check(Method{28}, "/old/some/page.html", Status::NotImplemented);
+}
+
+
+TEST_CASE("HTTP Router Errors", "[http]") {
+    InitLogging();
+    Handler::HandlerFunction fn = [](Handler::Request const&, Handler::Response&) {
+        return Future<void>();
+    };
+    auto makeRouter = [&](std::vector<Handler::Route> routes) {Router router(std::move(routes));};
+    CHECK_THROWS(makeRouter({{Method::GET, "nope", fn}}));
+    CHECK_THROWS(makeRouter({{Method::GET, "/x:id", fn}}));
+    CHECK_THROWS(makeRouter({{Method::GET, "/:id.json", fn}}));
+    CHECK_THROWS(makeRouter({{Method::GET, "/:/x", fn}}));
+    CHECK_THROWS(makeRouter({{Method::GET, "/*rest/x", fn}}));
+    CHECK_THROWS(makeRouter({{Method::GET, "/a", fn}, {Method::GET, "/a", fn}}));
+    CHECK_NOTHROW(makeRouter({{Method::GET, "/a", fn}, {Method::PUT, "/a", fn}}));
+    CHECK_THROWS(makeRouter({{Method{28}, "/a", fn}}));
+}
+
+
+// An HTTP server on a local port, which handles each connection with a Handler and a Router.
+// `configure`, if given, is called on each Handler before it runs.
+struct TestHTTPServer {
+    using Configure = std::function<void(Handler&)>;
+
+    explicit TestHTTPServer(Router const& router, Configure configure = nullptr)
+    :tcpServer(0, "127.0.0.1")
+    ,_router(router)
+    ,_configure(std::move(configure))
+    {
+        tcpServer.listen([this](std::shared_ptr<io::ISocket> client) {
+            connections.push_back(handle(std::move(client)));
+        });
+    }
+
+    uint16_t port()                 {return tcpServer.port();}
+    string url(string_view path)    {return "http://127.0.0.1:" + std::to_string(port()) + string(path);}
+    string wsURL(string_view path)  {return "ws://127.0.0.1:" + std::to_string(port()) + string(path);}
+
+    // Stops listening, and waits for the accepted connections to end. Unless `allowErrors` is
+    // set, checks that none of their Handlers failed.
+    Future<void> close() {
+        tcpServer.close();
+        for (auto& connection : connections) {
+            Result<void> result = AWAIT NoThrow(std::move(connection));
+            if (!allowErrors)
+                CHECK(result.ok());
+        }
+        RETURN noerror;
+    }
+
+    Future<void> handle(std::shared_ptr<io::ISocket> client) {
+        Handler handler(client->stream(), _router);
+        if (_configure)
+            _configure(handler);
+        AWAIT handler.run();
+        RETURN noerror;
+    }
+
+    io::TCPServer               tcpServer;
+    std::vector<Future<void>>   connections;
+    bool                        allowErrors = false;
+
+private:
+    Router const&   _router;
+    Configure       _configure;
+};
+
+
+TEST_CASE("HTTP Handler Keep-Alive", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        Router router {
+            {Method::GET, "/", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Length", "3");
+                AWAIT res.writeToBody("Hi\n");
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        auto socket = io::ISocket::newSocket(false);
+        AWAIT socket->connect("127.0.0.1", server.port());
+        auto stream = socket->stream();
+        Parser parser(*stream, Parser::Response);
+
+        // Two requests on the same connection; the second asks to close it:
+        static constexpr string_view kRequests[2] = {
+            "GET / HTTP/1.1\r\n\r\n",
+            "GET / HTTP/1.1\r\nConnection: close\r\n\r\n",
+        };
+        for (int i = 0; i < 2; ++i) {
+            AWAIT stream->write(ConstBytes(kRequests[i]));
+            AWAIT parser.readHeaders();
+            CHECK(parser.status == Status::OK);
+            CHECK(parser.headers["Content-Length"] == "3");
+            CHECK(parser.headers.contains("Date"));
+            CHECK(parser.keepAlive() == (i == 0));
+            string body = AWAIT parser.entireBody();
+            CHECK(body == "Hi\n");
+            parser.reset();
+        }
+        ConstBytes eof = AWAIT stream->readNoCopy();
+        CHECK(eof.empty());
+        AWAIT socket->close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("HTTP Handler Pipelining", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        Router router {
+            {Method::GET, "/:name", [](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                string body = "Hi " + string(req.params["name"]);
+                res.writeHeader("Content-Length", std::to_string(body.size()));
+                AWAIT res.writeToBody(std::move(body));
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        auto socket = io::ISocket::newSocket(false);
+        AWAIT socket->connect("127.0.0.1", server.port());
+        auto stream = socket->stream();
+        Parser parser(*stream, Parser::Response);
+
+        // Three requests in one write; each must get its own response, in order:
+        AWAIT stream->write(string("GET /a HTTP/1.1\r\n\r\n"
+                                   "GET /b HTTP/1.1\r\n\r\n"
+                                   "GET /c HTTP/1.1\r\nConnection: close\r\n\r\n"));
+        for (string_view name : {"a", "b", "c"}) {
+            INFO("Response " << name);
+            AWAIT parser.readHeaders();
+            CHECK(parser.status == Status::OK);
+            string body = AWAIT parser.entireBody();
+            CHECK(body == "Hi " + string(name));
+            parser.reset();
+        }
+        ConstBytes eof = AWAIT stream->readNoCopy();
+        CHECK(eof.empty());
+        AWAIT socket->close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("HTTP Handler Unknown Method", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        Router router {
+            {Method::GET, "/", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Length", "0");
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        auto socket = io::ISocket::newSocket(false);
+        AWAIT socket->connect("127.0.0.1", server.port());
+        auto stream = socket->stream();
+        Parser parser(*stream, Parser::Response);
+
+        // PATCH's llhttp value is beyond the methods routes can have:
+        AWAIT stream->write(string("PATCH / HTTP/1.1\r\nConnection: close\r\n\r\n"));
+        AWAIT parser.readHeaders();
+        CHECK(parser.status == Status::NotImplemented);
+        AWAIT socket->close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("HTTP Handler Skips Unrouted Body", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        Router router {
+            {Method::GET, "/", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Length", "0");
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        auto socket = io::ISocket::newSocket(false);
+        AWAIT socket->connect("127.0.0.1", server.port());
+        auto stream = socket->stream();
+        Parser parser(*stream, Parser::Response);
+
+        // A kept-alive POST to a missing route, whose body looks like another request:
+        string smuggled = "GET / HTTP/1.1\r\n\r\n";
+        AWAIT stream->write("POST /nope HTTP/1.1\r\nContent-Length: "
+                            + std::to_string(smuggled.size()) + "\r\n\r\n" + smuggled);
+        AWAIT parser.readHeaders();
+        CHECK(parser.status == Status::NotFound);
+        CHECK(parser.keepAlive());
+        (void) AWAIT parser.entireBody();
+        parser.reset();
+
+        // The next response must be to this request, not to the body of the last one:
+        AWAIT stream->write(string("GET / HTTP/1.1\r\nConnection: close\r\n\r\n"));
+        AWAIT parser.readHeaders();
+        CHECK(parser.status == Status::OK);
+        CHECK(!parser.keepAlive());
+        (void) AWAIT parser.entireBody();
+        ConstBytes eof = AWAIT stream->readNoCopy();
+        CHECK(eof.empty());
+        AWAIT socket->close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+#if CROUTON_USE_ZLIB
+TEST_CASE("HTTP Content-Encoding", "[http]") {
+    CHECK(negotiateEncoding("") == ContentEncoding::Identity);
+    CHECK(negotiateEncoding("identity") == ContentEncoding::Identity);
+    CHECK(negotiateEncoding("gzip, deflate, br") == ContentEncoding::Gzip);
+    CHECK(negotiateEncoding("deflate") == ContentEncoding::Deflate);
+    CHECK(negotiateEncoding("gzip;q=0.5, deflate") == ContentEncoding::Deflate);
+    CHECK(negotiateEncoding("GZIP ; q=1.0, deflate;q=0.9") == ContentEncoding::Gzip);
+    CHECK(negotiateEncoding("*") == ContentEncoding::Gzip);
+    CHECK(negotiateEncoding("*, gzip;q=0") == ContentEncoding::Deflate);
+    CHECK(negotiateEncoding("gzip;q=0, deflate;q=0.000") == ContentEncoding::Identity);
+
+    CHECK(parseContentEncoding("") == ContentEncoding::Identity);
+    CHECK(parseContentEncoding("gzip") == ContentEncoding::Gzip);
+    CHECK(parseContentEncoding(" Deflate") == ContentEncoding::Deflate);
+    CHECK(parseContentEncoding("br") == std::nullopt);
+
+    CHECK(isCompressibleType("text/html; charset=utf-8"));
+    CHECK(isCompressibleType("application/json"));
+    CHECK(isCompressibleType("application/vnd.api+json"));
+    CHECK(isCompressibleType("image/svg+xml"));
+    CHECK(!isCompressibleType("image/png"));
+    CHECK(!isCompressibleType("application/octet-stream"));
+    CHECK(!isCompressibleType(""));
+
+    string original;
+    for (int i = 0; i < 1000; ++i)
+        original += "{\"id\": " + std::to_string(i) + ", \"name\": \"item\"},\n";
+    for (auto encoding : {ContentEncoding::Gzip, ContentEncoding::Deflate}) {
+        // Do it twice, to exercise the reuse of cached zlib streams:
+        for (int pass = 0; pass < 2; ++pass) {
+            string compressed;
+            {
+                Deflater::Ref deflater = Deflater::get(encoding, 6);
+                deflater->write(ConstBytes(original.substr(0, 10000)), compressed);
+                deflater->write(ConstBytes(original.substr(10000)), compressed, true);
+                deflater->finish(compressed);
+            }
+            CHECK(compressed.size() < original.size() / 4);
+            if (encoding == ContentEncoding::Gzip)
+                CHECK(compressed.starts_with("\x1f\x8b"));
+
+            // Decompress it into a small buffer, to exercise partial output:
+            Inflater::Ref inflater = Inflater::get();
+            CHECK(!inflater->started());
+            string decompressed;
+            ConstBytes input(compressed);
+            char buf[1000];
+            while (!inflater->finished()) {
+                size_t n = inflater->write(input, MutableBytes(buf, sizeof(buf)));
+                decompressed.append(buf, n);
+            }
+            CHECK(input.empty());
+            CHECK(decompressed == original);
+        }
+    }
+}
+
+
+TEST_CASE("HTTP Handler Compression", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        static string sJSON;
+        for (int i = 0; i < 500; ++i)
+            sJSON += "{\"id\": " + std::to_string(i) + "},\n";
+        static const HeaderBlock kJSONType {{"Content-Type", "application/json"}};
+        Router router {
+            // A body with a Content-Length is compressed as a whole:
+            {Method::GET, "/sized", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeaders(kJSONType);
+                res.writeHeader("Content-Length", std::to_string(sJSON.size()));
+                AWAIT res.writeToBody(sJSON.substr(0, 1000));
+                AWAIT res.writeToBody(sJSON.substr(1000));
+                RETURN noerror;
+            }},
+            // A body without one is streamed:
+            {Method::GET, "/streamed", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Type", "text/plain");
+                AWAIT res.writeToBody(sJSON.substr(0, 2000));
+                AWAIT res.writeToBody(sJSON.substr(2000));
+                RETURN noerror;
+            }},
+            // A small body isn't compressed:
+            {Method::GET, "/small", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Type", "text/plain");
+                res.writeHeader("Content-Length", "3");
+                AWAIT res.writeToBody("Hi\n");
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+        string base = server.url("");
+
+        struct Case {string_view path; string_view acceptEncoding; string_view encoding;};
+        static constexpr Case kCases[] = {
+            {"/sized",    "",         "gzip"},      // Connection sends "gzip, deflate" by default
+            {"/sized",    "deflate",  "deflate"},
+            {"/sized",    "identity", ""},
+            {"/streamed", "",         "gzip"},
+            {"/small",    "",         ""},
+        };
+        for (auto& c : kCases) {
+            INFO("GET " << c.path << " with Accept-Encoding " << c.acceptEncoding);
+            Connection connection(base + string(c.path));
+            Request req;
+            if (!c.acceptEncoding.empty())
+                req.headers.set("Accept-Encoding", c.acceptEncoding);
+            Response response = AWAIT connection.send(req);
+            CHECK(response.status() == Status::OK);
+            CHECK(response.headers()["Content-Encoding"] == c.encoding);
+            string body = AWAIT response.readAll();
+            if (c.path == "/small")
+                CHECK(body == "Hi\n");
+            else
+                CHECK(body == sJSON);
+            if (!c.encoding.empty() && c.path == "/sized")
+                CHECK(response.headers()["Content-Length"] != std::to_string(sJSON.size()));
+        }
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+#endif // CROUTON_USE_ZLIB
+
+
+TEST_CASE("HTTP File Handler", "[uv][http]") {
+    InitLogging();
+    string dir = io::fs::mkdtemp("/tmp/crouton_files_XXXXXX");
+    string contents;
+    for (int i = 0; contents.size() < 200000; ++i)
+        contents += "Line " + std::to_string(i) + "\n";
+    std::ofstream(dir + "/big.txt") << contents;
+    io::fs::mkdir((dir + "/sub").c_str(), 0755);
+    std::ofstream(dir + "/sub/index.html") << "<p>Hi</p>";
+
+    auto test = [&]() -> Future<void> {
+        FileHandler files(dir);
+        Router router {
+            {Method::GET,  "/files/*path", files},
+            {Method::HEAD, "/files/*path", files},
+        };
+        TestHTTPServer server(router);
+        string base = server.url("");
+
+        // Returns a new Connection and a GET request with an optional header:
+        auto get = [&](string uri, string_view header = {}, string_view value = {}) {
+            Request req {.uri = std::move(uri)};
+            if (!header.empty())
+                req.headers.set(header, value);
+            return std::pair{std::make_unique<Connection>(base), std::move(req)};
+        };
+
+        string etag;
+        {
+            INFO("Whole file");
+            auto [conn, req] = get("/files/big.txt");
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::OK);
+            CHECK(response.headers()["Content-Type"] == "text/plain; charset=utf-8");
+            CHECK(response.headers()["Content-Length"] == std::to_string(contents.size()));
+            CHECK(response.headers()["Accept-Ranges"] == "bytes");
+            CHECK(response.headers().contains("Last-Modified"));
+            etag = string(response.headers()["ETag"]);
+            CHECK(!etag.empty());
+            string body = AWAIT response.readAll();
+            CHECK(body == contents);
+        }
+        {
+            INFO("Conditional GET");
+            auto [conn, req] = get("/files/big.txt", "If-None-Match", etag);
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::NotModified);
+            CHECK(response.headers()["ETag"] == etag);
+        }
+        {
+            INFO("Range");
+            auto [conn, req] = get("/files/big.txt", "Range", "bytes=10-19");
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::PartialContent);
+            CHECK(response.headers()["Content-Range"]
+                  == "bytes 10-19/" + std::to_string(contents.size()));
+            string body = AWAIT response.readAll();
+            CHECK(body == contents.substr(10, 10));
+        }
+        {
+            INFO("Suffix range");
+            auto [conn, req] = get("/files/big.txt", "Range", "bytes=-5");
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::PartialContent);
+            string body = AWAIT response.readAll();
+            CHECK(body == contents.substr(contents.size() - 5));
+        }
+        {
+            INFO("Unsatisfiable range");
+            auto [conn, req] = get("/files/big.txt", "Range", "bytes=999999-");
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::RangeNotSatisfiable);
+            CHECK(response.headers()["Content-Range"] == "bytes */" + std::to_string(contents.size()));
+        }
+        {
+            INFO("Index file");
+            auto [conn, req] = get("/files/sub/");
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::OK);
+            CHECK(response.headers()["Content-Type"] == "text/html; charset=utf-8");
+            string body = AWAIT response.readAll();
+            CHECK(body == "<p>Hi</p>");
+        }
+        {
+            INFO("Directory redirect");
+            auto [conn, req] = get("/files/sub");
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::MovedPermanently);
+            CHECK(response.headers()["Location"] == "/files/sub/");
+        }
+        for (string_view path : {"/files/nope.txt", "/files/../etc/passwd", "/files/sub/%2e%2e/big.txt"}) {
+            INFO("Not found: " << path);
+            auto [conn, req] = get(string(path));
+            Response response = AWAIT conn->send(req);
+            CHECK(response.status() == Status::NotFound);
+        }
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+
+    io::fs::unlink((dir + "/sub/index.html").c_str());
+    io::fs::rmdir((dir + "/sub").c_str());
+    io::fs::unlink((dir + "/big.txt").c_str());
+    io::fs::rmdir(dir.c_str());
+}
+
+
+TEST_CASE("HTTP Response Cache", "[uv][http]") {
+    InitLogging();
+    ResponseCache cache({.maxSize = 500});  // (must outlive the server's Handlers)
+    auto test = [&]() -> Future<void> {
+        static int sCalls = 0;
+        auto counter = [](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+            string body = string(req.params["id"]) + ":" + std::to_string(++sCalls);
+            if (req.uri.query == "nostore")
+                res.writeHeader("Cache-Control", "no-store");
+            res.writeHeader("Content-Type", "application/octet-stream");
+            res.writeHeader("Content-Length", std::to_string(body.size()));
+            AWAIT res.writeToBody(std::move(body));
+            RETURN noerror;
+        };
+        Router router {
+            {Method::GET,  "/item/:id", counter},
+            {Method::POST, "/item/:id", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Length", "0");
+                RETURN noerror;
+            }},
+            {Method::GET,  "/dated", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Date", "Mon, 01 Jan 2001 00:00:00 GMT");
+                res.writeHeader("Content-Length", "0");
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router, [&](Handler& handler) {handler.setResponseCache(&cache);});
+        string base = server.url("");
+
+        auto send = [&](Method method, string uri) -> Future<string> {
+            Connection connection(base);
+            Request req {.method = method, .uri = std::move(uri)};
+            Response response = AWAIT connection.send(req);
+            CHECK(response.status() == Status::OK);
+            CHECK(response.headers().contains("Date"));
+            string body = AWAIT response.readAll();
+            RETURN body;
+        };
+
+        // The second request is answered from the cache:
+        string body;
+        body = AWAIT send(Method::GET, "/item/1");
+        CHECK(body == "1:1");
+        body = AWAIT send(Method::GET, "/item/1");
+        CHECK(body == "1:1");
+        CHECK(cache.stats().hits == 1);
+        CHECK(cache.stats().misses == 1);
+        CHECK(cache.count() == 1);
+
+        // The query is part of the key, and `no-store` responses aren't cached:
+        body = AWAIT send(Method::GET, "/item/1?nostore");
+        CHECK(body == "1:2");
+        body = AWAIT send(Method::GET, "/item/1?nostore");
+        CHECK(body == "1:3");
+        CHECK(cache.count() == 1);
+
+        // A POST invalidates the URI:
+        body = AWAIT send(Method::POST, "/item/1");
+        CHECK(body == "");
+        CHECK(cache.count() == 0);
+        body = AWAIT send(Method::GET, "/item/1");
+        CHECK(body == "1:4");
+        body = AWAIT send(Method::GET, "/item/1");
+        CHECK(body == "1:4");
+
+        // Filling the cache evicts the least recently used responses:
+        for (int i = 2; i <= 10; ++i)
+            body = AWAIT send(Method::GET, "/item/" + std::to_string(i));
+        CHECK(cache.stats().evictions > 0);
+        CHECK(cache.size() <= 500);
+        CHECK(cache.count() < 10);
+        body = AWAIT send(Method::GET, "/item/10");
+        CHECK(body == "10:13");
+        body = AWAIT send(Method::GET, "/item/1");
+        CHECK(body == "1:14");
+
+        // A handler's own Date header isn't cached; a cached response gets the current date:
+        auto hits = cache.stats().hits;
+        for (int i = 0; i < 2; ++i) {
+            Connection connection(base);
+            Request req {.method = Method::GET, .uri = "/dated"};
+            Response response = AWAIT connection.send(req);
+            string date(response.headers().get("Date"));
+            if (i == 0)
+                CHECK(date == "Mon, 01 Jan 2001 00:00:00 GMT");
+            else
+                CHECK(date.find("2001") == string::npos);
+            AWAIT response.readAll();
+        }
+        CHECK(cache.stats().hits == hits + 1);
+
+        cache.clear();
+        CHECK(cache.count() == 0);
+        CHECK(cache.size() == 0);
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("HTTP Admission Control", "[uv][http]") {
+    InitLogging();
+    io::AdmissionController admission({.maxConnections = 2, .maxLag = 0});
+    auto test = [&]() -> Future<void> {
+        Router router {
+            {Method::GET, "/slow", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                AWAIT Timer::sleep(0.1);
+                res.writeHeader("Content-Length", "0");
+                RETURN noerror;
+            }, 1},
+        };
+        TestHTTPServer server(router, [&](Handler& handler) {handler.setAdmissionController(&admission);});
+        server.tcpServer.setAdmissionController(&admission);
+        string base = server.url("");
+
+        auto get = [&](string uri) -> Future<Status> {
+            Connection connection(base);
+            Request req {.uri = std::move(uri)};
+            Response response = AWAIT connection.send(req);
+            (void) AWAIT response.readAll();
+            RETURN response.status();
+        };
+
+        // The route allows only one request at a time, so the second one is rejected:
+        Future<Status> first = get("/slow"), second = get("/slow");
+        Status status1 = AWAIT first, status2 = AWAIT second;
+        CHECK(std::min(status1, status2) == Status::OK);
+        CHECK(std::max(status1, status2) == Status::ServiceUnavailable);
+        CHECK(admission.stats().admittedRequests == 1);
+        CHECK(admission.stats().rejectedRequests == 1);
+        CHECK(admission.requests() == 0);
+
+        // Past the connection limit, new connections are closed right away:
+        std::shared_ptr<io::ISocket> sockets[3];
+        for (auto& socket : sockets) {
+            socket = io::ISocket::newSocket(false);
+            AWAIT socket->connect("127.0.0.1", server.port());
+            AWAIT socket->stream()->write(ConstBytes("GET /nope HTTP/1.1\r\nConnection: close\r\n\r\n"));
+        }
+        for (int i = 0; i < 3; ++i) {
+            string response = AWAIT sockets[i]->stream()->readAll();
+            CHECK(response.starts_with("HTTP/1.1 404") == (i < 2));
+        }
+        CHECK(admission.stats().refusedConnections == 1);
+        for (auto& socket : sockets)
+            AWAIT socket->close();
+
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+    CHECK(admission.connections() == 0);
+}
+
+
+TEST_CASE("Admission Control Lag", "[uv]") {
+    io::AdmissionController admission({.maxLag = 0.02, .sampleInterval = 0.01});
+    CHECK(!admission.overloaded());
+    CHECK(admission.admitRequest());
+    // Block the event loop to simulate overload:
+    Timer::after(0.005, [] {std::this_thread::sleep_for(std::chrono::milliseconds(100));});
+    Scheduler::current().runUntil([&] {return admission.lag() > 0.02;});
+    CHECK(admission.overloaded());
+    CHECK(!admission.admitRequest());
+    CHECK(!admission.shouldAccept());
+    CHECK(admission.stats().rejectedRequests == 1);
+}
+
+
+TEST_CASE("Admission Control Tickets", "[uv]") {
+    io::AdmissionController admission({.maxRequests = 1, .maxLag = 0});
+    auto ticket = admission.admitRequest();
+    CHECK(ticket);
+    CHECK(!admission.admitRequest());
+    // Moving a Ticket moves its slot, leaving the original empty:
+    auto moved = std::move(ticket);
+    CHECK(moved);
+    CHECK(!ticket);
+    CHECK(admission.requests() == 1);
+    moved.release();
+    CHECK(admission.requests() == 0);
+    CHECK(admission.admitRequest());
+}
+
+
+TEST_CASE("HTTP Handler Timeouts", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        Router router {
+            {Method::GET, "/", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                res.writeHeader("Content-Length", "3");
+                AWAIT res.writeToBody("Hi\n");
+                RETURN noerror;
+            }},
+            {Method::GET, "/slow", [](Handler::Request const&, Handler::Response& res) -> Future<void> {
+                AWAIT Timer::sleep(0.6);
+                res.writeHeader("Content-Length", "3");
+                AWAIT res.writeToBody("Hi\n");
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router, [](Handler& handler) {
+            handler.setTimeouts({.headers = 0.3, .body = 0.3, .idle = 0.3, .request = 0.4});
+        });
+        server.allowErrors = true;      // (timeouts make the Handlers fail)
+
+        auto& stats = Handler::timeoutStats();
+        uint64_t headers = stats.headers, idle = stats.idle, request = stats.request;
+
+        // Sends some bytes and returns everything the server sends before closing the socket:
+        auto exchange = [&](string_view send) -> Future<string> {
+            auto socket = io::ISocket::newSocket(false);
+            AWAIT socket->connect("127.0.0.1", server.port());
+            AWAIT socket->stream()->write(ConstBytes(send));
+            string response = AWAIT socket->stream()->readAll();
+            AWAIT socket->close();
+            RETURN response;
+        };
+
+        // A client that never finishes sending its headers is disconnected:
+        string response = AWAIT exchange("GET / HTTP/1.1\r\nHost: exa");
+        CHECK(response.empty());
+        CHECK(stats.headers == headers + 1);
+
+        // A kept-alive connection is closed after being idle:
+        response = AWAIT exchange("GET / HTTP/1.1\r\n\r\n");
+        CHECK(response.starts_with("HTTP/1.1 200 OK\r\n"));
+        CHECK(response.ends_with("\r\n\r\nHi\n"));
+        CHECK(stats.idle == idle + 1);
+
+        // A request that takes too long to handle is aborted:
+        response = AWAIT exchange("GET /slow HTTP/1.1\r\n\r\n");
+        CHECK(response.empty());
+        CHECK(stats.request == request + 1);
+
+        AWAIT server.close();        // waits for the slow handler to finish
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+#if CROUTON_USE_ZLIB
+TEST_CASE("WebSocket Compression", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        // An echo server:
+        Router router {
+            {Method::GET, "/ws", [](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                socket.setCompressionOptions({.noContextTakeover = true});
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                Generator<io::ws::Message> rcvr = socket.receive();
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr))
+                    AWAIT socket.send(*msg);     // (this echoes the Close message too)
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        string json;
+        for (int i = 0; i < 2000; ++i)
+            json += "{\"id\": " + std::to_string(i) + "},\n";
+        const string messages[] = {"Hi", json, json.substr(0, 1000), json};
+
+        for (bool compress : {true, false}) {
+            INFO("Client compression " << (compress ? "on" : "off"));
+            io::ws::ClientWebSocket client(server.wsURL("/ws"));
+            client.setCompressionOptions({.enabled = compress, .windowBits = 10});
+            AWAIT client.connect();
+            CHECK(client.isCompressed() == compress);
+            if (compress)
+                CHECK(client.responseHeaders()["Sec-WebSocket-Extensions"]
+                      == "permessage-deflate; server_no_context_takeover; client_max_window_bits=10");
+
+            Generator<io::ws::Message> rcvr = client.receive();
+            for (string const& message : messages) {
+                AWAIT client.send(ConstBytes(message), io::ws::Message::Text);
+                Result<io::ws::Message> msg = AWAIT rcvr;
+                REQUIRE(msg);
+                CHECK(msg->type == io::ws::Message::Text);
+                CHECK(*msg == message);
+            }
+
+            // Messages sent without waiting, from owned strings, must arrive in order:
+            Future<void> sent1 = client.send(string(json), io::ws::Message::Binary);
+            Future<void> sent2 = client.send(string("Bye"), io::ws::Message::Binary);
+            AWAIT sent1;
+            AWAIT sent2;
+            const string sent[] = {json, "Bye"};
+            for (string const& message : sent) {
+                Result<io::ws::Message> msg = AWAIT rcvr;
+                REQUIRE(msg);
+                CHECK(msg->type == io::ws::Message::Binary);
+                CHECK(*msg == message);
+            }
+
+            AWAIT client.send(io::ws::Message(io::ws::CloseCode::Normal, "bye"));
+            Result<io::ws::Message> msg = AWAIT rcvr;
+            REQUIRE(msg);
+            CHECK(msg->type == io::ws::Message::Close);
+            CHECK(client.readyToClose());
+            AWAIT client.close();
+        }
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+#endif // CROUTON_USE_ZLIB
+
+
+TEST_CASE("WebSocket Broadcast", "[uv][http]") {
+    InitLogging();
+    static constexpr size_t kNumClients = 3;
+    string json;
+    for (int i = 0; i < 2000; ++i)
+        json += "{\"id\": " + std::to_string(i) + "},\n";
+
+    auto test = [&]() -> Future<void> {
+        // A server that broadcasts a message once all the clients have connected:
+        std::vector<io::ws::ServerWebSocket*> sockets;
+        Router router {
+            {Method::GET, "/ws", [&](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                socket.setCompressionOptions({.noContextTakeover = true});
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                sockets.push_back(&socket);
+                if (sockets.size() == kNumClients) {
+                    auto msg = std::make_shared<io::ws::PreparedMessage>(ConstBytes(json),
+                                                                         io::ws::Message::Text,
+                                                                         io::ws::CompressionOptions{});
+                    CHECK(msg->isCompressed() == CROUTON_USE_ZLIB);
+                    CHECK(io::ws::ServerWebSocket::broadcast(msg, sockets) == kNumClients);
+                }
+                Generator<io::ws::Message> rcvr = socket.receive();
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr))
+                    AWAIT socket.send(*msg);     // (this echoes the Close message)
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        // Some clients use compression and some don't:
+        std::vector<std::unique_ptr<io::ws::ClientWebSocket>> clients;
+        for (size_t i = 0; i < kNumClients; ++i) {
+            auto client = std::make_unique<io::ws::ClientWebSocket>(
+                                server.wsURL("/ws"));
+            client->setCompressionOptions({.enabled = (i % 2 == 0)});
+            AWAIT client->connect();
+            clients.push_back(std::move(client));
+        }
+
+        for (auto& client : clients) {
+            Generator<io::ws::Message> rcvr = client->receive();
+            Result<io::ws::Message> msg = AWAIT rcvr;
+            REQUIRE(msg);
+            CHECK(msg->type == io::ws::Message::Text);
+            CHECK(*msg == json);
+
+            AWAIT client->send(io::ws::Message(io::ws::CloseCode::Normal, "bye"));
+            msg = AWAIT rcvr;
+            REQUIRE(msg);
+            CHECK(msg->type == io::ws::Message::Close);
+            AWAIT client->close();
+        }
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("WebSocket Coalescing", "[uv][http]") {
+    InitLogging();
+    static constexpr int kNumMessages = 100;
+    auto test = []() -> Future<void> {
+        // An echo server that coalesces its replies:
+        Router router {
+            {Method::GET, "/ws", [](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                socket.setCoalescing({.enabled = true});
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                Generator<io::ws::Message> rcvr = socket.receive();
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr))
+                    (void) socket.send(std::move(*msg));    // (this echoes the Close message)
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        io::ws::ClientWebSocket client(server.wsURL("/ws"));
+        client.setCoalescing({.enabled = true, .maxBytes = 1000, .maxDelay = 10});
+        AWAIT client.connect();
+
+        // Send a burst of small messages, and one too big to coalesce, without waiting:
+        string big(2000, 'x');
+        std::vector<Future<void>> sent;
+        for (int i = 0; i < kNumMessages; ++i) {
+            if (i == kNumMessages / 2)
+                sent.push_back(client.send(ConstBytes(big), io::ws::Message::Binary));
+            sent.push_back(client.send("Message #" + std::to_string(i), io::ws::Message::Text));
+        }
+        CHECK(client.bytesQueued() > 0);
+        // The long maxDelay would hold the last ones, but flush writes them now:
+        AWAIT client.flush();
+        for (auto& f : sent) {
+            CHECK(f.hasResult());
+            AWAIT f;
+        }
+
+        Generator<io::ws::Message> rcvr = client.receive();
+        for (int i = 0; i < kNumMessages; ++i) {
+            if (i == kNumMessages / 2) {
+                Result<io::ws::Message> msg = AWAIT rcvr;
+                REQUIRE(msg);
+                CHECK(*msg == big);
+            }
+            Result<io::ws::Message> msg = AWAIT rcvr;
+            REQUIRE(msg);
+            REQUIRE(*msg == "Message #" + std::to_string(i));
+        }
+
+        Future<void> closing = client.send(io::ws::Message(io::ws::CloseCode::Normal, "bye"));
+        AWAIT client.flush();
+        AWAIT closing;
+        Result<io::ws::Message> msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(msg->type == io::ws::Message::Close);
+        AWAIT client.close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("WebSocket Disconnect While Coalescing", "[uv][http]") {
+    InitLogging();
+    auto test = []() -> Future<void> {
+        Router router {
+            {Method::GET, "/ws", [](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                Generator<io::ws::Message> rcvr = socket.receive();
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr))
+                    ;
+                (void) AWAIT NoThrow(socket.close());
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+        server.allowErrors = true;      // (the client disconnects abruptly)
+
+        io::ws::ClientWebSocket client(server.wsURL("/ws"));
+        client.setCoalescing({.enabled = true, .maxBytes = 1000, .maxDelay = 10});
+        AWAIT client.connect();
+
+        // The long maxDelay holds these messages until the client disconnects, so they're never
+        // written, and their senders must be told so instead of waiting forever:
+        std::vector<Future<void>> sent;
+        for (int i = 0; i < 3; ++i)
+            sent.push_back(client.send("Message #" + std::to_string(i), io::ws::Message::Text));
+        CHECK(client.bytesQueued() > 0);
+        client.disconnect();
+        for (auto& f : sent) {
+            Result<void> result = AWAIT NoThrow(std::move(f));
+            CHECK(result.isError());
+            CHECK(result.error() == CroutonError::Disconnected);
+        }
+
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("WebSocket Receive Limits", "[uv][http]") {
+    InitLogging();
+    static constexpr int kNumMessages = 1000;
+    auto test = []() -> Future<void> {
+        // A server that sends a flood of messages without waiting:
+        Router router {
+            {Method::GET, "/ws", [](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                for (int i = 0; i < kNumMessages; ++i)
+                    (void) socket.send("Message #" + std::to_string(i), io::ws::Message::Text);
+                Generator<io::ws::Message> rcvr = socket.receive();
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr))
+                    AWAIT socket.send(*msg);     // (this echoes the Close message)
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        // A client with a tiny incoming queue still gets all the messages, in order:
+        io::ws::ClientWebSocket client(server.wsURL("/ws"));
+        client.setReceiveLimits({.maxQueuedMessages = 4, .maxQueuedBytes = 100});
+        AWAIT client.connect();
+        Generator<io::ws::Message> rcvr = client.receive();
+        for (int i = 0; i < kNumMessages; ++i) {
+            Result<io::ws::Message> msg = AWAIT rcvr;
+            REQUIRE(msg);
+            REQUIRE(*msg == "Message #" + std::to_string(i));
+            io::ws::WebSocket::recycle(std::move(*msg));
+        }
+
+        AWAIT client.send(io::ws::Message(io::ws::CloseCode::Normal, "bye"));
+        Result<io::ws::Message> msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(msg->type == io::ws::Message::Close);
+        AWAIT client.close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("WebSocket Streaming", "[uv][http]") {
+    InitLogging();
+    // A file bigger than `receive` accepts as a single message:
+    string dir = io::fs::mkdtemp("/tmp/crouton_ws_XXXXXX");
+    string path = dir + "/big.txt";
+    string contents;
+    for (int i = 0; contents.size() < 3'000'000; ++i)
+        contents += "Line " + std::to_string(i) + "\n";
+    std::ofstream(path) << contents;
+
+    // Reads a streamed message; returns its contents and the number of pieces it came in.
+    auto receiveStreamed = [](Generator<io::ws::Message>& rcvr) -> Future<std::pair<string,int>> {
+        string data;
+        int pieces = 0;
+        while (true) {
+            Result<io::ws::Message> msg = AWAIT rcvr;
+            REQUIRE(msg);
+            CHECK(msg->type == io::ws::Message::Binary);
+            data += *msg;
+            ++pieces;
+            if (!msg->partial)
+                break;
+        }
+        RETURN std::pair{data, pieces};
+    };
+
+    auto test = [&]() -> Future<void> {
+        // A server that streams a message back after it receives one:
+        Router router {
+            {Method::GET, "/ws", [&](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                Generator<io::ws::Message> rcvr = socket.receiveFragments();
+                auto [data, pieces] = AWAIT receiveStreamed(rcvr);
+                CHECK(data == contents);
+                CHECK(pieces > 1);
+
+                io::FileStream file(path);
+                AWAIT file.open();
+                AWAIT socket.sendStream(file);
+                AWAIT file.close();
+
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr))
+                    AWAIT socket.send(*msg);     // (this echoes the Close message)
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        io::ws::ClientWebSocket client(server.wsURL("/ws"));
+        AWAIT client.connect();
+        Generator<io::ws::Message> rcvr = client.receiveFragments();
+
+        io::FileStream file(path);
+        AWAIT file.open();
+        AWAIT client.sendStream(file);
+        AWAIT file.close();
+
+        auto [data, pieces] = AWAIT receiveStreamed(rcvr);
+        CHECK(data == contents);
+        CHECK(pieces > 1);
+
+        AWAIT client.send(io::ws::Message(io::ws::CloseCode::Normal, "bye"));
+        Result<io::ws::Message> msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(msg->type == io::ws::Message::Close);
+        AWAIT client.close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+    io::fs::unlink(path.c_str());
+    io::fs::rmdir(dir.c_str());
+}
+
+
+// A stream that returns `data` from its first `nReads` reads, then fails.
+struct FailingStream : public io::IStream {
+    explicit FailingStream(string data, int nReads) :_data(std::move(data)), _nReads(nReads) { }
+    bool isOpen() const override                {return true;}
+    Future<void> open() override                {return Future<void>();}
+    Future<void> close() override               {return Future<void>();}
+    Future<void> closeWrite() override          {return Future<void>();}
+    Future<ConstBytes> peekNoCopy() override    {return CroutonError::Unimplemented;}
+    Future<void> write(ConstBytes) override     {return CroutonError::Unimplemented;}
+    Future<ConstBytes> readNoCopy(size_t) override {
+        if (_nReads-- > 0)
+            return ConstBytes(_data);
+        return Error(CroutonError::Disconnected, "test stream failed");
+    }
+private:
+    string _data;
+    int    _nReads;
+};
+
+
+TEST_CASE("WebSocket Streaming Failure", "[uv][http]") {
+    InitLogging();
+    auto test = [&]() -> Future<void> {
+        Router router {
+            {Method::GET, "/ws", [&](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                Generator<io::ws::Message> rcvr = socket.receiveFragments();
+                // A stream that fails before anything is sent doesn't affect the socket:
+                FailingStream empty("", 0);
+                Result<void> sent = AWAIT NoThrow(socket.sendStream(empty));
+                CHECK(sent.isError());
+                AWAIT socket.send(string("hi"));
+                // But one that fails partway through a message makes it send a Close:
+                FailingStream partial("some data", 1);
+                sent = AWAIT NoThrow(socket.sendStream(partial));
+                CHECK(sent.isError());
+                sent = AWAIT NoThrow(socket.send(string("too late")));
+                CHECK(sent.isError());
+                Result<io::ws::Message> msg = AWAIT rcvr;     // the client's Close reply
+                REQUIRE(msg);
+                CHECK(msg->type == io::ws::Message::Close);
+                CHECK(socket.readyToClose());
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        io::ws::ClientWebSocket client(server.wsURL("/ws"));
+        AWAIT client.connect();
+        Generator<io::ws::Message> rcvr = client.receiveFragments();
+        Result<io::ws::Message> msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(*msg == "hi");
+        msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(msg->partial);
+        CHECK(*msg == "some data");
+        msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(msg->type == io::ws::Message::Close);
+        CHECK(msg->closeCode() == io::ws::CloseCode::CantFulfill);
+        AWAIT client.close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("WebSocket Streaming Large Frame", "[uv][http]") {
+    InitLogging();
+    // A single frame bigger than `receive` accepts as a message:
+    string contents;
+    for (int i = 0; contents.size() < 3'000'000; ++i)
+        contents += "Line " + std::to_string(i) + "\n";
+
+    auto test = [&]() -> Future<void> {
+        Router router {
+            {Method::GET, "/ws", [&](Handler::Request const& req, Handler::Response& res) -> Future<void> {
+                io::ws::ServerWebSocket socket;
+                if (! AWAIT socket.connect(req, res))
+                    RETURN noerror;
+                Generator<io::ws::Message> rcvr = socket.receiveFragments();
+                string data;
+                int pieces = 0;
+                Result<io::ws::Message> msg;
+                while ((msg = AWAIT rcvr) && msg->type == io::ws::Message::Binary) {
+                    data += *msg;
+                    ++pieces;
+                    if (!msg->partial)
+                        break;
+                }
+                CHECK(data == contents);
+                CHECK(pieces > 1);
+                AWAIT socket.send(io::ws::Message(io::ws::CloseCode::Normal, "thanks"));
+                while ((msg = AWAIT rcvr))
+                    ;
+                AWAIT socket.close();
+                RETURN noerror;
+            }},
+        };
+        TestHTTPServer server(router);
+
+        io::ws::ClientWebSocket client(server.wsURL("/ws"));
+        client.setCompressionOptions({.enabled = false});   // so the frame stays big
+        AWAIT client.connect();
+        Generator<io::ws::Message> rcvr = client.receive();
+        AWAIT client.send(ConstBytes(contents), io::ws::Message::Binary);
+
+        Result<io::ws::Message> msg = AWAIT rcvr;
+        REQUIRE(msg);
+        CHECK(msg->type == io::ws::Message::Close);    // (the client echoes it)
+        AWAIT client.close();
+        AWAIT server.close();
+        RETURN noerror;
+    };
+    test().waitForResult();
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
 TEST_CASE("HTTP GET", "[uv][http]") {
     auto test = []() -> Future<void> {
         Connection connection("http://example.com/");
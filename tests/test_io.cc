@@ -17,9 +17,14 @@
 //
 
 #include "tests.hh"
+#include "TestCerts.hh"
 #include "crouton/io/HTTPParser.hh"
 #include "crouton/io/apple/NWConnection.hh"
 #include "crouton/io/mbed/TLSSocket.hh"
+#include "crouton/io/TCPServer.hh"
+#include "io/WebSocketMask.hh"
+#include <cstring>
+#include <thread>
 
 #if defined(_WIN32)
 #   include <winsock2.h>
@@ -142,6 +147,115 @@ TEST_CASE("DNS lookup", "[uv]") {
 }
 
 
+TEST_CASE("DNS cache", "[uv]") {
+    RunCoroutine([]() -> Future<void> {
+        AddrInfo::clearCache();
+        auto& stats = AddrInfo::cacheStats();
+        uint64_t queries = stats.queries, coalesced = stats.coalesced;
+
+        // Concurrent lookups of the same name share one query:
+        Future<AddrInfo> f1 = AddrInfo::lookup("localhost", 80);
+        Future<AddrInfo> f2 = AddrInfo::lookup("localhost", 80);
+        AddrInfo a1 = AWAIT f1;
+        AddrInfo a2 = AWAIT f2;
+        CHECK(a1.primaryAddressString() == a2.primaryAddressString());
+        CHECK(stats.queries == queries + 1);
+        CHECK(stats.coalesced == coalesced + 1);
+
+        // Then the result is cached, but not for a different port:
+        uint64_t hits = stats.hits;
+        (void) AWAIT AddrInfo::lookup("localhost", 80);
+        CHECK(stats.hits == hits + 1);
+        CHECK(stats.queries == queries + 1);
+        (void) AWAIT AddrInfo::lookup("localhost", 8080);
+        CHECK(stats.queries == queries + 2);
+
+        // A stale result is returned while it's refreshed:
+        AddrInfo::setCacheOptions({.ttl = 0});
+        uint64_t staleHits = stats.staleHits;
+        (void) AWAIT AddrInfo::lookup("localhost", 80);
+        CHECK(stats.staleHits == staleHits + 1);
+        CHECK(stats.queries == queries + 3);
+        AWAIT Timer::sleep(0.5);    // let the refresh finish
+
+        AddrInfo::setCacheOptions({});
+        AddrInfo::clearCache();
+        RETURN noerror;
+    });
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("Happy Eyeballs", "[uv]") {
+    RunCoroutine([]() -> Future<void> {
+        AddrInfo addr = AWAIT AddrInfo::lookup("localhost", 80);
+        auto all = addr.allAddresses();
+        REQUIRE(!all.empty());
+        CHECK(std::find(all.begin(), all.end(), &addr.primaryAddress()) != all.end());
+
+        // "localhost" may resolve to ::1 first, but the server only listens on IPv4,
+        // so the IPv6 attempt fails and the IPv4 one has to win:
+        TCPServer server(0, "127.0.0.1");
+        server.listen([](std::shared_ptr<ISocket> client) { });
+        auto socket = ISocket::newSocket(false);
+        socket->bind("localhost", server.port());
+        AWAIT socket->open();
+        CHECK(socket->isOpen());
+        AWAIT socket->close();
+        server.close();
+        RETURN noerror;
+    });
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
+TEST_CASE("MemoryStream", "[io]") {
+    RunCoroutine([]() -> Future<void> {
+        auto [a, b] = MemoryStream::createPair();
+        string message = "Hello, in-memory world!";
+        Future<void> written = a->write(ConstBytes(message));
+        CHECK(!written.hasResult());
+
+        // The reader gets the writer's own buffer:
+        ConstBytes bytes = AWAIT b->readNoCopy(5);
+        CHECK((const char*)bytes.data() == message.data());
+        CHECK(a->bytesQueued() == message.size() - 5);
+        bytes = AWAIT b->readNoCopy();
+        CHECK(string_view((const char*)bytes.data(), bytes.size()) == "in-memory world!");
+        CHECK(a->bytesQueued() == 0);
+        // ...so the write isn't done until the reader is done with those bytes:
+        CHECK(!written.hasResult());
+        Future<ConstBytes> next = b->readNoCopy();
+        AWAIT written;
+        AWAIT a->closeWrite();
+        bytes = AWAIT next;
+        CHECK(bytes.empty());
+
+        // With a buffer, small writes complete right away, so both sides can write first:
+        auto [c, d] = MemoryStream::createPair(1024);
+        AWAIT c->write(string("ping"));
+        AWAIT d->write(string("pong"));
+        string got = AWAIT c->readString(4);
+        CHECK(got == "pong");
+        got = AWAIT d->readString(4);
+        CHECK(got == "ping");
+
+        // After the peer closes, reads get EOF and writes fail:
+        AWAIT c->close();
+        bytes = AWAIT d->readNoCopy();
+        CHECK(bytes.empty());
+        Result<void> result = AWAIT NoThrow(d->write(string("x")));
+        CHECK(result.isError());
+
+        AWAIT a->close();
+        AWAIT b->close();
+        AWAIT d->close();
+        RETURN noerror;
+    });
+    REQUIRE(Scheduler::current().assertEmpty());
+}
+
+
 TEST_CASE("Read a socket", "[uv]") {
     RunCoroutine([]() -> Future<void> {
         auto socket = ISocket::newSocket(false);
@@ -187,6 +301,224 @@ TEST_CASE("Read a TLS socket", "[uv]") {
 }
 
 
+TEST_CASE("TLS session resumption", "[uv]") {
+    RunCoroutine([]() -> Future<void> {
+        auto& stats = mbed::TLSSocket::sessionStats();
+        uint64_t lookups = stats.clientLookups, hits = stats.clientHits;
+        // The second connection to the same host and port offers the first one's session:
+        for (int i = 0; i < 2; ++i) {
+            auto tlsSock = mbed::TLSSocket::create();
+            tlsSock->bind("example.com", 443);
+            AWAIT tlsSock->open();
+            AWAIT tlsSock->stream()->close();
+        }
+        CHECK(stats.clientLookups == lookups + 2);
+        CHECK(stats.clientHits >= hits + 1);
+        RETURN noerror;
+    });
+}
+
+
+TEST_CASE("TCPServer TLS config", "[uv]") {
+    TCPServer server(0, "127.0.0.1");
+    // A TLS server needs a valid certificate and key:
+    CHECK_THROWS(server.useTLS({}));
+    CHECK_THROWS(server.useTLS({.identities = {{.certChain = "bogus", .privateKey = "bogus"}}}));
+}
+
+
+// A TLS server on a local port, whose connections echo back whatever their clients send.
+struct EchoTLSServer {
+    explicit EchoTLSServer(TLSServerConfig const& config)
+    :server(0, "127.0.0.1")
+    {
+        TrustTestCerts();
+        server.useTLS(config);
+        server.listen([this](std::shared_ptr<ISocket> client) {
+            connections.push_back(echo(std::move(client)));
+        });
+    }
+
+    uint16_t port()         {return server.port();}
+
+    // Stops listening, and waits for the accepted connections to end.
+    Future<void> close() {
+        server.close();
+        for (auto& connection : connections)
+            AWAIT connection;
+        RETURN noerror;
+    }
+
+    static Future<void> echo(std::shared_ptr<ISocket> client) {
+        auto stream = client->stream();
+        while (true) {
+            ConstBytes bytes = AWAIT stream->readNoCopy();
+            if (bytes.empty())
+                break;
+            AWAIT stream->write(bytes);
+        }
+        AWAIT stream->close();
+        RETURN noerror;
+    }
+
+    TCPServer               server;
+    std::vector<Future<void>> connections;
+};
+
+
+// Connects to a local EchoTLSServer, checks that it echoes a message, and disconnects.
+static Future<void> EchoOverTLS(uint16_t port, string hostName = "127.0.0.1") {
+    auto socket = mbed::TLSSocket::create();
+    socket->bind(hostName, port);
+    AWAIT socket->open();
+    auto stream = socket->stream();
+    string message = "Hello, " + hostName + "!";
+    AWAIT stream->write(message);
+    string reply = AWAIT stream->readString(message.size());
+    CHECK(reply == message);
+    AWAIT stream->close();
+    RETURN noerror;
+}
+
+
+TEST_CASE("TLS loopback", "[uv][tls]") {
+    for (bool offload : {false, true}) {
+        RunCoroutine([offload]() -> Future<void> {
+            EchoTLSServer server({
+                .identities = {{.certChain = kTestCertPEM, .privateKey = kTestKeyPEM}},
+                .offloadHandshakes = offload,
+            });
+            auto socket = mbed::TLSSocket::create();
+            socket->bind("127.0.0.1", server.port());
+            AWAIT socket->open();
+            CHECK(socket->isOpen());
+
+            // Send enough data to take many TLS records, a piece at a time:
+            auto stream = socket->stream();
+            string chunk(16 * 1024, 'x');
+            for (int i = 0; i < 16; ++i) {
+                chunk[0] = char('a' + i);
+                AWAIT stream->write(chunk);
+                string reply = AWAIT stream->readString(chunk.size());
+                CHECK(reply == chunk);
+            }
+
+            // A multi-buffer write, mixing buffers that are gathered and ones that aren't:
+            string head = "head:", body(5000, 'b'), tail = ":tail";
+            std::array<ConstBytes, 4> bufs {ConstBytes(head), ConstBytes(body), ConstBytes(tail),
+                                            ConstBytes(head)};
+            AWAIT stream->write(bufs.data(), bufs.size());
+            string reply = AWAIT stream->readString(head.size() + body.size() + tail.size()
+                                                    + head.size());
+            CHECK(reply == head + body + tail + head);
+            AWAIT stream->close();
+            AWAIT server.close();
+            RETURN noerror;
+        });
+    }
+}
+
+
+TEST_CASE("TLS server SNI", "[uv][tls]") {
+    RunCoroutine([]() -> Future<void> {
+        EchoTLSServer server({
+            .identities = {
+                {.certChain = kTestCertPEM, .privateKey = kTestKeyPEM},
+                {.hostName = "localhost",
+                 .certChain = kTestLocalhostCertPEM, .privateKey = kTestLocalhostKeyPEM},
+            },
+        });
+        // Each client verifies that the server's cert matches the host name it asked for:
+        AWAIT EchoOverTLS(server.port(), "127.0.0.1");     // the default identity
+        AWAIT EchoOverTLS(server.port(), "localhost");     // the second identity, via SNI
+        AWAIT server.close();
+        RETURN noerror;
+    });
+}
+
+
+TEST_CASE("TLS server session resumption", "[uv][tls]") {
+    // A client reconnecting to a server resumes its session, using a session ticket if it
+    // supports them, else the session ID in the server's cache:
+    for (bool tickets : {false, true}) {
+#if !defined(MBEDTLS_SSL_SESSION_TICKETS)
+        if (tickets)
+            break;
+#endif
+        RunCoroutine([tickets]() -> Future<void> {
+            EchoTLSServer server({
+                .identities = {{.certChain = kTestCertPEM, .privateKey = kTestKeyPEM}},
+            });
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+            auto clientConfig = mbed::TLSContext::defaultClientContext().config();
+            mbedtls_ssl_conf_session_tickets(clientConfig, tickets
+                                             ? MBEDTLS_SSL_SESSION_TICKETS_ENABLED
+                                             : MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+#endif
+            auto& stats = mbed::TLSSocket::sessionStats();
+            uint64_t hits = stats.serverHits;
+            AWAIT EchoOverTLS(server.port());       // a full handshake, since the port is new
+            CHECK(stats.serverHits == hits);
+            AWAIT EchoOverTLS(server.port());
+            CHECK(stats.serverHits == hits + 1);
+            AWAIT EchoOverTLS(server.port());
+            CHECK(stats.serverHits == hits + 2);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+            mbedtls_ssl_conf_session_tickets(clientConfig, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+            AWAIT server.close();
+            RETURN noerror;
+        });
+    }
+}
+
+
+TEST_CASE("TLS concurrent offloaded handshakes", "[uv][tls]") {
+    // Many handshakes running on the thread pool at once all sign with the server's key, each
+    // with its own copy of it, so they don't have to wait for each other.
+    RunCoroutine([]() -> Future<void> {
+        EchoTLSServer server({
+            .identities = {{.certChain = kTestCertPEM, .privateKey = kTestKeyPEM}},
+            .offloadHandshakes = true,
+        });
+        // Make every client do a full handshake:
+        mbed::TLSContext::defaultClientContext().sessionCache()
+            .remove("127.0.0.1:" + std::to_string(server.port()));
+        std::vector<Future<void>> clients;
+        for (int i = 0; i < 32; ++i)
+            clients.push_back(EchoOverTLS(server.port()));
+        for (auto& client : clients)
+            AWAIT client;
+        auto& stats = mbed::TLSSocket::handshakeStats();
+        CHECK(stats.offloadedSteps > 0);
+        if (std::thread::hardware_concurrency() > 1)
+            CHECK(stats.maxConcurrentSteps > 1);
+        AWAIT server.close();
+        RETURN noerror;
+    });
+}
+
+
+TEST_CASE("TLS handshake timeout", "[uv][tls]") {
+    RunCoroutine([]() -> Future<void> {
+        EchoTLSServer server({
+            .identities = {{.certChain = kTestCertPEM, .privateKey = kTestKeyPEM}},
+            .handshakeTimeout = 0.5,
+        });
+        // A client that connects but never starts the handshake gets disconnected:
+        auto socket = ISocket::newSocket(false);
+        AWAIT socket->connect("127.0.0.1", server.port());
+        auto start = std::chrono::steady_clock::now();
+        ConstBytes bytes = AWAIT socket->stream()->readNoCopy();
+        CHECK(bytes.empty());
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+        AWAIT socket->close();
+        AWAIT server.close();
+        RETURN noerror;
+    });
+}
+
+
 TEST_CASE("WebSocket", "[uv]") {
     auto test = []() -> Future<void> {
         ws::ClientWebSocket ws("wss://ws.postman-echo.com/raw");
@@ -228,6 +560,38 @@ TEST_CASE("WebSocket", "[uv]") {
 }
 
 
+TEST_CASE("WebSocket Masking", "[ws]") {
+    const std::byte mask[4] = {std::byte{0x12}, std::byte{0x34}, std::byte{0xAB}, std::byte{0xCD}};
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    std::vector<std::byte> input(1100);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = std::byte(i * 7);
+
+    // Compare each kernel with the obvious byte-at-a-time algorithm, at various sizes and
+    // alignments, copying, in place, and shifting down (as when removing a frame header.)
+    for (auto& kernel : ws::availableMaskKernels()) {
+        INFO("Kernel " << kernel.name);
+        for (size_t len : {0, 1, 3, 4, 15, 16, 17, 63, 64, 65, 127, 128, 129, 1000}) {
+            INFO("len " << len);
+            for (size_t offset = 0; offset < 8; ++offset) {
+                std::vector<std::byte> out(input.size());
+                kernel.apply(&out[offset], &input[16], len, mask32);
+                for (size_t i = 0; i < len; ++i)
+                    REQUIRE(out[offset + i] == (input[16 + i] ^ mask[i % 4]));
+
+                for (size_t shift : {0, 6, 14}) {
+                    std::vector<std::byte> buf = input;
+                    kernel.apply(&buf[16 + offset - shift], &buf[16 + offset], len, mask32);
+                    for (size_t i = 0; i < len; ++i)
+                        REQUIRE((buf[16 + offset - shift + i] ^ mask[i % 4]) == input[16 + offset + i]);
+                }
+            }
+        }
+    }
+}
+
+
 TEST_CASE("readdir", "[uv]") {
     cerr << "Dir is " << fs::realpath(".") << endl;
     auto dir = fs::readdir(".");
@@ -22,6 +22,7 @@
 #include "crouton/Producer.hh"
 #include "crouton/util/Relation.hh"
 #include "crouton/io/uv/UVBase.hh"
+#include "support/FastRandom.hh"
 
 
 void RunCoroutine(std::function<Future<void>()> test) {
@@ -44,6 +45,40 @@ TEST_CASE("Randomize") {
 }
 
 
+TEST_CASE("FastRandomize") {
+    // Different-sized requests share the generator's buffer:
+    uint8_t buf[300];
+    for (size_t len : {4, 4, 100, 300}) {
+        ::memset(buf, 0, sizeof(buf));
+        FastRandomize(buf, len);
+        CHECK(size_t(std::count(buf, buf + len, 0)) < len / 2 + 2);
+        CHECK(size_t(std::count(buf + len, buf + sizeof(buf), 0)) == sizeof(buf) - len);
+    }
+    uint8_t buf2[300];
+    FastRandomize(buf2, sizeof(buf2));
+    CHECK(::memcmp(buf, buf2, sizeof(buf)) != 0);
+}
+
+
+TEST_CASE("ChaCha20 block") {
+    // Test vector from RFC 8439 §2.3.2:
+    const uint32_t state[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,     // constants
+        0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,     // key 00:01:02:...:1f
+        0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+        0x00000001,                                         // block count
+        0x09000000, 0x4a000000, 0x00000000};                // nonce
+    const uint8_t expected[64] = {
+        0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+        0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+        0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+        0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e};
+    uint8_t out[64];
+    ChaCha20Block(state, out);
+    CHECK(::memcmp(out, expected, sizeof(out)) == 0);
+}
+
+
 TEST_CASE("Result") {
     Result<bool> result = true;
     CHECK(result.ok());